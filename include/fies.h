@@ -67,6 +67,7 @@ struct fies_time {
 
 /* Forward declaration */
 struct fies_packet;
+struct fies_alloc_range;
 
 /*! \defgroup FiesReaderGroup FiesReader methods.
  * @{
@@ -193,6 +194,20 @@ struct FiesReader_Funcs {
 
 	/*! \brief Optional: Debug callback for the fies packet stream. */
 	void     (*dbg_packet)(void *opaque, const struct fies_packet*);
+
+	/*! \brief Optional: Called with the data layout of a file before its
+	 * extents arrive, so space can be allocated up front.
+	 */
+	int      (*preallocate)(void *opaque,
+	                        void *fh,
+	                        fies_sz data_size,
+	                        const struct fies_alloc_range *ranges,
+	                        size_t count);
+
+	/*! \brief Optional: Called when a file which existed in the stream this
+	 * one is an update to has since been removed.
+	 */
+	int      (*unlink)    (void *opaque, const char *filename);
 };
 
 
@@ -297,6 +312,29 @@ int         FiesWriter_writeFile   (struct FiesWriter *self,
 int         FiesWriter_readRefFile (struct FiesWriter *self,
                                     struct FiesFile *handle);
 
+/*! \brief Also look for matching blocks at unaligned offsets. */
+#define FIES_DELTA_ROLLING 0x001
+
+/*! \brief Match the data of new files against the blocks of delta
+ * reference files.
+ * \param block_size A power of two between 512 bytes and 16 MiB.
+ * \param flags Zero or \c FIES_DELTA_ROLLING.
+ */
+int         FiesWriter_setDelta    (struct FiesWriter *self,
+                                    size_t block_size,
+                                    unsigned int flags);
+
+/*! \brief Like \c FiesWriter_readRefFile, but additionally index the file's
+ * data for \c FiesWriter_setDelta. The writer takes ownership of the handle
+ * (also on error) and reads from it until it is deleted.
+ */
+int         FiesWriter_readDeltaRefFile(struct FiesWriter *self,
+                                        struct FiesFile *handle);
+
+/*! \brief Tell the receiver that a previously sent file was removed. */
+int         FiesWriter_unlink      (struct FiesWriter *self,
+                                    const char *filename);
+
 /*! \brief Add a list of snapshots referencing a volume file. */
 int         FiesWriter_snapshots   (struct FiesWriter *self,
                                     struct FiesFile *file,
@@ -513,6 +551,8 @@ struct FiesFile_Extent {
 #define FIES_F_UNORDERED    0x00000002
 /*! \brief Incremental: Files should not be zero initialized. */
 #define FIES_F_INCREMENTAL  0x00000004
+/*! \brief Regular files carry a \c FIES_META_ALLOC allocation hint. */
+#define FIES_F_ALLOC_HINTS  0x00000008
 
 /*! \brief This tells FiesWriter_newFull not to write a fies_header. */
 #define FIES_F_RAW          0x80000000
@@ -539,6 +579,7 @@ struct fies_header {
 #define FIES_PACKET_EXTENT        4
 #define FIES_PACKET_FILE_END      5
 #define FIES_PACKET_SNAPSHOT_LIST 6
+#define FIES_PACKET_UNLINK        7
 
 struct fies_packet {
 	char magic[2];
@@ -633,6 +674,9 @@ struct fies_file_meta {
 
 /*! \brief TODO. */
 #define FIES_META_XATTR   ((uint32_t)5)
+
+/*! \brief The packet contains a \ref fies_meta_alloc . */
+#define FIES_META_ALLOC   ((uint32_t)6)
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wzero-length-array"
 /*! \brief File xattrs are name value pairs, data follows the size header. */
@@ -656,6 +700,24 @@ struct fies_meta_owner {
 /*! \brief Internal convenience macro. */
 #define FIES_META_TIME_SIZE FIES_TIME_SIZE
 
+/*! \brief Allocation hint found in \ref fies_file_meta packets, followed by
+ * \c count \ref fies_alloc_range entries.
+ */
+struct fies_meta_alloc {
+	fies_sz  data_size; /*!< \brief Number of bytes in the ranges. */
+	uint32_t count;     /*!< \brief Number of ranges following. */
+	uint32_t reserved;
+};
+
+/*! \brief A range of a file which will receive data. */
+struct fies_alloc_range {
+	fies_pos offset; /*!< \brief Range offset in bytes. */
+	fies_sz  length; /*!< \brief Range length in bytes. */
+};
+
+/*! \brief Writers list at most this many ranges in an allocation hint. */
+#define FIES_ALLOC_MAX_RANGES 1024
+
 /*! \brief File extent information and possibly followed by data to be written
  * to the file.
  */
@@ -678,6 +740,13 @@ struct fies_file_end {
 	fies_id file;
 };
 
+/*! \brief Removes a file, the name follows directly afterwards. */
+struct fies_unlink {
+	uint16_t name_length; /*!< \brief File name length. */
+	uint16_t reserved;
+	uint32_t reserved2;
+};
+
 struct fies_snapshot_list {
 	fies_id file;
 	uint16_t count;
@@ -887,6 +956,10 @@ struct fies_snapshot_entry {
  * \def FIES_PACKET_SNAPSHOT_LIST
  *   \brief Lists the existing snapshots of a file with their creation
  *   timestamp.
+ *
+ * \def FIES_PACKET_UNLINK
+ *   \brief Removes a file or an empty directory which is expected to exist
+ *   on the receiving side from an earlier stream.
  */
 
 /*! \struct fies_file_meta
@@ -40,11 +40,28 @@ struct FiesDMThin {
 	/*! \brief Data mapping btree start block. */
 	size_t data_mapping_root;
 
+	/*! \brief Device details btree start block. */
+	size_t details_root;
+
 	/*! \brief Callback to get a pointer to a block of meta data. */
 	FiesDMThin_getBlock_t *get_block_cb;
 
 	/*! \brief Callback to return a block to the user. */
 	FiesDMThin_putBlock_t *put_block_cb;
+
+	/*! \brief Optional callback announcing blocks needed soon. */
+	int (*prefetch_cb)(void *opaque, const uint64_t *block_numbers,
+	                   size_t count);
+
+	/*! \brief Query flags used when mapping, see
+	 * \ref FiesDMThin_setQueryFlags. */
+	uint32_t query_flags;
+
+	/*! \brief Cached reader of the data blocks' reference counts. */
+	struct FiesDMThin_SpaceMap *data_space_map;
+
+	/*! \brief Cached reader of the metadata blocks' reference counts. */
+	struct FiesDMThin_SpaceMap *metadata_space_map;
 };
 
 /*! \brief Create a new dmthin accessor instance. */
@@ -70,6 +87,146 @@ ssize_t FiesDMThin_mapExtents(struct FiesDMThin      *self,
                               struct FiesFile_Extent *out_extents,
                               size_t                  out_count);
 
+/*! \brief Iterator over the mappings of a device.
+ *
+ * Keeps the path to the current btree leaf entry between calls so that
+ * mapping a whole device reads each node only as often as it is passed.
+ * Only block numbers are kept, no blocks remain acquired between calls.
+ */
+struct FiesDMThin_Cursor;
+
+/*! \brief Create a cursor positioned at the start of a device. */
+struct FiesDMThin_Cursor* FiesDMThin_cursorNew(struct FiesDMThin *self,
+                                               uint32_t device);
+
+/*! \brief Destroy a cursor. */
+void FiesDMThin_cursorDelete(struct FiesDMThin_Cursor *cursor);
+
+/*! \brief The device a cursor iterates over. */
+uint32_t FiesDMThin_cursorDevice(const struct FiesDMThin_Cursor *cursor);
+
+/*! \brief The logical address up to which extents have been returned. */
+uint64_t FiesDMThin_cursorPosition(const struct FiesDMThin_Cursor *cursor);
+
+/*! \brief Reposition a cursor to a logical address. */
+int FiesDMThin_cursorSeek(struct FiesDMThin_Cursor *cursor, uint64_t logical);
+
+/*! \brief Map the next extents after the cursor's position.
+ * \return The number of extents, 0 at the end of the device, or a negative
+ * errno value.
+ */
+ssize_t FiesDMThin_cursorNext(struct FiesDMThin_Cursor *cursor,
+                              struct FiesFile_Extent   *out_extents,
+                              size_t                    out_count);
+
+/*! \brief Callback announcing metadata blocks which are about to be read. */
+typedef int FiesDMThin_loadBlocks_t(void *opaque,
+                                    const uint64_t *block_numbers,
+                                    size_t count);
+
+/*! \brief Walk all metadata blocks needed to map a device.
+ *
+ * The btree nodes are announced to \p load_cb one tree level at a time
+ * before they are requested via the get_block callback, so they can be
+ * read in large batches, eg. into a private copy.
+ * \return 0 on success, a negative errno value otherwise.
+ */
+int FiesDMThin_loadDevice(struct FiesDMThin       *self,
+                          uint32_t                 device,
+                          FiesDMThin_loadBlocks_t *load_cb);
+
+/*! \brief Announce btree nodes to \p prefetch_cb before they are needed.
+ *
+ * While iterating with a cursor, the children of internal nodes which are
+ * going to be visited are passed to the callback a window at a time, so they
+ * can be read ahead, eg. by multiple threads. Errors from the callback are
+ * ignored, the blocks are requested via the get_block callback as usual.
+ */
+void FiesDMThin_setPrefetch(struct FiesDMThin       *self,
+                            FiesDMThin_loadBlocks_t *prefetch_cb);
+
+/*! \brief Get the root block of a device's mapping tree.
+ *
+ * Devices are copy-on-write, so within one metadata snapshot devices with
+ * the same root have the same mappings. Once a snapshot is released its
+ * blocks may be reused, so a root from an earlier snapshot only hints that
+ * the device is unchanged, see \ref FiesDMThin_deviceDetails.
+ */
+int FiesDMThin_deviceRoot(struct FiesDMThin *self,
+                          uint32_t           device,
+                          uint64_t          *root);
+
+/*! \brief A device's entry in the pool's details tree. */
+struct FiesDMThin_DeviceDetails {
+	/*! \brief Number of mapped data blocks. */
+	uint64_t mapped_blocks;
+	/*! \brief The pool's transaction id when the device was created. */
+	uint64_t transaction_id;
+	/*! \brief The pool's time when the device was created. */
+	uint32_t creation_time;
+	/*! \brief The pool's time when the device was last snapshotted. */
+	uint32_t snapshotted_time;
+};
+
+/*! \brief Get the details of a device.
+ *
+ * Together with its root these tell whether a device changed between two
+ * metadata snapshots: recreating, snapshotting or provisioning a device
+ * changes them.
+ * \return 0 on success, a negative errno value otherwise.
+ */
+int FiesDMThin_deviceDetails(struct FiesDMThin               *self,
+                             uint32_t                         device,
+                             struct FiesDMThin_DeviceDetails *details);
+
+/*! \brief Callback receiving the extents of a \ref FiesDMThin_diff. */
+typedef int FiesDMThin_diff_t(void *opaque,
+                              const struct FiesFile_Extent *extent);
+
+/*! \brief Compare a device's mappings with an older mapping tree.
+ *
+ * Walks the device's tree next to the tree rooted at \p origin_root, which
+ * is usually the root of a snapshot the device was created from. Subtrees
+ * shared by both trees are skipped. Extents are passed to \p diff_cb in
+ * logical order. Mappings from the rest of the tree are passed as shared
+ * data extents. Ranges whose mappings are the same in both trees are passed
+ * with \c FIES_FL_COPY set and \c source.offset equal to the logical
+ * offset. The caller fills in \c source.file. Such ranges may include
+ * unmapped blocks, and the last one may extend to \c UINT64_MAX.
+ * \return 0 on success, a negative errno value otherwise.
+ */
+int FiesDMThin_diff(struct FiesDMThin *self,
+                    uint32_t           device,
+                    uint64_t           origin_root,
+                    FiesDMThin_diff_t *diff_cb,
+                    void              *opaque);
+
+/*! \brief Callback receiving the extents of \ref FiesDMThin_mapDevices.
+ * \param index The position of the device in the list of devices.
+ */
+typedef int FiesDMThin_mapDevices_t(void *opaque,
+                                    size_t index,
+                                    const struct FiesFile_Extent *extent);
+
+/*! \brief Map several devices in one walk over their mapping trees.
+ *
+ * The devices' trees are walked in the given order, and each btree node is
+ * read only once. Where a device's tree contains a subtree which was already
+ * walked for an earlier device, the range it covers is passed with
+ * \c FIES_FL_COPY set, \c source.file set to the index of that device and
+ * \c source.offset equal to the logical offset, as with
+ * \ref FiesDMThin_diff. All other mappings are passed as data extents
+ * without \c FIES_FL_SHARED. Data blocks shared by different leaves can
+ * only be told apart by their physical address. The extents of a device are
+ * passed in logical order, one device after the other.
+ * \return 0 on success, a negative errno value otherwise.
+ */
+int FiesDMThin_mapDevices(struct FiesDMThin       *self,
+                          const uint32_t          *devices,
+                          size_t                   count,
+                          FiesDMThin_mapDevices_t *map_cb,
+                          void                    *opaque);
+
 struct FiesDMThin_Extent {
 	/*! \brief Logical offset of the extent within the file. */
 	fies_pos logical;
@@ -79,13 +236,41 @@ struct FiesDMThin_Extent {
 	fies_sz length;
 	/*! \brief Flags describing the type of extent. */
 	uint32_t flags;
-	/*! \brief Reference count of the extent. */
+	/*! \brief Reference count of the extent's data blocks.
+	 *
+	 * Taken from the pool's live data space map, 0 if it is unknown.
+	 * While a metadata snapshot is mapped it may be higher than the
+	 * snapshot's own reference count, but never lower. Blocks
+	 * mapped via btree nodes shared with other devices may still have a
+	 * count of 1, their extents are marked \c FIES_FL_SHARED regardless.
+	 */
 	uint32_t refcount;
 };
 
+/*! \brief Look up the reference counts of mapped data blocks.
+ *
+ * Only extents whose data blocks are referenced more than once, either
+ * directly or through a shared btree node, are marked \c FIES_FL_SHARED.
+ * Without this flag every mapped extent is.
+ */
 #define FIES_DMTHIN_QUERY_REFCOUNTS (1<<0)
 
-/*! \brief Query information about a logical address range. */
+/*! \brief Set the query flags used by cursors, \ref FiesDMThin_mapExtents
+ * and \ref FiesDMThin_diff.
+ *
+ * With \ref FIES_DMTHIN_QUERY_REFCOUNTS, \ref FiesDMThin_loadDevice also
+ * announces the space map blocks needed to map the device. Affects cursors
+ * created afterwards.
+ */
+void FiesDMThin_setQueryFlags(struct FiesDMThin *self, uint32_t query_flags);
+
+/*! \brief Query information about a logical address range.
+ *
+ * Like \ref FiesDMThin_mapExtents with the given \p query_flags. Adjacent
+ * blocks are only merged into one extent if their flags and reference
+ * counts match.
+ * \return The number of extents or a negative errno value.
+ */
 ssize_t FiesDMThin_queryExtents(struct FiesDMThin        *self,
                                 uint32_t                  device,
                                 uint64_t                  logical,
@@ -0,0 +1,548 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fies.h"
+#include "fies_writer.h"
+#include "delta.h"
+#include "util.h"
+
+#define DELTA_NONE UINT32_MAX
+// Window over the data of the extent being sent.
+#define DELTA_MIN_BUFFER (1024*1024)
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	uint64_t strong;
+	fies_pos logical;
+	fies_pos physical;
+	uint32_t weak;
+	uint32_t source;
+	uint32_t next; // bucket chain
+} DeltaBlock;
+
+struct FiesDelta {
+	size_t block_size;
+	unsigned int flags;
+	VectorOf(FiesFile*) sources;
+	VectorOf(DeltaBlock) blocks;
+	uint32_t *buckets;
+	unsigned int bucket_bits;
+	unsigned char *buffer;
+	size_t capacity;
+	unsigned char *verify; // one block of reference data
+};
+
+// rsync's rolling checksum
+typedef struct {
+	uint32_t a;
+	uint32_t b;
+} DeltaWeak;
+#pragma clang diagnostic pop
+
+static inline void
+DeltaWeak_init(DeltaWeak *self, const unsigned char *data, size_t len)
+{
+	uint32_t a = 0, b = 0;
+	for (size_t i = 0; i != len; ++i) {
+		a += data[i];
+		b += a;
+	}
+	self->a = a;
+	self->b = b;
+}
+
+static inline void
+DeltaWeak_roll(DeltaWeak *self, unsigned char out, unsigned char in,
+               size_t len)
+{
+	self->a = self->a - out + in;
+	self->b = self->b - (uint32_t)len * out + self->a;
+}
+
+static inline uint32_t
+DeltaWeak_value(const DeltaWeak *self)
+{
+	return (self->a & 0xFFFF) | (self->b << 16);
+}
+
+// Block sizes are powers of two of at least 512 bytes.
+static uint64_t
+Delta_strong(const unsigned char *data, size_t len)
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+	for (size_t i = 0; i != len; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash ^= word * 0xbf58476d1ce4e5b9ULL;
+		hash = ((hash << 27) | (hash >> 37)) * 0x94d049bb133111ebULL;
+	}
+	return hash ^ (hash >> 31);
+}
+
+static inline size_t
+Delta_bucket(const FiesDelta *self, uint32_t weak)
+{
+	return (uint32_t)(weak * 0x9E3779B1u) >> (32 - self->bucket_bits);
+}
+
+static fies_ssz
+Delta_read(FiesFile *file, void *buffer, size_t length,
+           fies_pos logical, fies_pos physical)
+{
+	size_t done = 0;
+	while (done != length) {
+		fies_ssz got;
+		unsigned char *dst = (unsigned char*)buffer + done;
+		if (file->funcs->preadp)
+			got = file->funcs->preadp(file, dst, length - done,
+			                          logical + done,
+			                          physical + done);
+		else
+			got = file->funcs->pread(file, dst, length - done,
+			                         logical + done);
+		if (got < 0)
+			return got;
+		if (!got)
+			return -EIO; // the file shrunk
+		done += (size_t)got;
+	}
+	return (fies_ssz)done;
+}
+
+extern FiesDelta*
+FiesDelta_new(size_t block_size, unsigned int flags)
+{
+	if (block_size < 512 || (block_size & (block_size-1)) ||
+	    block_size > 16*1024*1024)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	FiesDelta *self = u_malloc0(sizeof(*self));
+	if (!self)
+		return NULL;
+	self->block_size = block_size;
+	self->flags = flags;
+	self->capacity = 4 * block_size;
+	if (self->capacity < DELTA_MIN_BUFFER)
+		self->capacity = DELTA_MIN_BUFFER;
+	self->buffer = malloc(self->capacity);
+	self->verify = malloc(block_size);
+	if (!self->buffer || !self->verify) {
+		free(self->buffer);
+		free(self->verify);
+		free(self);
+		errno = ENOMEM;
+		return NULL;
+	}
+	Vector_init_type(&self->sources, FiesFile*);
+	Vector_init_type(&self->blocks, DeltaBlock);
+	return self;
+}
+
+extern void
+FiesDelta_delete(FiesDelta *self)
+{
+	if (!self)
+		return;
+	FiesFile **file;
+	Vector_foreach(&self->sources, file)
+		FiesFile_close(*file);
+	Vector_destroy(&self->sources);
+	Vector_destroy(&self->blocks);
+	free(self->buckets);
+	free(self->buffer);
+	free(self->verify);
+	free(self);
+}
+
+extern bool
+FiesDelta_empty(const FiesDelta *self)
+{
+	return Vector_empty(&self->blocks);
+}
+
+static int
+Delta_rehash(FiesDelta *self, unsigned int bits)
+{
+	uint32_t *buckets = malloc(sizeof(*buckets) << bits);
+	if (!buckets)
+		return -ENOMEM;
+	memset(buckets, 0xFF, sizeof(*buckets) << bits);
+	free(self->buckets);
+	self->buckets = buckets;
+	self->bucket_bits = bits;
+
+	for (size_t i = 0; i != Vector_length(&self->blocks); ++i) {
+		DeltaBlock *blk = Vector_at(&self->blocks, i);
+		uint32_t *head = &buckets[Delta_bucket(self, blk->weak)];
+		blk->next = *head;
+		*head = (uint32_t)i;
+	}
+	return 0;
+}
+
+static int
+Delta_insert(FiesDelta *self, DeltaBlock *blk)
+{
+	size_t count = Vector_length(&self->blocks);
+	if (count == DELTA_NONE)
+		return -EFBIG;
+	if (!self->buckets || count >> self->bucket_bits) {
+		int rc = Delta_rehash(self, self->buckets ? self->bucket_bits+1
+		                                          : 10);
+		if (rc < 0)
+			return rc;
+	}
+	uint32_t *head = &self->buckets[Delta_bucket(self, blk->weak)];
+	for (uint32_t i = *head; i != DELTA_NONE;) {
+		const DeltaBlock *other = Vector_at(&self->blocks, i);
+		// Identical data (eg. zeroes) needs only one entry.
+		if (other->weak == blk->weak && other->strong == blk->strong)
+			return 0;
+		i = other->next;
+	}
+	blk->next = *head;
+	*head = (uint32_t)count;
+	Vector_push(&self->blocks, blk);
+	return 0;
+}
+
+// Index the blocks on the block grid within a run of data.
+static int
+Delta_indexRun(FiesDelta *self, FiesFile *file, uint32_t source,
+               fies_pos start, fies_pos end, fies_pos physical)
+{
+	const size_t bs = self->block_size;
+	fies_pos pos = FIES_ALIGN_UP(start, bs);
+	while (pos < end && end - pos >= bs) {
+		size_t len = FIES_ALIGN_DOWN(end - pos, bs);
+		if (len > self->capacity)
+			len = self->capacity;
+		fies_pos phys = physical + (pos - start);
+		fies_ssz got = Delta_read(file, self->buffer, len, pos, phys);
+		if (got < 0)
+			return (int)got;
+		for (size_t off = 0; off != len; off += bs) {
+			const unsigned char *data = self->buffer + off;
+			DeltaWeak weak;
+			DeltaWeak_init(&weak, data, bs);
+			DeltaBlock blk = {
+				.strong = Delta_strong(data, bs),
+				.logical = pos + off,
+				.physical = phys + off,
+				.weak = DeltaWeak_value(&weak),
+				.source = source,
+				.next = DELTA_NONE
+			};
+			int rc = Delta_insert(self, &blk);
+			if (rc < 0)
+				return rc;
+		}
+		pos += len;
+	}
+	return 0;
+}
+
+extern int
+FiesDelta_addSource(FiesDelta *self, FiesWriter *writer, FiesFile *file)
+{
+	if (!file->funcs->next_extents ||
+	    !(file->funcs->pread || file->funcs->preadp))
+	{
+		FiesFile_close(file);
+		return -ENOTSUP;
+	}
+	size_t source = Vector_length(&self->sources);
+	if (source >= DELTA_NONE) {
+		FiesFile_close(file);
+		return -EMFILE;
+	}
+	Vector_push(&self->sources, &file);
+
+	const size_t capacity = 1024;
+	FiesFile_Extent *exbuf = malloc(capacity * sizeof(*exbuf));
+	if (!exbuf)
+		return -ENOMEM;
+
+	// Consecutive data extents are indexed as one run so that blocks
+	// crossing extent boundaries are found as well.
+	fies_pos run_start = 0, run_end = 0, run_physical = 0;
+	const fies_sz filesize = file->filesize;
+	fies_pos at = 0;
+	int rc = 0;
+	while (at < filesize) {
+		fies_ssz count = file->funcs->next_extents(file, writer, at,
+		                                           exbuf, capacity);
+		if (count <= 0) {
+			rc = (int)count;
+			break;
+		}
+		fies_pos next = at;
+		for (size_t i = 0; i != (size_t)count && rc == 0; ++i) {
+			const FiesFile_Extent *ex = &exbuf[i];
+			if (ex->logical >= filesize)
+				break;
+			fies_pos end = ex->logical + ex->length;
+			if (end > filesize)
+				end = filesize;
+			next = end;
+			if ((ex->flags & FIES_FL_EXTYPE_MASK) != FIES_FL_DATA) {
+				rc = Delta_indexRun(self, file, (uint32_t)source,
+				                    run_start, run_end,
+				                    run_physical);
+				run_start = run_end = end;
+				continue;
+			}
+			if (run_end > run_start && ex->logical == run_end &&
+			    ex->physical == run_physical + (run_end - run_start))
+			{
+				run_end = end;
+				continue;
+			}
+			rc = Delta_indexRun(self, file, (uint32_t)source,
+			                    run_start, run_end, run_physical);
+			run_start = ex->logical;
+			run_end = end;
+			run_physical = ex->physical;
+		}
+		if (rc < 0 || next <= at)
+			break;
+		at = next;
+	}
+	if (rc == 0)
+		rc = Delta_indexRun(self, file, (uint32_t)source,
+		                    run_start, run_end, run_physical);
+	free(exbuf);
+	return rc;
+}
+
+// Returns 1 and the block if the data at hand is found in a reference file.
+static int
+Delta_find(FiesDelta *self, uint32_t weak, const unsigned char *data,
+           const DeltaBlock **out)
+{
+	const size_t bs = self->block_size;
+	if (!self->buckets)
+		return 0;
+	bool have_strong = false;
+	uint64_t strong = 0;
+	uint32_t i = self->buckets[Delta_bucket(self, weak)];
+	while (i != DELTA_NONE) {
+		const DeltaBlock *blk = Vector_at(&self->blocks, i);
+		i = blk->next;
+		if (blk->weak != weak)
+			continue;
+		if (!have_strong) {
+			strong = Delta_strong(data, bs);
+			have_strong = true;
+		}
+		if (blk->strong != strong)
+			continue;
+		FiesFile **src = Vector_at(&self->sources, blk->source);
+		fies_ssz got = Delta_read(*src, self->verify, bs,
+		                          blk->logical, blk->physical);
+		if (got < 0)
+			return (int)got;
+		if (memcmp(self->verify, data, bs) != 0)
+			continue;
+		*out = blk;
+		return 1;
+	}
+	return 0;
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	FiesDelta *delta;
+	FiesFile *file;
+	fies_pos logical;
+	fies_pos physical;
+	fies_pos end;
+
+	fies_pos buf_pos;   // file offset of the buffer
+	size_t buf_len;
+	fies_pos data_pos;  // start of data not sent yet
+
+	fies_pos copy_pos;  // pending copy, merged with adjacent matches
+	fies_sz copy_len;
+	fies_id copy_file;
+	fies_pos copy_src;
+
+	FiesDelta_for_data *for_data;
+	FiesDelta_for_copy *for_copy;
+	void *opaque;
+} DeltaSend;
+#pragma clang diagnostic pop
+
+static int
+DeltaSend_flushCopy(DeltaSend *self)
+{
+	if (!self->copy_len)
+		return 0;
+	fies_sz len = self->copy_len;
+	self->copy_len = 0;
+	return self->for_copy(self->opaque, self->copy_pos, len,
+	                      self->copy_file, self->copy_src);
+}
+
+static int
+DeltaSend_flushData(DeltaSend *self, fies_pos upto)
+{
+	if (upto <= self->data_pos)
+		return 0;
+	int rc = DeltaSend_flushCopy(self);
+	if (rc < 0)
+		return rc;
+	const unsigned char *data = self->delta->buffer +
+	                            (self->data_pos - self->buf_pos);
+	rc = self->for_data(self->opaque, self->data_pos,
+	                    upto - self->data_pos, data);
+	self->data_pos = upto;
+	return rc;
+}
+
+// Make sure the buffer contains the data up to `need`, keeping the data not
+// sent yet, unless it has to be sent to make room.
+static int
+DeltaSend_fill(DeltaSend *self, fies_pos pos, fies_pos need)
+{
+	FiesDelta *delta = self->delta;
+	if (need <= self->buf_pos + self->buf_len)
+		return 0;
+	if (need - self->data_pos > delta->capacity) {
+		int rc = DeltaSend_flushData(self, pos);
+		if (rc < 0)
+			return rc;
+	}
+	size_t drop = self->data_pos - self->buf_pos;
+	if (drop) {
+		self->buf_len -= drop;
+		memmove(delta->buffer, delta->buffer + drop, self->buf_len);
+		self->buf_pos = self->data_pos;
+	}
+	fies_pos from = self->buf_pos + self->buf_len;
+	size_t len = delta->capacity - self->buf_len;
+	if (len > self->end - from)
+		len = self->end - from;
+	fies_ssz got = Delta_read(self->file, delta->buffer + self->buf_len,
+	                          len, from,
+	                          self->physical + (from - self->logical));
+	if (got < 0)
+		return (int)got;
+	self->buf_len += len;
+	return 0;
+}
+
+static int
+DeltaSend_copy(DeltaSend *self, fies_pos pos, const DeltaBlock *blk)
+{
+	int rc = DeltaSend_flushData(self, pos);
+	if (rc < 0)
+		return rc;
+	const size_t bs = self->delta->block_size;
+	FiesFile **src = Vector_at(&self->delta->sources, blk->source);
+	fies_id file = (*src)->fileid;
+	if (self->copy_len &&
+	    self->copy_pos + self->copy_len == pos &&
+	    self->copy_file == file &&
+	    self->copy_src + self->copy_len == blk->logical)
+	{
+		self->copy_len += bs;
+	} else {
+		rc = DeltaSend_flushCopy(self);
+		if (rc < 0)
+			return rc;
+		self->copy_pos = pos;
+		self->copy_len = bs;
+		self->copy_file = file;
+		self->copy_src = blk->logical;
+	}
+	self->data_pos = pos + bs;
+	return 0;
+}
+
+extern int
+FiesDelta_send(FiesDelta *self,
+               FiesFile *file,
+               fies_pos logical,
+               fies_sz length,
+               fies_pos physical,
+               FiesDelta_for_data *for_data,
+               FiesDelta_for_copy *for_copy,
+               void *opaque)
+{
+	DeltaSend s = {
+		.delta = self,
+		.file = file,
+		.logical = logical,
+		.physical = physical,
+		.end = logical + length,
+		.buf_pos = logical,
+		.buf_len = 0,
+		.data_pos = logical,
+		.copy_len = 0,
+		.for_data = for_data,
+		.for_copy = for_copy,
+		.opaque = opaque
+	};
+	const size_t bs = self->block_size;
+	const bool rolling = !!(self->flags & FIES_DELTA_ROLLING);
+	const fies_pos end = s.end;
+
+	int rc;
+	DeltaWeak weak;
+	bool have_weak = false;
+	fies_pos pos = rolling ? logical : FIES_ALIGN_UP(logical, bs);
+	while (pos < end && end - pos >= bs) {
+		// With a rolling checksum the next byte is needed as well.
+		fies_pos need = pos + bs;
+		if (rolling && need < end)
+			++need;
+		rc = DeltaSend_fill(&s, pos, need);
+		if (rc < 0)
+			return rc;
+		const unsigned char *data = self->buffer + (pos - s.buf_pos);
+		if (!have_weak) {
+			DeltaWeak_init(&weak, data, bs);
+			have_weak = true;
+		}
+		const DeltaBlock *blk;
+		rc = Delta_find(self, DeltaWeak_value(&weak), data, &blk);
+		if (rc < 0)
+			return rc;
+		if (rc) {
+			rc = DeltaSend_copy(&s, pos, blk);
+			if (rc < 0)
+				return rc;
+			pos += bs;
+			have_weak = false;
+		} else if (!rolling) {
+			pos += bs;
+			have_weak = false;
+		} else if (pos + bs == end) {
+			break;
+		} else {
+			DeltaWeak_roll(&weak, data[0], data[bs], bs);
+			++pos;
+		}
+	}
+
+	// Whatever is left was not found.
+	while (s.data_pos < end) {
+		if (s.data_pos == s.buf_pos + s.buf_len) {
+			rc = DeltaSend_fill(&s, s.data_pos, end);
+			if (rc < 0)
+				return rc;
+		}
+		rc = DeltaSend_flushData(&s, s.buf_pos + s.buf_len);
+		if (rc < 0)
+			return rc;
+	}
+	return DeltaSend_flushCopy(&s);
+}
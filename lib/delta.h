@@ -0,0 +1,38 @@
+#ifndef FIES_SRC_DELTA_H
+#define FIES_SRC_DELTA_H
+
+#include "../include/fies.h"
+
+#include "vector.h"
+
+// Block matching against the data of reference files, for data which does not
+// share physical extents with them (eg. independent copies of an image).
+// Reference files are split into blocks indexed by an rsync style weak rolling
+// checksum and a stronger 64 bit hash. Data of new files is then looked up
+// block by block, either on the block grid only or, with FIES_DELTA_ROLLING,
+// at every byte offset. Matches are verified against the reference data before
+// they are turned into copy extents.
+
+typedef struct FiesDelta FiesDelta;
+
+FiesDelta* FiesDelta_new(size_t block_size, unsigned int flags);
+void FiesDelta_delete(FiesDelta*);
+bool FiesDelta_empty(const FiesDelta*);
+
+// Takes ownership of the file.
+int FiesDelta_addSource(FiesDelta*, struct FiesWriter*, struct FiesFile*);
+
+typedef int FiesDelta_for_data(void *opaque, fies_pos pos, fies_sz len,
+                               const void *data);
+typedef int FiesDelta_for_copy(void *opaque, fies_pos pos, fies_sz len,
+                               fies_id file, fies_pos logical);
+int FiesDelta_send(FiesDelta*,
+                   struct FiesFile *file,
+                   fies_pos logical,
+                   fies_sz length,
+                   fies_pos physical,
+                   FiesDelta_for_data *for_data,
+                   FiesDelta_for_copy *for_copy,
+                   void *opaque);
+
+#endif
@@ -454,6 +454,33 @@ FiesReader_handleFileMeta(FiesReader *self)
 		                                name+namelen+1, valuelen);
 		break;
 	}
+	case FIES_META_ALLOC: {
+		const struct fies_meta_alloc *alloc = (const void*)(pmeta+1);
+		if (self->pkt_size < sizeof(*pmeta) + sizeof(*alloc))
+			FiesReader_throw(self, EINVAL, "bad allocation hint");
+		size_t count = (size_t)FIES_LE(alloc->count);
+		if (count > FIES_ALLOC_MAX_RANGES)
+			FiesReader_throw(self, EINVAL,
+			                 "too many ranges in allocation hint");
+		FiesReader_assertMetaSize(self, sizeof(*alloc) +
+		                          count * sizeof(struct fies_alloc_range));
+		if (!self->funcs->preallocate || !file->opaque)
+			break;
+		struct fies_alloc_range *ranges =
+			malloc((count ? count : 1) * sizeof(*ranges));
+		if (!ranges)
+			FiesReader_throw(self, errno, "allocation failed");
+		memcpy(ranges, alloc+1, count * sizeof(*ranges));
+		for (size_t i = 0; i != count; ++i) {
+			SwapLE(ranges[i].offset);
+			SwapLE(ranges[i].length);
+		}
+		retval = self->funcs->preallocate(self->opaque, file->opaque,
+		                                  FIES_LE(alloc->data_size),
+		                                  ranges, count);
+		free(ranges);
+		break;
+	}
 	}
 
 done:
@@ -853,6 +880,35 @@ FiesReader_getSnapshotList(FiesReader *self)
 	return FiesReader_readSnapshotList(self);
 }
 
+static int
+FiesReader_getUnlink(FiesReader *self)
+{
+	int rc = FiesReader_bufferAtLeast(self, self->pkt_size);
+	if (rc < 0)
+		return rc;
+
+	const struct fies_unlink *unl = FiesReader_data(self);
+	const size_t namelen = FIES_LE(unl->name_length);
+	const char *name = (const char*)(unl+1);
+	if (!namelen || sizeof(*unl) + namelen != self->pkt_size)
+		FiesReader_throw(self, EINVAL, "bad unlink packet size");
+	if (strnlen(name, namelen) != namelen)
+		FiesReader_throw(self, EINVAL, "file name length mismatch");
+	if (!self->funcs->unlink)
+		FiesReader_throw(self, ENOTSUP, "cannot remove files");
+
+	char *filename = strndup(name, namelen);
+	if (!filename)
+		FiesReader_throw(self, ENOMEM, "allocation failed");
+	rc = self->funcs->unlink(self->opaque, filename);
+	free(filename);
+	if (rc < 0)
+		FiesReader_throw(self, -rc, "failed to remove file");
+
+	FiesReader_eat(self, self->pkt_size, FR_State_Begin);
+	return 0;
+}
+
 static int
 FiesReader_readPacket(FiesReader *self)
 {
@@ -922,6 +978,16 @@ FiesReader_readPacket(FiesReader *self)
 		self->state = FR_State_SnapshotList;
 		return FiesReader_getSnapshotList(self);
 
+	case FIES_PACKET_UNLINK:
+		if (self->pkt_size < sizeof(struct fies_unlink) ||
+		    self->pkt_size > sizeof(struct fies_unlink) + 0xFFFF)
+		{
+			FiesReader_throw(self, EINVAL,
+			                 "Invalid unlink packet size");
+		}
+		self->state = FR_State_Unlink;
+		return FiesReader_getUnlink(self);
+
 	case FIES_PACKET_INVALID:
 	default:
 		FiesReader_throw(self, EINVAL, "Invalid packet type");
@@ -1033,6 +1099,9 @@ FiesReader_iterate(FiesReader *self)
 		case FR_State_SnapshotList_Read:
 			rc = FiesReader_readSnapshotList(self);
 			break;
+		case FR_State_Unlink:
+			rc = FiesReader_getUnlink(self);
+			break;
 		case FR_State_Botched:
 			FiesReader_throw(self, EFAULT, "FiesReader botched");
 		}
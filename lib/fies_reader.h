@@ -14,6 +14,7 @@ typedef enum {
 	FR_State_FileMeta_Do,
 	FR_State_FileEnd,
 	FR_State_SnapshotList,
+	FR_State_Unlink,
 #if 0
 	FR_State_FileClose,
 #endif
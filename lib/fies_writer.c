@@ -162,6 +162,8 @@ FiesWriter_delete(FiesWriter *self)
 	if (self->funcs->finalize)
 		self->funcs->finalize(self->opaque);
 	free(self->sendbuffer);
+	FiesBtrfsCache_delete(self->btrfs);
+	FiesDelta_delete(self->delta);
 	Vector_destroy(&self->free_devices);
 	Map_destroy(&self->devices);
 	Map_destroy(&self->osdevs);
@@ -544,6 +546,84 @@ FiesWriter_sendMetaXAttrs(FiesWriter *self, FiesFile *file, fies_id fileid)
 	return retval;
 }
 
+// Map the first batch of the file's extents ahead of time to tell the receiver
+// which ranges will be written, so it can allocate them contiguously before
+// the data arrives. The batch is left in `exbuf` for sending the data.
+static int
+FiesWriter_sendMetaAlloc(FiesWriter *self, FiesFile *file, fies_id fileid,
+                         FiesFile_Extent *exbuf, size_t capacity,
+                         size_t *mapped)
+{
+	if (!(self->flags & FIES_F_ALLOC_HINTS) ||
+	    !FIES_M_HAS_EXTENTS(file->mode) ||
+	    !file->funcs->next_extents || !exbuf)
+	{
+		return 0;
+	}
+
+	ssize_t got = file->funcs->next_extents(file, self, 0,
+	                                        exbuf, capacity);
+	if (got < 0)
+		return (int)got;
+	*mapped = (size_t)got;
+
+	struct fies_alloc_range *ranges =
+		malloc(FIES_ALLOC_MAX_RANGES * sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	// Only the listed ranges are counted, later ones are left to the
+	// receiver's usual allocation.
+	const fies_sz filesize = file->filesize;
+	fies_sz data_size = 0;
+	uint32_t count = 0;
+	for (size_t i = 0; i != (size_t)got; ++i) {
+		const FiesFile_Extent *ex = &exbuf[i];
+		if (ex->logical >= filesize)
+			break;
+		fies_sz len = ex->length;
+		if (len > filesize - ex->logical)
+			len = filesize - ex->logical;
+		uint32_t type = ex->flags & FIES_FL_EXTYPE_MASK;
+		if (type != FIES_FL_DATA)
+			continue;
+		if (count &&
+		    ranges[count-1].offset + ranges[count-1].length
+		      == ex->logical)
+		{
+			ranges[count-1].length += len;
+		} else if (count != FIES_ALLOC_MAX_RANGES) {
+			ranges[count].offset = ex->logical;
+			ranges[count].length = len;
+			++count;
+		} else {
+			break;
+		}
+		data_size += len;
+	}
+
+	for (uint32_t i = 0; i != count; ++i) {
+		SwapLE(ranges[i].offset);
+		SwapLE(ranges[i].length);
+	}
+	struct fies_file_meta meta = {
+		FIES_LE(FIES_META_ALLOC),
+		FIES_LE(fileid)
+	};
+	struct fies_meta_alloc head = {
+		.data_size = FIES_LE(data_size),
+		.count = FIES_LE(count),
+		.reserved = 0
+	};
+	int retval = FiesWriter_putPacket(self, FIES_PACKET_FILE_META,
+	                                  &meta, sizeof(meta),
+	                                  &head, sizeof(head),
+	                                  ranges, count * sizeof(*ranges),
+	                                  NULL);
+	free(ranges);
+	return retval;
+}
+
 static int
 FiesWriter_sendMetaEnd(FiesWriter *self, fies_id fileid)
 {
@@ -560,7 +640,9 @@ FiesWriter_sendFileMeta(FiesWriter *self,
                         FiesFile *file,
                         fies_id fileid,
                         const char *filename, size_t filenamelen,
-                        const char *linkdest, size_t linkdestlen)
+                        const char *linkdest, size_t linkdestlen,
+                        FiesFile_Extent *exbuf, size_t capacity,
+                        size_t *mapped)
 {
 	int rc = FiesWriter_sendFileHeader(self, file, fileid, file->mode,
 	                                   filename, filenamelen,
@@ -581,6 +663,11 @@ FiesWriter_sendFileMeta(FiesWriter *self,
 	if (rc < 0 && rc != -ENOTSUP && rc != -EOPNOTSUPP)
 		return rc;
 
+	rc = FiesWriter_sendMetaAlloc(self, file, fileid,
+	                              exbuf, capacity, mapped);
+	if (rc < 0 && rc != -ENOTSUP && rc != -EOPNOTSUPP)
+		return rc;
+
 	rc = FiesWriter_sendMetaEnd(self, fileid);
 	if (rc < 0)
 		return rc;
@@ -646,6 +733,33 @@ typedef struct {
 } FiesWriter_sendExtent_capture;
 #pragma clang diagnostic pop
 
+static int
+FiesWriter_sendExtent_forAvail(void *opaque, fies_pos pos, fies_sz len,
+                               fies_id src_file, fies_pos src_pos);
+
+// Data already read by the delta matcher.
+static int
+FiesWriter_sendExtent_data(void *opaque,
+                           fies_pos logical,
+                           fies_sz len,
+                           const void *data)
+{
+	FiesWriter_sendExtent_capture *cap = opaque;
+	struct fies_extent fex = {
+		FIES_LE(cap->fileid),
+		FIES_LE((uint32_t)FIES_FL_DATA),
+		FIES_LE(logical),
+		FIES_LE(len)
+	};
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcast-qual"
+	return FiesWriter_putPacket(cap->self, FIES_PACKET_EXTENT,
+	                            &fex, sizeof(fex),
+	                            (void*)data, (size_t)len,
+	                            NULL);
+#pragma clang diagnostic pop
+}
+
 static int
 FiesWriter_sendExtent_forNew(void *opaque,
                              fies_pos logical,
@@ -689,6 +803,14 @@ FiesWriter_sendExtent_forNew(void *opaque,
 		return FiesWriter_putPacket(cap->self, FIES_PACKET_EXTENT,
 		                            &fex, sizeof(fex), NULL);
 
+	if (cap->self->delta && !FiesDelta_empty(cap->self->delta)) {
+		return FiesDelta_send(cap->self->delta, cap->file,
+		                      logical, len, physical,
+		                      &FiesWriter_sendExtent_data,
+		                      &FiesWriter_sendExtent_forAvail,
+		                      cap);
+	}
+
 	struct fies_packet pkt = {
 		.magic    = FIES_PACKET_HDR_MAGIC,
 		.type     = FIES_PACKET_EXTENT,
@@ -931,6 +1053,16 @@ FiesWriter_writeFileDo(FiesWriter *self, FiesFile *file, bool ref_file)
 
 	fies_id fileid = FiesWriter_registerFile(self, file);
 
+	const size_t capacity = 8*1024;
+	FiesFile_Extent *exbuf = NULL;
+	size_t mapped = 0;
+	if (FIES_M_HAS_EXTENTS(file->mode)) {
+		exbuf = malloc(capacity * sizeof(*exbuf));
+		if (!exbuf)
+			return FiesWriter_setError(self, ENOMEM,
+			                           "failed to allocate memory");
+	}
+
 	if (ref_file) {
 		retval = FiesWriter_sendFileHeader(self, file, file->fileid,
 		                                   FIES_M_FREF,
@@ -939,28 +1071,34 @@ FiesWriter_writeFileDo(FiesWriter *self, FiesFile *file, bool ref_file)
 	} else {
 		retval = FiesWriter_sendFileMeta(self, file, fileid,
 		                                 file->filename, filenamelen,
-		                                 file->linkdest, linkdestlen);
+		                                 file->linkdest, linkdestlen,
+		                                 exbuf, capacity, &mapped);
 	}
-	if (retval < 0)
+	if (retval < 0) {
+		free(exbuf);
 		return retval;
+	}
 
 	if (!FIES_M_HAS_EXTENTS(file->mode))
 		return FiesWriter_sendFileEnd(self, fileid);
 
-	if (!file->funcs->next_extents)
+	if (!file->funcs->next_extents) {
+		free(exbuf);
 		return FiesWriter_setError(self, ENOTSUP,
 		                           "cannot map extents of file");
-
-	const size_t capacity = 8*1024;
-	FiesFile_Extent *exbuf = malloc(capacity * sizeof(*exbuf));
+	}
 
 	const fies_sz filesize = file->filesize;
 	fies_pos at = 0;
 	retval = 0;
 	while (at != filesize) {
-		ssize_t count = file->funcs->next_extents(file, self,
-		                                          at, exbuf,
-		                                          capacity);
+		// The first batch may have been mapped for the allocation hint.
+		ssize_t count = (ssize_t)mapped;
+		if (!mapped)
+			count = file->funcs->next_extents(file, self,
+			                                  at, exbuf,
+			                                  capacity);
+		mapped = 0;
 		if (count < 0) {
 			retval = (int)count;
 			break;
@@ -1028,6 +1166,59 @@ FiesWriter_readRefFile(FiesWriter *self, FiesFile *file)
 	return FiesWriter_writeFileDo(self, file, true);
 }
 
+extern int
+FiesWriter_setDelta(FiesWriter *self, size_t block_size, unsigned int flags)
+{
+	if (self->delta)
+		return FiesWriter_setError(self, EBUSY,
+		                           "delta mode is already enabled");
+	self->delta = FiesDelta_new(block_size, flags);
+	if (!self->delta)
+		return FiesWriter_setError(self, errno,
+		                           "failed to enable delta mode");
+	return 0;
+}
+
+extern int
+FiesWriter_readDeltaRefFile(FiesWriter *self, FiesFile *file)
+{
+	if (!self->delta) {
+		FiesFile_close(file);
+		return FiesWriter_setError(self, EINVAL,
+		                           "delta mode is not enabled");
+	}
+	int rc = FiesWriter_writeFileDo(self, file, true);
+	if (rc < 0) {
+		FiesFile_close(file);
+		return rc;
+	}
+	rc = FiesDelta_addSource(self->delta, self, file);
+	if (rc < 0)
+		return FiesWriter_setError(self, -rc,
+		                           "failed to index reference file");
+	return 0;
+}
+
+extern int
+FiesWriter_unlink(FiesWriter *self, const char *filename)
+{
+	size_t filenamelen = strlen(filename);
+	if (!filenamelen)
+		return FiesWriter_setError(self, EINVAL, "empty file name");
+	if (filenamelen > 0xFFFF)
+		return FiesWriter_setError(self, ENAMETOOLONG,
+		                           "filename too long");
+	struct fies_unlink unl = {
+		.name_length = FIES_LE((uint16_t)filenamelen),
+		.reserved = 0,
+		.reserved2 = 0
+	};
+	return FiesWriter_putPacket(self, FIES_PACKET_UNLINK,
+	                            &unl, sizeof(unl),
+	                            filename, filenamelen,
+	                            NULL);
+}
+
 extern int
 FiesWriter_snapshots(struct FiesWriter *self,
                      struct FiesFile *file,
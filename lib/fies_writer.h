@@ -3,8 +3,10 @@
 
 #include "map.h"
 #include "emap.h"
+#include "delta.h"
 
 typedef struct FiesWriter FiesWriter;
+typedef struct FiesBtrfsCache FiesBtrfsCache;
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
@@ -31,6 +33,9 @@ struct FiesWriter {
 
 	void *sendbuffer;
 	size_t sendcapacity;
+
+	FiesBtrfsCache *btrfs; // see linux_btrfs.c
+	FiesDelta *delta;
 };
 #pragma clang diagnostic pop
 
@@ -43,4 +48,14 @@ int FiesWriter_FIEMAP_to_Extent(FiesWriter *self,
                                 struct fiemap_extent *src,
                                 fies_sz filesize);
 
+struct stat;
+bool FiesBtrfs_isBtrfs(FiesWriter *writer, int fd, dev_t dev);
+fies_ssz FiesBtrfs_nextExtents(FiesWriter *writer,
+                               int fd,
+                               const struct stat *stbuf,
+                               fies_pos logical_start,
+                               FiesFile_Extent *buffer,
+                               size_t count);
+void FiesBtrfsCache_delete(FiesBtrfsCache *self);
+
 #endif
@@ -0,0 +1,377 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <errno.h>
+
+#include <sys/ioctl.h>
+
+#include "fies.h"
+#include "fies_writer.h"
+#include "vector.h"
+#include "util.h"
+
+#if HAVE_BTRFS
+# include <linux/magic.h>
+# include <linux/btrfs.h>
+# include <linux/btrfs_tree.h>
+#endif
+
+// On btrfs, instead of one synced FIEMAP call per file (where the SHARED flag
+// costs a backref walk in the kernel), the EXTENT_DATA items of a whole range
+// of inodes are read with a single tree search and cached in the writer.
+// Since `fies create` visits directory entries in inode order, the following
+// files usually find their extents in the cache.
+// Every regular extent is flagged as shared and keyed by its disk bytenr, so
+// reflinked data is deduplicated by the writer's extent map.
+
+// Inodes covered by one batch.
+#define BTRFS_BATCH_INODES 4096
+// Stop collecting more inodes once a batch holds this many extents.
+#define BTRFS_BATCH_EXTENTS (64*1024)
+#define BTRFS_SEARCH_BUFSIZE (256*1024)
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	uint64_t ino;
+	FiesFile_Extent extent;
+} BtrfsExtent;
+
+struct FiesBtrfsCache {
+	bool search_failed;  // tree search not permitted or not supported
+
+	bool statfs_valid;
+	bool statfs_btrfs;
+	dev_t statfs_dev;
+
+	bool valid;
+	dev_t dev;
+	uint64_t first_ino;  // the inode the batch was read for
+	uint64_t end_ino;    // first inode not covered by the batch
+	struct timespec time;
+	VectorOf(BtrfsExtent) extents;
+
+	void *args; // struct btrfs_ioctl_search_args_v2 + buffer
+};
+#pragma clang diagnostic pop
+
+static FiesBtrfsCache*
+FiesBtrfsCache_get(FiesWriter *writer)
+{
+	if (!writer->btrfs) {
+		FiesBtrfsCache *self = u_malloc0(sizeof(*self));
+		if (!self)
+			return NULL;
+		Vector_init_type(&self->extents, BtrfsExtent);
+		writer->btrfs = self;
+	}
+	return writer->btrfs;
+}
+
+extern void
+FiesBtrfsCache_delete(FiesBtrfsCache *self)
+{
+	if (!self)
+		return;
+	Vector_destroy(&self->extents);
+	free(self->args);
+	free(self);
+}
+
+#if !HAVE_BTRFS
+
+extern bool
+FiesBtrfs_isBtrfs(FiesWriter *writer, int fd, dev_t dev)
+{
+	(void)writer;
+	(void)fd;
+	(void)dev;
+	return false;
+}
+
+extern fies_ssz
+FiesBtrfs_nextExtents(FiesWriter *writer,
+                      int fd,
+                      const struct stat *stbuf,
+                      fies_pos logical_start,
+                      FiesFile_Extent *buffer,
+                      size_t count)
+{
+	(void)writer;
+	(void)fd;
+	(void)stbuf;
+	(void)logical_start;
+	(void)buffer;
+	(void)count;
+	(void)FiesBtrfsCache_get;
+	return -ENOTSUP;
+}
+
+#else
+
+extern bool
+FiesBtrfs_isBtrfs(FiesWriter *writer, int fd, dev_t dev)
+{
+	FiesBtrfsCache *self = FiesBtrfsCache_get(writer);
+	if (!self || self->search_failed)
+		return false;
+	if (self->statfs_valid && self->statfs_dev == dev)
+		return self->statfs_btrfs;
+
+	struct statfs fsbuf;
+	if (fstatfs(fd, &fsbuf) != 0)
+		return false;
+	self->statfs_valid = true;
+	self->statfs_dev = dev;
+	self->statfs_btrfs = (unsigned long)fsbuf.f_type == BTRFS_SUPER_MAGIC;
+	return self->statfs_btrfs;
+}
+
+static int
+BtrfsCache_addItem(FiesBtrfsCache *self,
+                   const struct btrfs_ioctl_search_header *hdr,
+                   const void *data)
+{
+	struct btrfs_file_extent_item item;
+	const size_t inline_size = offsetof(struct btrfs_file_extent_item,
+	                                    disk_bytenr);
+
+	if (hdr->len < inline_size)
+		return -EIO;
+	memset(&item, 0, sizeof(item));
+	memcpy(&item, data, hdr->len < sizeof(item) ? hdr->len : sizeof(item));
+
+	BtrfsExtent ex = {
+		.ino = hdr->objectid,
+		.extent = {
+			.device = 0,
+			.logical = hdr->offset,
+		}
+	};
+	if (item.type == BTRFS_FILE_EXTENT_INLINE) {
+		ex.extent.physical = 0;
+		ex.extent.length = u_le64(item.ram_bytes);
+		ex.extent.flags = FIES_FL_DATA;
+	} else {
+		if (hdr->len < sizeof(item))
+			return -EIO;
+		uint64_t bytenr = u_le64(item.disk_bytenr);
+		if (!bytenr)
+			return 0; // hole
+		ex.extent.physical = bytenr + u_le64(item.offset);
+		ex.extent.length = u_le64(item.num_bytes);
+		if (item.type == BTRFS_FILE_EXTENT_PREALLOC)
+			ex.extent.flags = FIES_FL_ZERO;
+		else if (item.compression || item.encryption)
+			// The offset is into the decoded data, so the bytenr
+			// based key could overlap the following disk extent.
+			ex.extent.flags = FIES_FL_DATA;
+		else
+			ex.extent.flags = FIES_FL_DATA | FIES_FL_SHARED;
+	}
+	if (!ex.extent.length)
+		return 0;
+	Vector_push(&self->extents, &ex);
+	return 0;
+}
+
+static void
+BtrfsCache_dropFrom(FiesBtrfsCache *self, uint64_t ino)
+{
+	size_t count = Vector_length(&self->extents);
+	while (count) {
+		const BtrfsExtent *ex = Vector_at(&self->extents, count-1);
+		if (ex->ino < ino)
+			break;
+		--count;
+	}
+	Vector_remove(&self->extents, count,
+	              Vector_length(&self->extents) - count);
+}
+
+static int
+BtrfsCache_fill(FiesBtrfsCache *self, int fd, dev_t dev, uint64_t ino)
+{
+	self->valid = false;
+	Vector_clear(&self->extents);
+
+	struct btrfs_ioctl_search_args_v2 *args = self->args;
+	if (!args) {
+		args = malloc(sizeof(*args) + BTRFS_SEARCH_BUFSIZE);
+		if (!args)
+			return -ENOMEM;
+		self->args = args;
+	}
+
+	// Delayed allocations only show up in the tree once written out, and
+	// this covers every file of the batch, not just the current one.
+	clock_gettime(CLOCK_REALTIME, &self->time);
+	if (syncfs(fd) != 0)
+		return -errno;
+
+	struct btrfs_ioctl_search_key *sk = &args->key;
+	memset(sk, 0, sizeof(*sk));
+	sk->tree_id = 0; // the subvolume containing fd
+	sk->min_objectid = ino;
+	sk->max_objectid = ino + BTRFS_BATCH_INODES - 1;
+	sk->min_type = BTRFS_EXTENT_DATA_KEY;
+	sk->max_type = BTRFS_EXTENT_DATA_KEY;
+	sk->min_offset = 0;
+	sk->max_offset = (uint64_t)-1;
+	sk->min_transid = 0;
+	sk->max_transid = (uint64_t)-1;
+
+	uint64_t end_ino = sk->max_objectid + 1;
+	for (;;) {
+		sk->nr_items = (uint32_t)-1;
+		args->buf_size = BTRFS_SEARCH_BUFSIZE;
+		if (ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args) != 0)
+			return -errno;
+		if (!sk->nr_items)
+			break;
+
+		// The key range is compared as a whole, so other item types
+		// of the inodes in between are returned as well.
+		struct btrfs_ioctl_search_header hdr;
+		const char *buf = (const char*)args->buf;
+		size_t off = 0;
+		for (uint32_t i = 0; i != sk->nr_items; ++i) {
+			if (off + sizeof(hdr) > BTRFS_SEARCH_BUFSIZE)
+				return -EIO;
+			memcpy(&hdr, buf + off, sizeof(hdr));
+			off += sizeof(hdr);
+			if (off + hdr.len > BTRFS_SEARCH_BUFSIZE)
+				return -EIO;
+			if (hdr.type == BTRFS_EXTENT_DATA_KEY) {
+				int rc = BtrfsCache_addItem(self, &hdr,
+				                            buf + off);
+				if (rc < 0)
+					return rc;
+			}
+			off += hdr.len;
+		}
+
+		if (Vector_length(&self->extents) > BTRFS_BATCH_EXTENTS &&
+		    hdr.objectid != ino)
+		{
+			// The last inode may be incomplete.
+			end_ino = hdr.objectid;
+			BtrfsCache_dropFrom(self, end_ino);
+			break;
+		}
+
+		// Continue after the last returned key.
+		sk->min_objectid = hdr.objectid;
+		sk->min_type = hdr.type;
+		sk->min_offset = hdr.offset + 1;
+		if (!sk->min_offset && ++sk->min_type > 255) {
+			sk->min_type = 0;
+			++sk->min_objectid;
+		}
+		if (sk->min_objectid > sk->max_objectid ||
+		    (sk->min_objectid == sk->max_objectid &&
+		     sk->min_type > sk->max_type))
+		{
+			break;
+		}
+	}
+
+	self->valid = true;
+	self->dev = dev;
+	self->first_ino = ino;
+	self->end_ino = end_ino;
+	return 0;
+}
+
+static bool
+BtrfsCache_covers(FiesBtrfsCache *self, dev_t dev, const struct stat *stbuf)
+{
+	uint64_t ino = (uint64_t)stbuf->st_ino;
+	if (!self->valid || self->dev != dev ||
+	    ino < self->first_ino || ino >= self->end_ino)
+	{
+		return false;
+	}
+	if (ino == self->first_ino)
+		return true;
+	// Other files must not have been touched since shortly before the
+	// batch was read (file timestamps are coarser than the clock).
+	time_t limit = self->time.tv_sec - 1;
+	return stbuf->st_mtim.tv_sec < limit && stbuf->st_ctim.tv_sec < limit;
+}
+
+static int
+BtrfsExtent_cmp_end(const BtrfsExtent *ex, uint64_t ino, fies_pos pos)
+{
+	if (ex->ino != ino)
+		return ex->ino < ino ? -1 : 1;
+	return ex->extent.logical + ex->extent.length <= pos ? -1 : 1;
+}
+
+extern fies_ssz
+FiesBtrfs_nextExtents(FiesWriter *writer,
+                      int fd,
+                      const struct stat *stbuf,
+                      fies_pos logical_start,
+                      FiesFile_Extent *buffer,
+                      size_t count)
+{
+	FiesBtrfsCache *self = writer->btrfs;
+	if (!self || self->search_failed)
+		return -ENOTSUP;
+
+	if (!BtrfsCache_covers(self, stbuf->st_dev, stbuf)) {
+		int rc = BtrfsCache_fill(self, fd, stbuf->st_dev,
+		                         (uint64_t)stbuf->st_ino);
+		if (rc == -EPERM || rc == -ENOTTY || rc == -EINVAL ||
+		    rc == -EOPNOTSUPP)
+		{
+			// Needs CAP_SYS_ADMIN, use FIEMAP from now on.
+			self->search_failed = true;
+			return -ENOTSUP;
+		}
+		if (rc < 0)
+			return rc;
+	}
+
+	const uint64_t ino = (uint64_t)stbuf->st_ino;
+	const fies_sz filesize = (fies_sz)stbuf->st_size;
+
+	// First extent of the inode ending past logical_start.
+	size_t lo = 0, hi = Vector_length(&self->extents);
+	while (lo != hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const BtrfsExtent *ex = Vector_at(&self->extents, mid);
+		if (BtrfsExtent_cmp_end(ex, ino, logical_start) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	size_t got = 0;
+	for (size_t i = lo; i != Vector_length(&self->extents) && got != count;
+	     ++i)
+	{
+		const BtrfsExtent *ex = Vector_at(&self->extents, i);
+		if (ex->ino != ino || ex->extent.logical >= filesize)
+			break;
+		FiesFile_Extent *out = &buffer[got++];
+		*out = ex->extent;
+		if (out->logical < logical_start && out->physical) {
+			fies_sz skip = logical_start - out->logical;
+			out->logical += skip;
+			out->physical += skip;
+			out->length -= skip;
+		}
+	}
+	return (fies_ssz)got;
+}
+
+#endif
@@ -33,6 +33,8 @@
 typedef struct {
 	int fd;
 	dev_t dev;
+	bool btrfs;
+	struct stat stbuf;
 	struct fiemap fm; // must be the last member
 } FiesOSFile;
 #pragma clang diagnostic pop
@@ -216,6 +218,16 @@ FiesOSFile_nextExtents(FiesFile *handle,
 	if (!count)
 		return 0;
 
+	if (self->btrfs) {
+		fies_ssz got = FiesBtrfs_nextExtents(writer, self->fd,
+		                                     &self->stbuf,
+		                                     logical_start,
+		                                     buffer, count);
+		if (got != -ENOTSUP)
+			return got;
+		self->btrfs = false;
+	}
+
 	self->fm.fm_start = (size_t)logical_start;
 	self->fm.fm_length = handle->filesize - (size_t)logical_start;
 	self->fm.fm_mapped_extents = 0;
@@ -468,6 +480,9 @@ FiesFile_fdopenfull(int fd,
 #endif
 	self->fd = fd;
 	self->dev = stbuf->st_dev;
+	self->btrfs = fd >= 0 && S_ISREG(stbuf->st_mode) &&
+	              FiesBtrfs_isBtrfs(writer, fd, stbuf->st_dev);
+	self->stbuf = *stbuf;
 	memset(&self->fm, 0, sizeof(self->fm));
 	self->fm.fm_start = 0;
 	self->fm.fm_length = (size_t)stbuf->st_size;
@@ -1,23 +1,204 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define CRC32C_X86 1
+#  include <nmmintrin.h>
+#  include <wmmintrin.h>
+#endif
 
 #include "crc.h"
 
-uint32_t
-crc32c(const void *data_, size_t length)
-{
-	static uint32_t table[256];
-	if (!table[4]) {
-		for (uint32_t i = 0; i != 256; ++i) {
-			uint32_t c = i;
-			for (size_t j = 0; j != 8; ++j)
-				c = (c>>1) ^ (-(c&1) & 0x82F63B78);
-			table[i] = c;
-		}
-	}
+#define CRC32C_POLY 0x82F63B78U // reflected
+
+static uint32_t crc32c_table[256];
+
+static uint32_t
+crc32c_software(uint32_t crc, const void *data_, size_t length)
+{
 	const uint8_t *data = data_;
-	uint32_t crc = 0xFFFFFFFFU;
 	for (size_t i = 0; i != length; ++i)
-		crc = (crc >> 8) ^ table[(data[i] ^ crc)&0xFF];
+		crc = (crc >> 8) ^ crc32c_table[(data[i] ^ crc)&0xFF];
+	return crc;
+}
+
+#ifdef CRC32C_X86
+// Streams are interleaved in rounds of 3 times these many bytes.
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+// x^(8n-33) mod P for shifting a crc over n and 2n bytes of zeros.
+static uint64_t crc32c_long_k1, crc32c_long_k2;
+static uint64_t crc32c_short_k1, crc32c_short_k2;
+
+static inline uint64_t
+crc32c_load(const uint8_t *data)
+{
+	uint64_t word;
+	memcpy(&word, data, sizeof(word));
+	return word;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const void *data_, size_t length)
+{
+	const uint8_t *data = data_;
+	for (; length && ((uintptr_t)data & 7); --length)
+		crc = _mm_crc32_u8(crc, *data++);
+	uint64_t crc64 = crc;
+	for (; length >= 8; data += 8, length -= 8)
+		crc64 = _mm_crc32_u64(crc64, crc32c_load(data));
+	crc = (uint32_t)crc64;
+	for (; length; --length)
+		crc = _mm_crc32_u8(crc, *data++);
 	return crc;
 }
+
+// Multiplying by x^(8n-33) and reducing the 64 bit product with the crc32
+// instruction, which adds the missing x^32, appends n zero bytes.
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64_t
+crc32c_shift(uint64_t crc, uint64_t k)
+{
+	__m128i product = _mm_clmulepi64_si128(
+		_mm_cvtsi64_si128((long long)crc),
+		_mm_cvtsi64_si128((long long)k), 0);
+	return _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+// The crc32 instruction has a latency of 3 cycles but a throughput of 1, so
+// 3 parts of the data are summed up independently and combined afterwards.
+__attribute__((target("sse4.2,pclmul")))
+static inline const uint8_t*
+crc32c_triple(uint64_t *crc, const uint8_t *data, size_t *length,
+              size_t stride, uint64_t k1, uint64_t k2)
+{
+	for (; *length >= 3*stride; data += 3*stride, *length -= 3*stride) {
+		uint64_t crc0 = *crc, crc1 = 0, crc2 = 0;
+		for (size_t i = 0; i != stride; i += 8) {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load(data + i));
+			crc1 = _mm_crc32_u64(crc1,
+			                     crc32c_load(data + stride + i));
+			crc2 = _mm_crc32_u64(crc2,
+			                     crc32c_load(data + 2*stride + i));
+		}
+		*crc = crc32c_shift(crc0, k2) ^ crc32c_shift(crc1, k1) ^ crc2;
+	}
+	return data;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t
+crc32c_pclmul(uint32_t crc, const void *data_, size_t length)
+{
+	const uint8_t *data = data_;
+	for (; length && ((uintptr_t)data & 7); --length)
+		crc = _mm_crc32_u8(crc, *data++);
+	uint64_t crc64 = crc;
+	data = crc32c_triple(&crc64, data, &length, CRC32C_LONG,
+	                     crc32c_long_k1, crc32c_long_k2);
+	data = crc32c_triple(&crc64, data, &length, CRC32C_SHORT,
+	                     crc32c_short_k1, crc32c_short_k2);
+	return crc32c_sse42((uint32_t)crc64, data, length);
+}
+
+// Polynomials are reflected, 1 is 0x80000000 and x is 0x40000000.
+static uint32_t
+crc32c_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+	for (uint32_t m = 1U << 31; m; m >>= 1) {
+		if (a & m)
+			product ^= b;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return product;
+}
+
+static uint64_t
+crc32c_xpow(uint64_t n)
+{
+	uint32_t result = 1U << 31;
+	uint32_t square = 1U << 30;
+	for (; n; n >>= 1) {
+		if (n & 1)
+			result = crc32c_multiply(result, square);
+		square = crc32c_multiply(square, square);
+	}
+	return result;
+}
+#endif
+
+static crc32c_func *crc32c_best;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Run once via crc32c_init(), blocks are checksummed by several threads.
+static void
+crc32c_select(void)
+{
+	for (uint32_t i = 0; i != 256; ++i) {
+		uint32_t c = i;
+		for (size_t j = 0; j != 8; ++j)
+			c = (c>>1) ^ (-(c&1) & CRC32C_POLY);
+		crc32c_table[i] = c;
+	}
+#ifdef CRC32C_X86
+	crc32c_long_k1 = crc32c_xpow(8 * CRC32C_LONG - 33);
+	crc32c_long_k2 = crc32c_xpow(8 * 2*CRC32C_LONG - 33);
+	crc32c_short_k1 = crc32c_xpow(8 * CRC32C_SHORT - 33);
+	crc32c_short_k2 = crc32c_xpow(8 * 2*CRC32C_SHORT - 33);
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		if (__builtin_cpu_supports("pclmul"))
+			crc32c_best = crc32c_pclmul;
+		else
+			crc32c_best = crc32c_sse42;
+		return;
+	}
+#endif
+	crc32c_best = crc32c_software;
+}
+
+static inline void
+crc32c_init(void)
+{
+	(void)pthread_once(&crc32c_once, crc32c_select);
+}
+
+crc32c_func*
+crc32c_implementation(enum crc32c_impl impl)
+{
+	crc32c_init();
+	switch (impl) {
+	case CRC32C_SOFTWARE:
+		return crc32c_software;
+#ifdef CRC32C_X86
+	case CRC32C_SSE42:
+		if (!__builtin_cpu_supports("sse4.2"))
+			return NULL;
+		return crc32c_sse42;
+	case CRC32C_PCLMUL:
+		if (!__builtin_cpu_supports("sse4.2") ||
+		    !__builtin_cpu_supports("pclmul"))
+		{
+			return NULL;
+		}
+		return crc32c_pclmul;
+#else
+	case CRC32C_SSE42:
+	case CRC32C_PCLMUL:
+		return NULL;
+#endif
+	}
+	return NULL;
+}
+
+uint32_t
+crc32c(const void *data, size_t length)
+{
+	crc32c_init();
+	return crc32c_best(0xFFFFFFFFU, data, length);
+}
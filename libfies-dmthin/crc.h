@@ -1,6 +1,24 @@
 #ifndef FIES_LIB_FIESMDTHIN_CRC_H
 #define FIES_LIB_FIESMDTHIN_CRC_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C of a block without the final inversion, as used by dm-thin. Uses
+// the SSE4.2 crc32 instruction and PCLMUL if the CPU supports them.
 uint32_t crc32c(const void *data_, size_t length);
 
+// The implementations to choose from, for testing. They continue from a
+// previous `crc`, which starts out as 0xFFFFFFFF.
+typedef uint32_t crc32c_func(uint32_t crc, const void *data, size_t length);
+
+enum crc32c_impl {
+	CRC32C_SOFTWARE,
+	CRC32C_SSE42,
+	CRC32C_PCLMUL,
+};
+
+// NULL if the CPU does not support it.
+crc32c_func* crc32c_implementation(enum crc32c_impl impl);
+
 #endif
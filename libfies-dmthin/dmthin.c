@@ -23,17 +23,55 @@ thin_superblock_verify(const struct thin_superblock *super,
 }
 
 bool
-btree_node_verify(const btree_node *node, size_t blocksize, size_t blocknr)
+thin_metadata_index_verify(const struct thin_metadata_index *index,
+                           size_t blocksize,
+                           size_t blocknr)
 {
+	if (FIES_LE(index->blocknr) != blocknr)
+		return false;
+	uint32_t csum = crc32c(&index->padding, blocksize - sizeof(index->csum))
+	                ^ THIN_INDEX_CSUM_XOR;
+	return FIES_LE(index->csum) == csum;
+}
+
+bool
+thin_bitmap_verify(const struct thin_bitmap_header *bitmap,
+                   size_t blocksize,
+                   size_t blocknr)
+{
+	if (FIES_LE(bitmap->blocknr) != blocknr)
+		return false;
+	uint32_t csum = crc32c(&bitmap->not_used,
+	                       blocksize - sizeof(bitmap->csum))
+	                ^ THIN_BITMAP_CSUM_XOR;
+	return FIES_LE(bitmap->csum) == csum;
+}
+
+// Leaves are expected to hold values of `value_size` bytes, internal nodes
+// always hold block numbers.
+bool
+btree_node_verify(const btree_node *node,
+                  size_t blocksize,
+                  size_t blocknr,
+                  size_t value_size)
+{
+	const uint32_t flags = FIES_LE(node->flags);
+	const uint64_t max_entries = FIES_LE(node->max_entries);
+	if (flags & INTERNAL_NODE)
+		value_size = sizeof(uint64_t);
 	if (FIES_LE(node->blocknr) != (uint64_t)blocknr ||
-	    FIES_LE(node->value_size) != sizeof(uint64_t)) // we expect u64
+	    !(flags & (INTERNAL_NODE | LEAF_NODE)) ||
+	    FIES_LE(node->value_size) != value_size ||
+	    FIES_LE(node->nr_entries) > max_entries ||
+	    sizeof(*node) + max_entries * (sizeof(uint64_t) + value_size)
+	      > blocksize)
 	{
 		return false;
 	}
 	uint32_t csum = crc32c(&node->flags,
 	                       blocksize - sizeof(node->csum))
 	                ^ BTREE_CSUM_XOR;
-	return FIES_LE(node->csum) != csum;
+	return FIES_LE(node->csum) == csum;
 }
 
 long
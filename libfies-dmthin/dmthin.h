@@ -21,7 +21,10 @@ typedef struct btree_node {
 	uint64_t keys[0];
 } FIES_PACKED btree_node;
 
-bool btree_node_verify(const btree_node*, size_t blocksize, size_t blocknr);
+bool btree_node_verify(const btree_node*,
+                       size_t blocksize,
+                       size_t blocknr,
+                       size_t value_size);
 long btree_node_search(const btree_node*, uint64_t key, bool hi);
 
 static inline const void*
@@ -58,10 +61,54 @@ struct thin_superblock {
 	uint32_t compat_ro_flags;
 	uint32_t incompat_flags;
 } FIES_PACKED;
+
+// Space maps hold the reference counts of data and metadata blocks.
+struct thin_space_map_root {
+	uint64_t nr_blocks;
+	uint64_t nr_allocated;
+	uint64_t bitmap_root;    // index btree, or index block for metadata
+	uint64_t ref_count_root; // btree of counts which don't fit the bitmap
+} FIES_PACKED;
+
+struct thin_index_entry {
+	uint64_t blocknr;
+	uint32_t nr_free;
+	uint32_t none_free_before;
+} FIES_PACKED;
+
+#define THIN_INDEX_CSUM_XOR 160478
+#define THIN_METADATA_BITMAPS 255
+struct thin_metadata_index {
+	uint32_t csum;
+	uint32_t padding;
+	uint64_t blocknr;
+	struct thin_index_entry index[THIN_METADATA_BITMAPS];
+} FIES_PACKED;
+
+struct thin_device_details {
+	uint64_t mapped_blocks;
+	uint64_t transaction_id;
+	uint32_t creation_time;
+	uint32_t snapshotted_time;
+} FIES_PACKED;
+
+// Followed by 2 bits per block: counts 0 to 2, or 3 for "see the btree".
+#define THIN_BITMAP_CSUM_XOR 240779
+struct thin_bitmap_header {
+	uint32_t csum;
+	uint32_t not_used;
+	uint64_t blocknr;
+} FIES_PACKED;
 #pragma clang diagnostic pop
 
 bool thin_superblock_verify(const struct thin_superblock *super,
                             size_t blocksize,
                             size_t blocknr);
+bool thin_metadata_index_verify(const struct thin_metadata_index *index,
+                                size_t blocksize,
+                                size_t blocknr);
+bool thin_bitmap_verify(const struct thin_bitmap_header *bitmap,
+                        size_t blocksize,
+                        size_t blocknr);
 
 #endif
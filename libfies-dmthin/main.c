@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <string.h>
 
 #include "main.h"
 
@@ -17,6 +18,59 @@ fdmt_putBlock(FiesDMThin *self, const void *block)
 	self->put_block_cb(self->opaque, block);
 }
 
+// Every node is checked when it is read, see btree_node_verify().
+static const btree_node*
+fdmt_getTreeNode(FiesDMThin *self, uint64_t block, size_t value_size)
+{
+	const btree_node *node = fdmt_getBlock(self, block);
+	if (node && !btree_node_verify(node, self->block_size, block,
+	                               value_size))
+	{
+		fdmt_putBlock(self, node);
+		errno = EBADF;
+		return NULL;
+	}
+	return node;
+}
+
+// Nodes of the mapping trees, which hold block numbers.
+static const btree_node*
+fdmt_getNode(FiesDMThin *self, uint64_t block)
+{
+	return fdmt_getTreeNode(self, block, sizeof(uint64_t));
+}
+
+static FiesDMThin_SpaceMap*
+fdmt_spaceMapNew(FiesDMThin *self, const uint8_t *disk_root, bool metadata)
+{
+	struct thin_space_map_root root;
+	memcpy(&root, disk_root, sizeof(root));
+
+	FiesDMThin_SpaceMap *sm = u_malloc0(sizeof(*sm));
+	if (!sm)
+		return NULL;
+	sm->metadata = metadata;
+	sm->nr_blocks = FIES_LE(root.nr_blocks);
+	sm->bitmap_root = FIES_LE(root.bitmap_root);
+	sm->ref_count_root = FIES_LE(root.ref_count_root);
+	// 4 entries per byte
+	sm->entries = (self->block_size - sizeof(struct thin_bitmap_header))
+	              * 4;
+	for (size_t i = 0; i != FDMT_SPACE_MAP_CACHE; ++i)
+		sm->bitmaps[i].index = UINT64_MAX;
+	return sm;
+}
+
+static void
+fdmt_spaceMapDelete(FiesDMThin_SpaceMap *sm)
+{
+	if (!sm)
+		return;
+	for (size_t i = 0; i != FDMT_SPACE_MAP_CACHE; ++i)
+		free(sm->bitmaps[i].data);
+	free(sm);
+}
+
 static int
 fdmt_init(FiesDMThin *self)
 {
@@ -27,6 +81,20 @@ fdmt_init(FiesDMThin *self)
 		fdmt_putBlock(self, super);
 		return -EBADF;
 	}
+	// The kernel zeroes the space map roots of the metadata snapshot's
+	// superblock copy, so the counts come from the live space maps. While
+	// the snapshot is held, every block reachable from it keeps at least
+	// the references it has there, so the live counts can only mark more
+	// extents as shared than necessary, never fewer.
+	self->data_space_map =
+		fdmt_spaceMapNew(self, super->data_spacemap_root, false);
+	self->metadata_space_map =
+		fdmt_spaceMapNew(self, super->metadata_spacemap_root, true);
+	if (!self->data_space_map || !self->metadata_space_map) {
+		fdmt_putBlock(self, super);
+		return -ENOMEM;
+	}
+
 	self->snap_root = FIES_LE(super->metasnap_root);
 	if (self->snap_root) {
 		fdmt_putBlock(self, super);
@@ -44,6 +112,7 @@ fdmt_init(FiesDMThin *self)
 	self->metadata_block_size = FIES_LE(super->metadata_block_size) * 512;
 	self->data_block_size = FIES_LE(super->data_block_size) * 512;
 	self->data_mapping_root = FIES_LE(super->data_mapping_root);
+	self->details_root = FIES_LE(super->dev_details_root);
 
 	fdmt_putBlock(self, super);
 	return 0;
@@ -68,7 +137,7 @@ FiesDMThin_new(void *opaque,
 
 	int rc = fdmt_init(self);
 	if (rc < 0) {
-		free(self);
+		FiesDMThin_delete(self);
 		errno = -rc;
 		return NULL;
 	}
@@ -79,17 +148,48 @@ FiesDMThin_new(void *opaque,
 extern void
 FiesDMThin_delete(FiesDMThin *self)
 {
+	if (!self)
+		return;
+	fdmt_spaceMapDelete(self->data_space_map);
+	fdmt_spaceMapDelete(self->metadata_space_map);
 	free(self);
 }
 
+extern void
+FiesDMThin_setPrefetch(FiesDMThin *self, FiesDMThin_loadBlocks_t *prefetch_cb)
+{
+	self->prefetch_cb = prefetch_cb;
+}
+
+extern void
+FiesDMThin_setQueryFlags(FiesDMThin *self, uint32_t query_flags)
+{
+	self->query_flags = query_flags;
+}
+
+// Look up `key` in the btree at `block`. If a `load_cb` is passed, each node
+// is announced to it before it is read, and at most `*budget` nodes are read.
 static int
-fdmt_search(FiesDMThin *self, uint64_t block, uint64_t key, uint64_t *value)
+fdmt_lookup(FiesDMThin              *self,
+            uint64_t                 block,
+            uint64_t                 key,
+            void                    *value,
+            size_t                   value_size,
+            FiesDMThin_loadBlocks_t *load_cb,
+            size_t                  *budget)
 {
 	int rc;
 	long index;
 	const btree_node *node = NULL;
 	while (true) {
-		if ( !(node = fdmt_getBlock(self, block)) )
+		if (load_cb) {
+			if (!*budget)
+				return -ELOOP;
+			--*budget;
+			if ((rc = load_cb(self->opaque, &block, 1)) < 0)
+				return rc;
+		}
+		if ( !(node = fdmt_getTreeNode(self, block, value_size)) )
 			return -errno;
 		index = btree_node_search(node, key, false);
 		if (index < 0 || (uint32_t)index == FIES_LE(node->nr_entries))
@@ -112,9 +212,21 @@ fdmt_search(FiesDMThin *self, uint64_t block, uint64_t key, uint64_t *value)
 		goto out;
 	}
 	rc = 0;
-	const uint64_t *values = btree_node_values(node);
-	*value = FIES_LE(values[index]);
+	const uint8_t *values = btree_node_values(node);
+	memcpy(value, values + (size_t)index * value_size, value_size);
 out:
+	fdmt_putBlock(self, node);
+	return rc;
+}
+
+static int
+fdmt_search(FiesDMThin *self, uint64_t block, uint64_t key, uint64_t *value)
+{
+	uint64_t le_value;
+	int rc = fdmt_lookup(self, block, key, &le_value, sizeof(le_value),
+	                     NULL, NULL);
+	if (rc == 0)
+		*value = FIES_LE(le_value);
 	return rc;
 }
 
@@ -124,6 +236,311 @@ fdmt_searchRoot(FiesDMThin *self, uint64_t key, uint64_t *value)
 	return fdmt_search(self, self->data_mapping_root, key, value);
 }
 
+// Find the bitmap block holding the counts of the blocks in bitmap `index`.
+static int
+fdmt_spaceMapFind(FiesDMThin              *self,
+                  FiesDMThin_SpaceMap     *sm,
+                  uint64_t                 index,
+                  uint64_t                *blocknr,
+                  FiesDMThin_loadBlocks_t *load_cb,
+                  size_t                  *budget)
+{
+	struct thin_index_entry entry;
+	if (!sm->metadata) {
+		int rc = fdmt_lookup(self, sm->bitmap_root, index,
+		                     &entry, sizeof(entry), load_cb, budget);
+		if (rc < 0)
+			return rc;
+		*blocknr = FIES_LE(entry.blocknr);
+		return 0;
+	}
+
+	if (index >= THIN_METADATA_BITMAPS)
+		return -ERANGE;
+	if (load_cb) {
+		int rc = load_cb(self->opaque, &sm->bitmap_root, 1);
+		if (rc < 0)
+			return rc;
+	}
+	const struct thin_metadata_index *mi =
+		fdmt_getBlock(self, sm->bitmap_root);
+	if (!mi)
+		return -errno;
+	bool valid = thin_metadata_index_verify(mi, self->block_size,
+	                                        sm->bitmap_root);
+	entry = mi->index[index];
+	fdmt_putBlock(self, mi);
+	if (!valid)
+		return -EIO;
+	*blocknr = FIES_LE(entry.blocknr);
+	return 0;
+}
+
+static const struct FiesDMThin_SpaceMapBitmap*
+fdmt_spaceMapBitmap(FiesDMThin *self, FiesDMThin_SpaceMap *sm, uint64_t index)
+{
+	struct FiesDMThin_SpaceMapBitmap *bitmap =
+		&sm->bitmaps[index % FDMT_SPACE_MAP_CACHE];
+	if (bitmap->index == index)
+		return bitmap;
+
+	const size_t size = self->block_size
+	                    - sizeof(struct thin_bitmap_header);
+	bitmap->index = UINT64_MAX;
+	bitmap->bad = true;
+	if (!bitmap->data && !(bitmap->data = malloc(size)))
+		return bitmap; // try again next time
+
+	// Remember failures, too, so a bad bitmap is only read once.
+	bitmap->index = index;
+	uint64_t blocknr;
+	if (fdmt_spaceMapFind(self, sm, index, &blocknr, NULL, NULL) < 0)
+		return bitmap;
+	const struct thin_bitmap_header *header = fdmt_getBlock(self, blocknr);
+	if (!header)
+		return bitmap;
+	if (thin_bitmap_verify(header, self->block_size, blocknr)) {
+		memcpy(bitmap->data, header + 1, size);
+		bitmap->bad = false;
+	}
+	fdmt_putBlock(self, header);
+	return bitmap;
+}
+
+// The reference count of `block`, or 0 if it is unknown. Counts above 2 are
+// only looked up if `exact` is set, otherwise they are returned as 3.
+static uint32_t
+fdmt_spaceMapCount(FiesDMThin          *self,
+                   FiesDMThin_SpaceMap *sm,
+                   uint64_t             block,
+                   bool                 exact)
+{
+	if (block >= sm->nr_blocks)
+		return 0;
+	const struct FiesDMThin_SpaceMapBitmap *bitmap =
+		fdmt_spaceMapBitmap(self, sm, block / sm->entries);
+	if (bitmap->bad)
+		return 0;
+
+	// 32 entries of 2 bits per little endian word, high bit first
+	const uint64_t entry = block % sm->entries;
+	uint64_t word;
+	memcpy(&word, bitmap->data + entry / 32 * sizeof(word), sizeof(word));
+	word = FIES_LE(word);
+	const unsigned int bit = (unsigned int)(entry % 32) * 2;
+	uint32_t count = (uint32_t)(((word >> bit) & 1) << 1)
+	               | (uint32_t)((word >> (bit+1)) & 1);
+	if (count != 3 || !exact)
+		return count;
+
+	uint32_t le_count;
+	if (fdmt_lookup(self, sm->ref_count_root, block,
+	                &le_count, sizeof(le_count), NULL, NULL) < 0)
+	{
+		return 0;
+	}
+	return FIES_LE(le_count);
+}
+
+// Whether a btree node may be referenced by more than one device. Snapshots
+// share nodes, the counts of the blocks below them are only raised once the
+// nodes get copied.
+static bool
+fdmt_nodeShared(FiesDMThin *self, uint64_t block)
+{
+	return fdmt_spaceMapCount(self, self->metadata_space_map,
+	                          block, false) != 1;
+}
+
+static int
+fdmt_reserve(uint64_t **list, size_t count, size_t *alloc, size_t more)
+{
+	if (count + more <= *alloc)
+		return 0;
+	size_t want = *alloc ? *alloc : 64;
+	while (want < count + more)
+		want *= 2;
+	uint64_t *grown = realloc(*list, want * sizeof(**list));
+	if (!grown)
+		return -ENOMEM;
+	*list = grown;
+	*alloc = want;
+	return 0;
+}
+
+static int
+fdmt_appendChildren(const btree_node *node,
+                    uint64_t **list, size_t *count, size_t *alloc)
+{
+	const uint64_t *values = btree_node_values(node);
+	const uint32_t entries = FIES_LE(node->nr_entries);
+	int rc = fdmt_reserve(list, *count, alloc, entries);
+	if (rc < 0)
+		return rc;
+	for (uint32_t i = 0; i != entries; ++i)
+		(*list)[(*count)++] = FIES_LE(values[i]);
+	return 0;
+}
+
+// Remember the bitmap covering `block` unless it was the last one added.
+static int
+fdmt_appendBitmap(const FiesDMThin_SpaceMap *sm, uint64_t block,
+                  uint64_t **list, size_t *count, size_t *alloc)
+{
+	if (block >= sm->nr_blocks)
+		return 0;
+	uint64_t index = block / sm->entries;
+	if (*count && (*list)[*count-1] == index)
+		return 0;
+	int rc = fdmt_reserve(list, *count, alloc, 1);
+	if (rc < 0)
+		return rc;
+	(*list)[(*count)++] = index;
+	return 0;
+}
+
+static int
+fdmt_u64cmp(const void *pa, const void *pb)
+{
+	uint64_t a = *(const uint64_t*)pa;
+	uint64_t b = *(const uint64_t*)pb;
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Announce the bitmap blocks with the given indices and the nodes needed to
+// find them. Bitmaps which cannot be found are skipped, their counts are
+// simply unknown later on.
+static int
+fdmt_loadSpaceMap(FiesDMThin              *self,
+                  FiesDMThin_SpaceMap     *sm,
+                  uint64_t                *indices,
+                  size_t                   count,
+                  FiesDMThin_loadBlocks_t *load_cb,
+                  size_t                  *budget)
+{
+	qsort(indices, count, sizeof(*indices), fdmt_u64cmp);
+	size_t found = 0;
+	uint64_t last = UINT64_MAX;
+	for (size_t i = 0; i != count; ++i) {
+		const uint64_t index = indices[i];
+		if (index == last)
+			continue;
+		last = index;
+		uint64_t blocknr;
+		int rc = fdmt_spaceMapFind(self, sm, index, &blocknr,
+		                           load_cb, budget);
+		if (rc == -ENOMEM || rc == -ELOOP)
+			return rc;
+		if (rc == 0)
+			indices[found++] = blocknr; // reuse the list
+	}
+	if (!found)
+		return 0;
+	return load_cb(self->opaque, indices, found);
+}
+
+extern int
+FiesDMThin_loadDevice(FiesDMThin              *self,
+                      uint32_t                 device,
+                      FiesDMThin_loadBlocks_t *load_cb)
+{
+	int rc;
+	const btree_node *node;
+	const bool refcounts =
+		!!(self->query_flags & FIES_DMTHIN_QUERY_REFCOUNTS);
+	// A valid tree cannot have more nodes than the metadata device.
+	size_t budget = self->size / self->block_size;
+
+	// The path to the device's tree, one node at a time.
+	uint64_t block;
+	rc = fdmt_lookup(self, self->data_mapping_root, device,
+	                 &block, sizeof(block), load_cb, &budget);
+	if (rc < 0)
+		return rc;
+	block = FIES_LE(block);
+
+	// The device's tree one level at a time.
+	uint64_t *level = malloc(sizeof(*level));
+	if (!level)
+		return -ENOMEM;
+	level[0] = block;
+	size_t count = 1;
+	size_t level_alloc = 1;
+	uint64_t *next = NULL;
+	size_t next_alloc = 0;
+	// Bitmaps with the counts of the nodes and of the data blocks.
+	uint64_t *node_maps = NULL, *data_maps = NULL;
+	size_t node_count = 0, node_alloc = 0;
+	size_t data_count = 0, data_alloc = 0;
+	while (count) {
+		if (count > budget) {
+			rc = -ELOOP;
+			break;
+		}
+		budget -= count;
+		if ((rc = load_cb(self->opaque, level, count)) < 0)
+			break;
+		size_t next_count = 0;
+		for (size_t i = 0; rc == 0 && i != count; ++i) {
+			if (refcounts &&
+			    (rc = fdmt_appendBitmap(self->metadata_space_map,
+			                            level[i], &node_maps,
+			                            &node_count,
+			                            &node_alloc)) < 0)
+			{
+				break;
+			}
+			if ( !(node = fdmt_getNode(self, level[i])) ) {
+				rc = -errno;
+				break;
+			}
+			uint32_t flags = FIES_LE(node->flags);
+			const uint64_t *values = btree_node_values(node);
+			const uint32_t entries = FIES_LE(node->nr_entries);
+			if (flags & INTERNAL_NODE) {
+				rc = fdmt_appendChildren(node, &next,
+				                         &next_count,
+				                         &next_alloc);
+			} else if (!(flags & LEAF_NODE)) {
+				rc = -EBADF;
+			} else if (refcounts) {
+				for (uint32_t j = 0; rc == 0 && j != entries;
+				     ++j)
+				{
+					// First 24 bits are a time stamp.
+					rc = fdmt_appendBitmap(
+						self->data_space_map,
+						FIES_LE(values[j]) >> 24,
+						&data_maps, &data_count,
+						&data_alloc);
+				}
+			}
+			fdmt_putBlock(self, node);
+		}
+		if (rc < 0)
+			break;
+		uint64_t *tmp = level;
+		level = next;
+		next = tmp;
+		size_t tmp_alloc = level_alloc;
+		level_alloc = next_alloc;
+		next_alloc = tmp_alloc;
+		count = next_count;
+	}
+	free(level);
+	free(next);
+
+	if (rc == 0 && refcounts)
+		rc = fdmt_loadSpaceMap(self, self->metadata_space_map,
+		                       node_maps, node_count, load_cb, &budget);
+	if (rc == 0 && refcounts)
+		rc = fdmt_loadSpaceMap(self, self->data_space_map,
+		                       data_maps, data_count, load_cb, &budget);
+	free(node_maps);
+	free(data_maps);
+	return rc;
+}
+
 extern off_t
 FiesDMThin_mapAddress(FiesDMThin *self, uint32_t device, uint64_t logical)
 {
@@ -139,85 +556,860 @@ FiesDMThin_mapAddress(FiesDMThin *self, uint32_t device, uint64_t logical)
 	return (off_t)address;
 }
 
+// Nodes on the path are only acquired while a cursor function runs.
+static const btree_node*
+fdmt_cursorNode(FiesDMThin_Cursor *cursor, size_t depth)
+{
+	struct FiesDMThin_CursorLevel *level = &cursor->path[depth];
+	if (!level->node)
+		level->node = fdmt_getNode(cursor->dmthin, level->block);
+	return level->node;
+}
+
+static void
+fdmt_cursorPop(FiesDMThin_Cursor *cursor)
+{
+	struct FiesDMThin_CursorLevel *level = &cursor->path[--cursor->depth];
+	if (level->node) {
+		fdmt_putBlock(cursor->dmthin, level->node);
+		level->node = NULL;
+	}
+}
+
+static void
+fdmt_cursorRelease(FiesDMThin_Cursor *cursor)
+{
+	for (size_t i = 0; i != cursor->depth; ++i) {
+		struct FiesDMThin_CursorLevel *level = &cursor->path[i];
+		if (level->node) {
+			fdmt_putBlock(cursor->dmthin, level->node);
+			level->node = NULL;
+		}
+	}
+}
+
 static int
-fdmt_mapAddressRange(FiesDMThin       *self,
-                     uint64_t          pos,   // btree position
-                     uint64_t          begin, // block to start mapping from
-                     uint64_t          end,   // last+1 block to map to
-                     FiesFile_Extent  *out_buf,
-                     size_t            out_count,
-                     size_t           *index)
-{
-	const btree_node *node = fdmt_getBlock(self, pos);
-	if (!node)
-		return -errno;
+fdmt_cursorPush(FiesDMThin_Cursor *cursor,
+                uint64_t           block,
+                uint32_t           index,
+                const btree_node  *node)
+{
+	if (cursor->depth == FDMT_CURSOR_MAX_DEPTH) {
+		fdmt_putBlock(cursor->dmthin, node);
+		return -ELOOP;
+	}
+	bool shared = false;
+	if (cursor->query_flags & FIES_DMTHIN_QUERY_REFCOUNTS) {
+		shared = (cursor->depth && cursor->path[cursor->depth-1].shared)
+		         || fdmt_nodeShared(cursor->dmthin, block);
+	}
+	struct FiesDMThin_CursorLevel *level = &cursor->path[cursor->depth++];
+	level->block = block;
+	level->index = index;
+	level->prefetched = 0;
+	level->shared = shared;
+	level->node = node;
+	return 0;
+}
 
+// Announce the next children of an internal node we're going to visit.
+static void
+fdmt_cursorPrefetch(FiesDMThin_Cursor             *cursor,
+                    struct FiesDMThin_CursorLevel *level,
+                    const btree_node              *node)
+{
+	FiesDMThin *self = cursor->dmthin;
+	if (!self->prefetch_cb || level->index < level->prefetched ||
+	    !(FIES_LE(node->flags) & INTERNAL_NODE))
+	{
+		return;
+	}
 	const uint64_t *values = btree_node_values(node);
-	const uint32_t flags   = FIES_LE(node->flags);
 	const uint32_t entries = FIES_LE(node->nr_entries);
+	uint64_t blocks[FDMT_PREFETCH_WINDOW];
+	size_t count = 0;
+	uint32_t i = level->index;
+	for (; i < entries && count != FDMT_PREFETCH_WINDOW; ++i) {
+		if (FIES_LE(node->keys[i]) >= cursor->end)
+			break;
+		blocks[count++] = FIES_LE(values[i]);
+	}
+	level->prefetched = count == FDMT_PREFETCH_WINDOW ? i : entries;
+	if (count)
+		(void)self->prefetch_cb(self->opaque, blocks, count);
+}
 
-	int rc = 0;
-	if (!(flags & (INTERNAL_NODE | LEAF_NODE))) {
-		rc = -EBADF;
-		goto out;
+// Descend from `block` to the first entry of its leftmost leaf.
+static int
+fdmt_cursorDescend(FiesDMThin_Cursor *cursor, uint64_t block)
+{
+	while (true) {
+		const btree_node *node = fdmt_getNode(cursor->dmthin, block);
+		if (!node)
+			return -errno;
+		int rc = fdmt_cursorPush(cursor, block, 0, node);
+		if (rc < 0)
+			return rc;
+		if (!(FIES_LE(node->flags) & INTERNAL_NODE) ||
+		    !FIES_LE(node->nr_entries))
+		{
+			return 0;
+		}
+		fdmt_cursorPrefetch(cursor, &cursor->path[cursor->depth-1],
+		                    node);
+		block = FIES_LE(((const uint64_t*)btree_node_values(node))[0]);
+	}
+}
+
+// Drop exhausted nodes from the path and move on to the next leaf.
+static int
+fdmt_cursorAdvance(FiesDMThin_Cursor *cursor)
+{
+	fdmt_cursorPop(cursor); // the leaf
+	while (cursor->depth) {
+		struct FiesDMThin_CursorLevel *level =
+			&cursor->path[cursor->depth-1];
+		const btree_node *node = fdmt_cursorNode(cursor,
+		                                         cursor->depth-1);
+		if (!node)
+			return -errno;
+		if (++level->index < FIES_LE(node->nr_entries)) {
+			fdmt_cursorPrefetch(cursor, level, node);
+			const uint64_t *values = btree_node_values(node);
+			uint64_t child = FIES_LE(values[level->index]);
+			return fdmt_cursorDescend(cursor, child);
+		}
+		fdmt_cursorPop(cursor);
+	}
+	return 0;
+}
+
+static int
+fdmt_cursorInit(FiesDMThin_Cursor *cursor, FiesDMThin *self, uint32_t device)
+{
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->dmthin = self;
+	cursor->device = device;
+	cursor->end = (uint64_t)-1;
+	cursor->query_flags = self->query_flags;
+	return fdmt_searchRoot(self, device, &cursor->root);
+}
+
+extern FiesDMThin_Cursor*
+FiesDMThin_cursorNew(FiesDMThin *self, uint32_t device)
+{
+	FiesDMThin_Cursor *cursor = malloc(sizeof(*cursor));
+	if (!cursor)
+		return NULL;
+	int rc = fdmt_cursorInit(cursor, self, device);
+	if (rc == 0)
+		rc = FiesDMThin_cursorSeek(cursor, 0);
+	if (rc < 0) {
+		free(cursor);
+		errno = -rc;
+		return NULL;
+	}
+	return cursor;
+}
+
+extern void
+FiesDMThin_cursorDelete(FiesDMThin_Cursor *cursor)
+{
+	free(cursor);
+}
+
+extern uint32_t
+FiesDMThin_cursorDevice(const FiesDMThin_Cursor *cursor)
+{
+	return cursor->device;
+}
+
+extern uint64_t
+FiesDMThin_cursorPosition(const FiesDMThin_Cursor *cursor)
+{
+	return cursor->position;
+}
+
+extern int
+FiesDMThin_cursorSeek(FiesDMThin_Cursor *cursor, uint64_t logical)
+{
+	FiesDMThin *self = cursor->dmthin;
+	uint64_t key = logical / self->data_block_size;
+	uint64_t block = cursor->root;
+	int rc;
+
+	fdmt_cursorRelease(cursor);
+	cursor->depth = 0;
+	cursor->position = logical;
+	while (true) {
+		const btree_node *node = fdmt_getNode(self, block);
+		if (!node) {
+			rc = -errno;
+			break;
+		}
+		const uint32_t flags = FIES_LE(node->flags);
+		const uint32_t entries = FIES_LE(node->nr_entries);
+		if (flags & LEAF_NODE) {
+			// first entry at or after the key
+			uint32_t index =
+				(uint32_t)btree_node_search(node, key, true);
+			rc = fdmt_cursorPush(cursor, block, index, node);
+			break;
+		}
+		// last child starting at or before the key
+		long lindex = btree_node_search(node, key, false);
+		uint32_t index = lindex < 0 ? 0 : (uint32_t)lindex;
+		if ((rc = fdmt_cursorPush(cursor, block, index, node)) < 0)
+			break;
+		if (index == entries)
+			break;
+		fdmt_cursorPrefetch(cursor, &cursor->path[cursor->depth-1],
+		                    node);
+		const uint64_t *values = btree_node_values(node);
+		block = FIES_LE(values[index]);
+	}
+	fdmt_cursorRelease(cursor);
+	if (rc < 0)
+		cursor->depth = 0;
+	return rc;
+}
+
+// Where a cursor puts the extents it maps, one of the two kinds.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	FiesFile_Extent   *files;
+	FiesDMThin_Extent *extents;
+	size_t             count;
+	size_t             index;
+} fdmt_output;
+#pragma clang diagnostic pop
+
+// Append a block to the output, false if it is full.
+static bool
+fdmt_outputAdd(fdmt_output *out,
+               uint64_t     logical,
+               uint64_t     physical,
+               uint64_t     length,
+               uint32_t     flags,
+               uint32_t     refcount)
+{
+	if (out->files) {
+		FiesFile_Extent *ex =
+			out->index ? &out->files[out->index-1] : NULL;
+		if (ex && ex->flags == flags &&
+		    ex->physical + ex->length == physical &&
+		    ex->logical + ex->length == logical)
+		{
+			ex->length += length;
+			return true;
+		}
+		if (out->index == out->count)
+			return false;
+		ex = &out->files[out->index++];
+		ex->device = 0;
+		ex->flags = flags;
+		ex->physical = physical;
+		ex->logical = logical;
+		ex->length = length;
+		return true;
+	}
+
+	FiesDMThin_Extent *ex =
+		out->index ? &out->extents[out->index-1] : NULL;
+	if (ex && ex->flags == flags && ex->refcount == refcount &&
+	    ex->physical + ex->length == physical &&
+	    ex->logical + ex->length == logical)
+	{
+		ex->length += length;
+		return true;
+	}
+	if (out->index == out->count)
+		return false;
+	ex = &out->extents[out->index++];
+	ex->flags = flags;
+	ex->refcount = refcount;
+	ex->physical = physical;
+	ex->logical = logical;
+	ex->length = length;
+	return true;
+}
+
+// Cut the first extent to start at `position`, return the end of the last.
+static uint64_t
+fdmt_outputFinish(fdmt_output *out, uint64_t position)
+{
+	fies_pos *logical, *physical;
+	fies_sz *length;
+	if (out->files) {
+		logical = &out->files[0].logical;
+		physical = &out->files[0].physical;
+		length = &out->files[0].length;
+	} else {
+		logical = &out->extents[0].logical;
+		physical = &out->extents[0].physical;
+		length = &out->extents[0].length;
+	}
+	if (*logical < position) {
+		uint64_t shift = position - *logical;
+		if (*length <= shift) {
+			// shouldn't be possible
+			shift = *length;
+		}
+		*logical += shift;
+		*physical += shift;
+		*length -= shift;
+	}
+	if (out->files) {
+		const FiesFile_Extent *last = &out->files[out->index-1];
+		return last->logical + last->length;
 	}
+	const FiesDMThin_Extent *last = &out->extents[out->index-1];
+	return last->logical + last->length;
+}
+
+static ssize_t
+fdmt_cursorMap(FiesDMThin_Cursor *cursor, fdmt_output *out)
+{
+	FiesDMThin *self = cursor->dmthin;
+	const uint64_t dbs = self->data_block_size;
+	const bool refcounts =
+		!!(cursor->query_flags & FIES_DMTHIN_QUERY_REFCOUNTS);
+	// Only the query interface returns the counts themselves.
+	const bool exact = !out->files;
+	int rc = 0;
 
-	// Search for the current address
-	long lfrom = btree_node_search(node, begin, (flags & LEAF_NODE));
-	uint32_t from = lfrom < 0 ? 0 : (uint32_t)lfrom;
-	if (from == entries)
-		goto out; // higher than the last mapped chunk
+	while (cursor->depth) {
+		struct FiesDMThin_CursorLevel *level =
+			&cursor->path[cursor->depth-1];
+		const btree_node *node = fdmt_cursorNode(cursor,
+		                                         cursor->depth-1);
+		if (!node) {
+			rc = -errno;
+			break;
+		}
+		const uint32_t entries = FIES_LE(node->nr_entries);
+		if (!(FIES_LE(node->flags) & LEAF_NODE)) {
+			// Only an empty or exhausted internal node gets here.
+			if ((rc = fdmt_cursorAdvance(cursor)) < 0)
+				break;
+			continue;
+		}
 
-	if (flags & INTERNAL_NODE) {
-		// recurse into each node that may contain the address:
-		while (*index != out_count && from != entries) {
-			uint64_t next = FIES_LE(values[from]);
-			if (next >= end)
+		const uint64_t *values = btree_node_values(node);
+		bool full = false;
+		for (; level->index < entries; ++level->index) {
+			uint64_t logblock = FIES_LE(node->keys[level->index]);
+			if (logblock >= cursor->end) {
+				fdmt_cursorRelease(cursor);
+				cursor->depth = 0;
+				break;
+			}
+			// First 24 bits are a time stamp.
+			uint64_t physblock =
+				FIES_LE(values[level->index]) >> 24;
+			uint32_t flags = FIES_FL_DATA | FIES_FL_SHARED;
+			uint32_t refcount = 0;
+			if (refcounts) {
+				FiesDMThin_SpaceMap *sm = self->data_space_map;
+				refcount = fdmt_spaceMapCount(self, sm,
+				                              physblock, exact);
+				if (!level->shared && refcount == 1)
+					flags = FIES_FL_DATA;
+			}
+			if (!fdmt_outputAdd(out, logblock * dbs,
+			                    physblock * dbs, dbs,
+			                    flags, refcount))
+			{
+				full = true;
 				break;
+			}
+		}
+		if (full || !cursor->depth)
+			break;
+		if ((rc = fdmt_cursorAdvance(cursor)) < 0)
+			break;
+	}
+	fdmt_cursorRelease(cursor);
+	if (rc < 0) {
+		cursor->depth = 0;
+		return (ssize_t)rc;
+	}
+	if (!out->index)
+		return 0;
+	cursor->position = fdmt_outputFinish(out, cursor->position);
+	return (ssize_t)out->index;
+}
+
+extern ssize_t
+FiesDMThin_cursorNext(FiesDMThin_Cursor *cursor,
+                      FiesFile_Extent   *out_buf,
+                      size_t             out_count)
+{
+	fdmt_output out = { out_buf, NULL, out_count, 0 };
+	return fdmt_cursorMap(cursor, &out);
+}
+
+extern int
+FiesDMThin_deviceRoot(FiesDMThin *self, uint32_t device, uint64_t *root)
+{
+	return fdmt_searchRoot(self, device, root);
+}
+
+extern int
+FiesDMThin_deviceDetails(FiesDMThin                      *self,
+                         uint32_t                         device,
+                         struct FiesDMThin_DeviceDetails *details)
+{
+	struct thin_device_details disk;
+	int rc = fdmt_lookup(self, self->details_root, device,
+	                     &disk, sizeof(disk), NULL, NULL);
+	if (rc < 0)
+		return rc;
+	details->mapped_blocks = FIES_LE(disk.mapped_blocks);
+	details->transaction_id = FIES_LE(disk.transaction_id);
+	details->creation_time = FIES_LE(disk.creation_time);
+	details->snapshotted_time = FIES_LE(disk.snapshotted_time);
+	return 0;
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+// Merges consecutive extents before passing them on.
+typedef struct {
+	FiesDMThin_diff_t *cb;
+	void              *opaque;
+	FiesFile_Extent    pending;
+} fdmt_emitter;
+
+typedef struct {
+	FiesDMThin        *self;
+	fdmt_emitter       out;
+	unsigned int       origin_height;
+	// The last lookup in the origin tree, by height.
+	struct {
+		bool              valid;
+		uint64_t          block;
+		uint64_t          lo, hi; // key range
+		const btree_node *node;   // acquired while valid
+	} origin_path[FDMT_CURSOR_MAX_DEPTH];
+} fdmt_diff;
+#pragma clang diagnostic pop
+
+static int
+fdmt_treeHeight(FiesDMThin *self, uint64_t block, unsigned int *height)
+{
+	*height = 0;
+	while (true) {
+		const btree_node *node = fdmt_getNode(self, block);
+		if (!node)
+			return -errno;
+		bool leaf = FIES_LE(node->flags) & LEAF_NODE;
+		bool empty = !FIES_LE(node->nr_entries);
+		const uint64_t *values = btree_node_values(node);
+		if (!leaf && !empty)
+			block = FIES_LE(values[0]);
+		fdmt_putBlock(self, node);
+		if (leaf || empty)
+			return 0;
+		if (++*height == FDMT_CURSOR_MAX_DEPTH)
+			return -ELOOP;
+	}
+}
+
+static inline uint64_t
+fdmt_toBytes(FiesDMThin *self, uint64_t blocks)
+{
+	if (blocks > UINT64_MAX / self->data_block_size)
+		return UINT64_MAX;
+	return blocks * self->data_block_size;
+}
+
+static int
+fdmt_emitFlush(fdmt_emitter *out)
+{
+	if (!out->pending.length)
+		return 0;
+	int rc = out->cb(out->opaque, &out->pending);
+	out->pending.length = 0;
+	return rc;
+}
+
+// Copies are taken from the same logical offset of file `source`.
+static int
+fdmt_emit(fdmt_emitter *out, uint32_t flags, uint64_t logical,
+          uint64_t physical, uint64_t length, fies_id source)
+{
+	FiesFile_Extent *ex = &out->pending;
+	if (ex->length && ex->flags == flags &&
+	    ex->logical + ex->length == logical &&
+	    ((flags & FIES_FL_COPY) ? ex->source.file == source
+	                            : ex->physical + ex->length == physical))
+	{
+		ex->length += length;
+		return 0;
+	}
+	int rc = fdmt_emitFlush(out);
+	if (rc < 0)
+		return rc;
+	memset(ex, 0, sizeof(*ex));
+	ex->flags = flags;
+	ex->logical = logical;
+	ex->physical = physical;
+	ex->length = length;
+	ex->source.file = source;
+	ex->source.offset = logical;
+	return 0;
+}
+
+// Drop the cached origin path below `height`.
+static void
+fdmt_diffForget(fdmt_diff *diff, unsigned int height)
+{
+	for (unsigned int h = 0; h != height; ++h) {
+		if (diff->origin_path[h].node) {
+			fdmt_putBlock(diff->self, diff->origin_path[h].node);
+			diff->origin_path[h].node = NULL;
+		}
+		diff->origin_path[h].valid = false;
+	}
+}
+
+// Find the origin tree's node at `height` whose key range contains `key`.
+static int
+fdmt_diffOrigin(fdmt_diff *diff, unsigned int height, uint64_t key,
+                uint64_t *block, uint64_t *lo, uint64_t *hi)
+{
+	FiesDMThin *self = diff->self;
+	unsigned int at = diff->origin_height;
+	// Continue from the deepest cached node which still covers the key.
+	while (at > height) {
+		if (!diff->origin_path[at-1].valid ||
+		    key < diff->origin_path[at-1].lo ||
+		    key >= diff->origin_path[at-1].hi)
+		{
+			break;
+		}
+		--at;
+	}
+	fdmt_diffForget(diff, at);
+
+	while (at > height) {
+		const btree_node *node = diff->origin_path[at].node;
+		if (!node) {
+			node = fdmt_getNode(self, diff->origin_path[at].block);
+			if (!node)
+				return -errno;
+			diff->origin_path[at].node = node;
+		}
+		if (!(FIES_LE(node->flags) & INTERNAL_NODE))
+			return -EBADF;
+		const uint32_t entries = FIES_LE(node->nr_entries);
+		long index = btree_node_search(node, key, false);
+		if (index < 0) {
+			*block = 0; // nothing mapped there
+			return 0;
+		}
+		const uint64_t *values = btree_node_values(node);
+		uint32_t i = (uint32_t)index;
+		--at;
+		diff->origin_path[at].valid = true;
+		diff->origin_path[at].block = FIES_LE(values[i]);
+		diff->origin_path[at].lo = FIES_LE(node->keys[i]);
+		diff->origin_path[at].hi = i+1 < entries
+		                         ? FIES_LE(node->keys[i+1])
+		                         : diff->origin_path[at+1].hi;
+	}
+	*block = diff->origin_path[height].block;
+	*lo = diff->origin_path[height].lo;
+	*hi = diff->origin_path[height].hi;
+	return 0;
+}
+
+static int
+fdmt_diffNode(fdmt_diff *diff, uint64_t block, unsigned int height,
+              uint64_t lo, uint64_t hi, bool shared)
+{
+	FiesDMThin *self = diff->self;
+	int rc;
 
-			rc = fdmt_mapAddressRange(self, next, begin, end,
-			                          out_buf, out_count, index);
-			if (rc < 0)
-				goto out;
-			++from;
+	if (height <= diff->origin_height) {
+		uint64_t origin, olo = 0, ohi = 0;
+		if ((rc = fdmt_diffOrigin(diff, height, lo, &origin,
+		                          &olo, &ohi)) < 0)
+			return rc;
+		if (origin == block) {
+			// Shared subtree: its mappings lie within both ranges.
+			uint64_t from = lo > olo ? lo : olo;
+			uint64_t to = hi < ohi ? hi : ohi;
+			if (from >= to)
+				return 0;
+			uint64_t start = fdmt_toBytes(self, from);
+			return fdmt_emit(&diff->out, FIES_FL_COPY, start, 0,
+			                 fdmt_toBytes(self, to) - start, 0);
 		}
+	}
+
+	const bool refcounts =
+		!!(self->query_flags & FIES_DMTHIN_QUERY_REFCOUNTS);
+	if (refcounts && !shared)
+		shared = fdmt_nodeShared(self, block);
+
+	const btree_node *node = fdmt_getNode(self, block);
+	if (!node)
+		return -errno;
+	const uint32_t flags = FIES_LE(node->flags);
+	const uint32_t entries = FIES_LE(node->nr_entries);
+	const uint64_t *values = btree_node_values(node);
+	rc = 0;
+	if (!!(flags & LEAF_NODE) != !height) {
+		rc = -EBADF;
 	} else if (flags & LEAF_NODE) {
-		FiesFile_Extent *ex = &out_buf[*index - 1];
-		while (from != entries) {
+		const uint64_t dbs = self->data_block_size;
+		for (uint32_t i = 0; rc == 0 && i != entries; ++i) {
 			// First 24 bits are a time stamp.
-			uint64_t logblock = FIES_LE(node->keys[from]);
-			uint64_t logaddr = logblock * self->data_block_size;
-			uint64_t physblock = FIES_LE(values[from]) >> 24;
-			uint64_t physaddr = physblock * self->data_block_size;
-
-			// Can we concatenate the extent?
-			if (*index &&
-			    ex->physical + ex->length == physaddr &&
-			    ex->logical + ex->length == logaddr)
+			uint64_t logical = FIES_LE(node->keys[i]) * dbs;
+			uint64_t data = FIES_LE(values[i]) >> 24;
+			uint32_t exflags = FIES_FL_DATA | FIES_FL_SHARED;
+			if (refcounts && !shared &&
+			    fdmt_spaceMapCount(self, self->data_space_map,
+			                       data, false) == 1)
 			{
-				ex->length += self->data_block_size;
-			} else if (*index < out_count) {
-				ex = &out_buf[*index];
-				ex->device = 0;
-				ex->flags = FIES_FL_DATA | FIES_FL_SHARED;
-				ex->physical = physaddr;
-				ex->logical = logaddr;
-				ex->length = self->data_block_size;
-				++*index;
-			} else {
-				break;
+				exflags = FIES_FL_DATA;
 			}
-			++from;
+			rc = fdmt_emit(&diff->out, exflags, logical,
+			               data * dbs, dbs, 0);
 		}
 	} else {
-		rc = -EBADF;
+		for (uint32_t i = 0; rc == 0 && i != entries; ++i) {
+			uint64_t clo = FIES_LE(node->keys[i]);
+			uint64_t chi = i+1 < entries ? FIES_LE(node->keys[i+1])
+			                             : hi;
+			rc = fdmt_diffNode(diff, FIES_LE(values[i]), height-1,
+			                   clo, chi, shared);
+		}
 	}
+	fdmt_putBlock(self, node);
+	return rc;
+}
 
-out:
+extern int
+FiesDMThin_diff(FiesDMThin        *self,
+                uint32_t           device,
+                uint64_t           origin_root,
+                FiesDMThin_diff_t *diff_cb,
+                void              *opaque)
+{
+	uint64_t root;
+	int rc = fdmt_searchRoot(self, device, &root);
+	if (rc < 0)
+		return rc;
+
+	fdmt_diff diff;
+	memset(&diff, 0, sizeof(diff));
+	diff.self = self;
+	diff.out.cb = diff_cb;
+	diff.out.opaque = opaque;
+
+	unsigned int height;
+	if ((rc = fdmt_treeHeight(self, root, &height)) < 0 ||
+	    (rc = fdmt_treeHeight(self, origin_root,
+	                          &diff.origin_height)) < 0)
+	{
+		return rc;
+	}
+	diff.origin_path[diff.origin_height].valid = true;
+	diff.origin_path[diff.origin_height].block = origin_root;
+	diff.origin_path[diff.origin_height].lo = 0;
+	diff.origin_path[diff.origin_height].hi = UINT64_MAX;
+
+	rc = fdmt_diffNode(&diff, root, height, 0, UINT64_MAX, false);
+	fdmt_diffForget(&diff, diff.origin_height+1);
+	if (rc < 0)
+		return rc;
+	return fdmt_emitFlush(&diff.out);
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	uint64_t block; // 0 if unused, the superblock is never a btree node
+	uint64_t lo, hi;
+	uint32_t index; // of the device it was first visited for
+	uint32_t height;
+} fdmt_seenNode;
+
+typedef struct {
+	FiesDMThin              *self;
+	FiesDMThin_mapDevices_t *map_cb;
+	void                    *opaque;
+	uint32_t                 index; // of the device being walked
+	fdmt_emitter             out;
+	// Every node visited so far, open addressing.
+	fdmt_seenNode           *seen;
+	size_t                   seen_mask;
+	size_t                   seen_count;
+} fdmt_walk;
+#pragma clang diagnostic pop
+
+static int
+fdmt_walkExtent(void *opaque, const FiesFile_Extent *extent)
+{
+	fdmt_walk *walk = opaque;
+	return walk->map_cb(walk->opaque, walk->index, extent);
+}
+
+// The entry for `block`, or the free slot it belongs in.
+static fdmt_seenNode*
+fdmt_walkFind(fdmt_seenNode *table, size_t mask, uint64_t block)
+{
+	size_t i = (size_t)((block * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+	while (table[i].block && table[i].block != block)
+		i = (i+1) & mask;
+	return &table[i];
+}
+
+static int
+fdmt_walkRemember(fdmt_walk *walk, const fdmt_seenNode *node)
+{
+	if (2 * (walk->seen_count + 1) > walk->seen_mask + 1) {
+		size_t mask = walk->seen_mask * 2 + 1;
+		fdmt_seenNode *table = calloc(mask + 1, sizeof(*table));
+		if (!table)
+			return -ENOMEM;
+		for (size_t i = 0; i != walk->seen_mask + 1; ++i) {
+			const fdmt_seenNode *old = &walk->seen[i];
+			if (old->block)
+				*fdmt_walkFind(table, mask, old->block) = *old;
+		}
+		free(walk->seen);
+		walk->seen = table;
+		walk->seen_mask = mask;
+	}
+	*fdmt_walkFind(walk->seen, walk->seen_mask, node->block) = *node;
+	++walk->seen_count;
+	return 0;
+}
+
+static int
+fdmt_walkNode(fdmt_walk *walk, uint64_t block, unsigned int height,
+              uint64_t lo, uint64_t hi)
+{
+	FiesDMThin *self = walk->self;
+	int rc;
+
+	const fdmt_seenNode *seen =
+		fdmt_walkFind(walk->seen, walk->seen_mask, block);
+	if (seen->block) {
+		// A node can only appear once per tree.
+		if (seen->index == walk->index || seen->height != height)
+			return -EBADF;
+		// Shared subtree: its mappings lie within both ranges.
+		uint64_t from = lo > seen->lo ? lo : seen->lo;
+		uint64_t to = hi < seen->hi ? hi : seen->hi;
+		if (from >= to)
+			return 0;
+		uint64_t start = fdmt_toBytes(self, from);
+		return fdmt_emit(&walk->out, FIES_FL_COPY, start, 0,
+		                 fdmt_toBytes(self, to) - start, seen->index);
+	}
+	fdmt_seenNode entry = { block, lo, hi, walk->index, height };
+	if ((rc = fdmt_walkRemember(walk, &entry)) < 0)
+		return rc;
+
+	const btree_node *node = fdmt_getNode(self, block);
+	if (!node)
+		return -errno;
+	const uint32_t flags = FIES_LE(node->flags);
+	const uint32_t entries = FIES_LE(node->nr_entries);
+	const uint64_t *values = btree_node_values(node);
+	rc = 0;
+	if (!!(flags & LEAF_NODE) != !height) {
+		rc = -EBADF;
+	} else if (flags & LEAF_NODE) {
+		const uint64_t dbs = self->data_block_size;
+		for (uint32_t i = 0; rc == 0 && i != entries; ++i) {
+			// First 24 bits are a time stamp.
+			uint64_t logical = FIES_LE(node->keys[i]) * dbs;
+			uint64_t data = FIES_LE(values[i]) >> 24;
+			rc = fdmt_emit(&walk->out, FIES_FL_DATA, logical,
+			               data * dbs, dbs, 0);
+		}
+	} else {
+		for (uint32_t i = 0; rc == 0 && i != entries; ++i) {
+			uint64_t clo = FIES_LE(node->keys[i]);
+			uint64_t chi = i+1 < entries ? FIES_LE(node->keys[i+1])
+			                             : hi;
+			rc = fdmt_walkNode(walk, FIES_LE(values[i]), height-1,
+			                   clo, chi);
+		}
+	}
 	fdmt_putBlock(self, node);
 	return rc;
 }
 
+extern int
+FiesDMThin_mapDevices(FiesDMThin              *self,
+                      const uint32_t          *devices,
+                      size_t                   count,
+                      FiesDMThin_mapDevices_t *map_cb,
+                      void                    *opaque)
+{
+	if (count > UINT32_MAX)
+		return -EINVAL;
+
+	fdmt_walk walk;
+	memset(&walk, 0, sizeof(walk));
+	walk.self = self;
+	walk.map_cb = map_cb;
+	walk.opaque = opaque;
+	walk.out.cb = fdmt_walkExtent;
+	walk.out.opaque = &walk;
+	walk.seen_mask = 1023;
+	walk.seen = calloc(walk.seen_mask + 1, sizeof(*walk.seen));
+	if (!walk.seen)
+		return -ENOMEM;
+
+	int rc = 0;
+	for (size_t i = 0; rc == 0 && i != count; ++i) {
+		uint64_t root;
+		unsigned int height;
+		walk.index = (uint32_t)i;
+		if ((rc = fdmt_searchRoot(self, devices[i], &root)) < 0 ||
+		    (rc = fdmt_treeHeight(self, root, &height)) < 0)
+		{
+			break;
+		}
+		rc = fdmt_walkNode(&walk, root, height, 0, UINT64_MAX);
+		if (rc == 0)
+			rc = fdmt_emitFlush(&walk.out);
+	}
+	free(walk.seen);
+	return rc;
+}
+
+// Set up a cursor for the blocks in a byte range.
+static int
+fdmt_cursorRange(FiesDMThin_Cursor *cursor,
+                 FiesDMThin        *self,
+                 uint32_t           device,
+                 uint64_t           logical_start,
+                 uint64_t           length,
+                 uint32_t           query_flags)
+{
+	int rc = fdmt_cursorInit(cursor, self, device);
+	if (rc < 0)
+		return rc;
+
+	uint64_t begin = logical_start / self->data_block_size;
+	uint64_t end = begin + length / self->data_block_size;
+	if (end < begin) // overflow
+		end = (uint64_t)-1;
+	cursor->end = end;
+	cursor->query_flags = query_flags;
+	return FiesDMThin_cursorSeek(cursor, logical_start);
+}
+
 extern ssize_t
 FiesDMThin_mapExtents(FiesDMThin       *self,
                       uint32_t          device,
@@ -226,34 +1418,29 @@ FiesDMThin_mapExtents(FiesDMThin       *self,
                       FiesFile_Extent  *out_buf,
                       size_t            out_count)
 {
-	uint64_t at;
-	int rc = fdmt_searchRoot(self, device, &at);
+	FiesDMThin_Cursor cursor;
+	int rc = fdmt_cursorRange(&cursor, self, device, logical_start,
+	                          length, self->query_flags);
 	if (rc < 0)
 		return (ssize_t)rc;
+	fdmt_output out = { out_buf, NULL, out_count, 0 };
+	return fdmt_cursorMap(&cursor, &out);
+}
 
-	size_t index = 0;
-	uint64_t begin = logical_start / self->data_block_size;
-	uint64_t blocklen = length / self->data_block_size;
-	uint64_t end = begin + blocklen;
-	if (end < begin) // overflow
-		end = (uint64_t)-1;
-	rc = fdmt_mapAddressRange(self, at, begin, end,
-	                          out_buf, out_count, &index);
+extern ssize_t
+FiesDMThin_queryExtents(FiesDMThin        *self,
+                        uint32_t           device,
+                        uint64_t           logical_start,
+                        uint64_t           length,
+                        uint32_t           query_flags,
+                        FiesDMThin_Extent *out_buf,
+                        size_t             out_count)
+{
+	FiesDMThin_Cursor cursor;
+	int rc = fdmt_cursorRange(&cursor, self, device, logical_start,
+	                          length, query_flags);
 	if (rc < 0)
 		return (ssize_t)rc;
-
-	// cut the first block to the actual address
-	if (index && out_buf[0].logical < logical_start) {
-		uint64_t shift = logical_start - out_buf[0].logical;
-		out_buf[0].logical += shift;
-		out_buf[0].physical += shift;
-		if (out_buf[0].length <= shift) {
-			// shouldn't be possible
-			out_buf[0].length = 0;
-		} else {
-			out_buf[0].length -= shift;
-		}
-	}
-
-	return (ssize_t)index;
+	fdmt_output out = { NULL, out_buf, out_count, 0 };
+	return fdmt_cursorMap(&cursor, &out);
 }
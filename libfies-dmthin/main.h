@@ -12,5 +12,48 @@
 typedef struct FiesFile_Extent   FiesFile_Extent;
 typedef struct FiesDMThin        FiesDMThin;
 typedef struct FiesDMThin_Extent FiesDMThin_Extent;
+typedef struct FiesDMThin_Cursor FiesDMThin_Cursor;
+typedef struct FiesDMThin_SpaceMap FiesDMThin_SpaceMap;
+
+// Way deeper than any dm-thin btree can get.
+#define FDMT_CURSOR_MAX_DEPTH 16
+// Number of children of an internal node announced for prefetching at once.
+#define FDMT_PREFETCH_WINDOW 32
+// Number of bitmap blocks a space map reader keeps a copy of.
+#define FDMT_SPACE_MAP_CACHE 8
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct FiesDMThin_Cursor {
+	FiesDMThin *dmthin;
+	uint32_t    device;
+	uint64_t    root;     // the device's mapping tree
+	uint64_t    position; // in bytes
+	uint64_t    end;      // in data blocks
+	uint32_t    query_flags;
+	size_t      depth;    // 0 when done
+	struct FiesDMThin_CursorLevel {
+		uint64_t          block;
+		uint32_t          index;
+		uint32_t          prefetched; // children announced up to here
+		bool              shared; // this node or a parent is, refcounts
+		const btree_node *node; // only while in use
+	} path[FDMT_CURSOR_MAX_DEPTH];
+};
+
+// Bitmaps are looked up by their index in the space map, direct mapped.
+struct FiesDMThin_SpaceMap {
+	bool     metadata;    // indexed by a single block instead of a btree
+	uint64_t nr_blocks;
+	uint64_t bitmap_root;
+	uint64_t ref_count_root;
+	uint64_t entries;     // per bitmap block
+	struct FiesDMThin_SpaceMapBitmap {
+		uint64_t index;   // UINT64_MAX if unused
+		bool     bad;     // failed to read, counts are unknown
+		uint8_t *data;    // entries * 2 bits
+	} bitmaps[FDMT_SPACE_MAP_CACHE];
+};
+#pragma clang diagnostic pop
 
 #endif
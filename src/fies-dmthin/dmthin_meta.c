@@ -1,12 +1,14 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <linux/fs.h>
 #include <sys/ioctl.h>
@@ -19,19 +21,436 @@
 #include "../util.h"
 #include "fies_dmthin.h"
 
+#define CACHE_NONE SIZE_MAX
+
+unsigned long long meta_cache_hits = 0;
+unsigned long long meta_cache_misses = 0;
+unsigned long long meta_cache_prefetched = 0;
+
+static inline size_t
+ThinMetaCache_bucket(const ThinMetaCache *self, size_t blocknr)
+{
+	return (size_t)(((uint64_t)blocknr * 0x9E3779B97F4A7C15ULL)
+	                >> (64 - self->bucket_bits));
+}
+
+static void
+ThinMetaCache_lruUnlink(ThinMetaCache *self, size_t index)
+{
+	ThinMetaCacheSlot *slot = &self->slots[index];
+	if (slot->lru_prev != CACHE_NONE)
+		self->slots[slot->lru_prev].lru_next = slot->lru_next;
+	else
+		self->lru_head = slot->lru_next;
+	if (slot->lru_next != CACHE_NONE)
+		self->slots[slot->lru_next].lru_prev = slot->lru_prev;
+	else
+		self->lru_tail = slot->lru_prev;
+	slot->lru_prev = slot->lru_next = CACHE_NONE;
+}
+
+static void
+ThinMetaCache_lruPush(ThinMetaCache *self, size_t index, bool front)
+{
+	ThinMetaCacheSlot *slot = &self->slots[index];
+	if (front) {
+		slot->lru_prev = CACHE_NONE;
+		slot->lru_next = self->lru_head;
+		if (self->lru_head != CACHE_NONE)
+			self->slots[self->lru_head].lru_prev = index;
+		else
+			self->lru_tail = index;
+		self->lru_head = index;
+	} else {
+		slot->lru_next = CACHE_NONE;
+		slot->lru_prev = self->lru_tail;
+		if (self->lru_tail != CACHE_NONE)
+			self->slots[self->lru_tail].lru_next = index;
+		else
+			self->lru_head = index;
+		self->lru_tail = index;
+	}
+}
+
+static size_t
+ThinMetaCache_find(ThinMetaCache *self, size_t blocknr)
+{
+	size_t index = self->buckets[ThinMetaCache_bucket(self, blocknr)];
+	while (index != CACHE_NONE && self->slots[index].blocknr != blocknr)
+		index = self->slots[index].hash_next;
+	return index;
+}
+
+static void
+ThinMetaCache_unhash(ThinMetaCache *self, size_t index)
+{
+	ThinMetaCacheSlot *slot = &self->slots[index];
+	size_t bucket = ThinMetaCache_bucket(self, slot->blocknr);
+	size_t *link = &self->buckets[bucket];
+	while (*link != index)
+		link = &self->slots[*link].hash_next;
+	*link = slot->hash_next;
+	slot->valid = false;
+}
+
+static void
+ThinMetaCache_hash(ThinMetaCache *self, size_t index, size_t blocknr)
+{
+	ThinMetaCacheSlot *slot = &self->slots[index];
+	size_t *bucket = &self->buckets[ThinMetaCache_bucket(self, blocknr)];
+	slot->blocknr = blocknr;
+	slot->valid = true;
+	slot->hash_next = *bucket;
+	*bucket = index;
+}
+
+// Forget all blocks, eg. when switching to another metadata snapshot.
+static void
+ThinMetaCache_clear(ThinMetaCache *self)
+{
+	if (!self->slab)
+		return;
+	for (size_t i = 0; i != self->count; ++i) {
+		if (self->slots[i].valid)
+			ThinMetaCache_unhash(self, i);
+	}
+}
+
+static void
+ThinMetaCache_destroy(ThinMetaCache *self)
+{
+	free(self->slab);
+	free(self->slots);
+	free(self->buckets);
+	memset(self, 0, sizeof(*self));
+}
+
+static bool
+ThinMetaCache_init(ThinMetaCache *self, size_t blocksize, size_t bytes)
+{
+	memset(self, 0, sizeof(*self));
+	self->lru_head = self->lru_tail = CACHE_NONE;
+	size_t count = bytes / blocksize;
+	if (!count)
+		return true; // disabled
+	self->bucket_bits = 1;
+	while (((size_t)1 << self->bucket_bits) < count)
+		++self->bucket_bits;
+	self->slab = aligned_alloc(blocksize, count * blocksize);
+	self->slots = malloc(count * sizeof(*self->slots));
+	self->buckets = malloc(sizeof(*self->buckets) << self->bucket_bits);
+	if (!self->slab || !self->slots || !self->buckets) {
+		ThinMetaCache_destroy(self);
+		errno = ENOMEM;
+		return false;
+	}
+	self->count = count;
+	memset(self->buckets, 0xFF,
+	       sizeof(*self->buckets) << self->bucket_bits);
+	for (size_t i = 0; i != count; ++i) {
+		self->slots[i].valid = false;
+		self->slots[i].queued = false;
+		self->slots[i].pending = false;
+		self->slots[i].refs = 0;
+		self->slots[i].hash_next = CACHE_NONE;
+		self->slots[i].job_next = CACHE_NONE;
+		ThinMetaCache_lruPush(self, i, false);
+	}
+	return true;
+}
+
+// Upper limit for a single read of consecutive blocks while preloading.
+#define PRELOAD_READ_MAX (1024*1024)
+
+static void
+ThinMetaCopyChunk_destroy(void *pchunk)
+{
+	ThinMetaCopyChunk *chunk = pchunk;
+	free(chunk->data);
+}
+
+static int
+ThinMetaCopyBlock_cmp(const void *pa, const void *pb)
+{
+	const ThinMetaCopyBlock *a = pa;
+	const ThinMetaCopyBlock *b = pb;
+	return a->blocknr < b->blocknr ? -1 : a->blocknr > b->blocknr;
+}
+
+static int
+u64_cmp(const void *pa, const void *pb)
+{
+	uint64_t a = *(const uint64_t*)pa;
+	uint64_t b = *(const uint64_t*)pb;
+	return a < b ? -1 : a > b;
+}
+
+static void
+ThinMetaCopy_init(ThinMetaCopy *self)
+{
+	Vector_init_type(&self->index, ThinMetaCopyBlock);
+	Vector_init_type(&self->chunks, ThinMetaCopyChunk);
+	Vector_set_destructor(&self->chunks, ThinMetaCopyChunk_destroy);
+	self->bytes = 0;
+	self->sealed = false;
+}
+
+static void
+ThinMetaCopy_clear(ThinMetaCopy *self)
+{
+	Vector_clear(&self->index);
+	Vector_clear(&self->chunks);
+	self->bytes = 0;
+	self->sealed = false;
+}
+
+static const unsigned char*
+ThinMetaCopy_find(ThinMetaCopy *self, size_t blocknr)
+{
+	if (Vector_empty(&self->index))
+		return NULL;
+	const ThinMetaCopyBlock key = { blocknr, NULL };
+	const ThinMetaCopyBlock *found =
+		bsearch(&key, Vector_data(&self->index),
+		        Vector_length(&self->index), sizeof(key),
+		        ThinMetaCopyBlock_cmp);
+	return found ? found->data : NULL;
+}
+
+static bool
+ThinMetaCopy_owns(ThinMetaCopy *self, const void *block)
+{
+	const unsigned char *data = block;
+	ThinMetaCopyChunk *chunk;
+	Vector_foreach(&self->chunks, chunk) {
+		if (data >= chunk->data && data < chunk->data + chunk->size)
+			return true;
+	}
+	return false;
+}
+
+static bool
+ThinMeta_readBlock(ThinMeta *self, void *block, size_t block_number)
+{
+	ssize_t got = pread(self->fd, block, self->blocksize,
+	                    (off_t)(self->blocksize * block_number));
+	if ((size_t)got != self->blocksize) {
+		errno = got < 0 ? errno : EIO;
+		return false;
+	}
+	return true;
+}
+
+static void*
+ThinMetaReaders_thread(void *opaque)
+{
+	ThinMeta *self = opaque;
+	ThinMetaReaders *readers = &self->readers;
+	ThinMetaCache *cache = &self->cache;
+	pthread_mutex_lock(&readers->mutex);
+	while (true) {
+		while (readers->head == CACHE_NONE && !readers->quit)
+			pthread_cond_wait(&readers->work, &readers->mutex);
+		size_t index = readers->head;
+		if (index == CACHE_NONE)
+			break;
+		ThinMetaCacheSlot *slot = &cache->slots[index];
+		readers->head = slot->job_next;
+		if (readers->head == CACHE_NONE)
+			readers->tail = CACHE_NONE;
+		pthread_mutex_unlock(&readers->mutex);
+
+		int err = 0;
+		void *block = cache->slab + index * self->blocksize;
+		if (!ThinMeta_readBlock(self, block, slot->blocknr))
+			err = errno;
+
+		pthread_mutex_lock(&readers->mutex);
+		slot->error = err;
+		slot->pending = false;
+		pthread_cond_broadcast(&readers->done);
+	}
+	pthread_mutex_unlock(&readers->mutex);
+	return NULL;
+}
+
+static void
+ThinMetaReaders_start(ThinMeta *self, unsigned long jobs)
+{
+	ThinMetaReaders *readers = &self->readers;
+	pthread_mutex_init(&readers->mutex, NULL);
+	pthread_cond_init(&readers->work, NULL);
+	pthread_cond_init(&readers->done, NULL);
+	readers->head = readers->tail = CACHE_NONE;
+	readers->quit = false;
+	readers->count = 0;
+	readers->threads = malloc(jobs * sizeof(*readers->threads));
+	if (!readers->threads)
+		return;
+	for (unsigned long i = 0; i != jobs; ++i) {
+		int rc = pthread_create(&readers->threads[i], NULL,
+		                        ThinMetaReaders_thread, self);
+		if (rc != 0) {
+			fprintf(stderr,
+			        "fies-dmthin: failed to start thread: %s\n",
+			        strerror(rc));
+			break;
+		}
+		++readers->count;
+	}
+}
+
+// The readers drain their queue before they quit.
+static void
+ThinMetaReaders_stop(ThinMeta *self)
+{
+	ThinMetaReaders *readers = &self->readers;
+	if (!readers->threads)
+		return;
+	pthread_mutex_lock(&readers->mutex);
+	readers->quit = true;
+	pthread_cond_broadcast(&readers->work);
+	pthread_mutex_unlock(&readers->mutex);
+	for (size_t i = 0; i != readers->count; ++i)
+		pthread_join(readers->threads[i], NULL);
+	free(readers->threads);
+	readers->threads = NULL;
+	readers->count = 0;
+	pthread_cond_destroy(&readers->done);
+	pthread_cond_destroy(&readers->work);
+	pthread_mutex_destroy(&readers->mutex);
+}
+
+// Wait for a read ahead into the slot to finish, returns its errno.
+static int
+ThinMeta_waitSlot(ThinMeta *self, size_t index)
+{
+	ThinMetaCacheSlot *slot = &self->cache.slots[index];
+	if (!slot->queued)
+		return 0;
+	ThinMetaReaders *readers = &self->readers;
+	pthread_mutex_lock(&readers->mutex);
+	while (slot->pending)
+		pthread_cond_wait(&readers->done, &readers->mutex);
+	int err = slot->error;
+	pthread_mutex_unlock(&readers->mutex);
+	slot->queued = false;
+	return err;
+}
+
+static void
+ThinMeta_waitReaders(ThinMeta *self)
+{
+	for (size_t i = 0; i != self->cache.count; ++i) {
+		if (ThinMeta_waitSlot(self, i) != 0)
+			ThinMetaCache_unhash(&self->cache, i);
+	}
+}
+
+// Queue reads of btree nodes the library is going to need next into free
+// cache slots.
+static int
+ThinMeta_prefetch(void *opaque, const uint64_t *blocks, size_t count)
+{
+	ThinMeta *self = opaque;
+	ThinMetaCache *cache = &self->cache;
+	ThinMetaReaders *readers = &self->readers;
+	if (!readers->count || self->copy.sealed)
+		return 0;
+	// Don't push out what the current lookup still needs.
+	if (count > cache->count / 4)
+		count = cache->count / 4;
+	for (size_t i = 0; i != count; ++i) {
+		size_t block_number = (size_t)blocks[i];
+		if (ThinMetaCopy_find(&self->copy, block_number) ||
+		    ThinMetaCache_find(cache, block_number) != CACHE_NONE)
+		{
+			continue;
+		}
+		size_t index = cache->lru_tail;
+		if (index == CACHE_NONE || cache->slots[index].queued)
+			break;
+		ThinMetaCacheSlot *slot = &cache->slots[index];
+		ThinMetaCache_lruUnlink(cache, index);
+		if (slot->valid)
+			ThinMetaCache_unhash(cache, index);
+		ThinMetaCache_hash(cache, index, block_number);
+		ThinMetaCache_lruPush(cache, index, true);
+		slot->queued = true;
+
+		pthread_mutex_lock(&readers->mutex);
+		slot->pending = true;
+		slot->error = 0;
+		slot->job_next = CACHE_NONE;
+		if (readers->tail != CACHE_NONE)
+			cache->slots[readers->tail].job_next = index;
+		else
+			readers->head = index;
+		readers->tail = index;
+		pthread_cond_signal(&readers->work);
+		pthread_mutex_unlock(&readers->mutex);
+		++meta_cache_prefetched;
+	}
+	return 0;
+}
+
 static const void*
 ThinMeta_getBlock(void *opaque, size_t block_number)
 {
 	ThinMeta *self = opaque;
+	ThinMetaCache *cache = &self->cache;
+
+	const unsigned char *copied = ThinMetaCopy_find(&self->copy,
+	                                                block_number);
+	if (copied)
+		return copied;
+	if (self->copy.sealed) {
+		// The device may have been changed since the snapshot was
+		// released.
+		errno = ESTALE;
+		return NULL;
+	}
+
+	if (cache->slab) {
+		size_t index = ThinMetaCache_find(cache, block_number);
+		if (index != CACHE_NONE && ThinMeta_waitSlot(self, index) != 0)
+		{
+			// read ahead failed, try again below
+			ThinMetaCache_unhash(cache, index);
+			index = CACHE_NONE;
+		}
+		if (index != CACHE_NONE) {
+			++meta_cache_hits;
+			if (!cache->slots[index].refs++)
+				ThinMetaCache_lruUnlink(cache, index);
+			return cache->slab + index * self->blocksize;
+		}
+	}
+	++meta_cache_misses;
+
+	// Use the least recently used block unless everything is pinned.
+	if (cache->slab && cache->lru_tail != CACHE_NONE) {
+		size_t index = cache->lru_tail;
+		ThinMetaCacheSlot *slot = &cache->slots[index];
+		(void)ThinMeta_waitSlot(self, index);
+		ThinMetaCache_lruUnlink(cache, index);
+		if (slot->valid)
+			ThinMetaCache_unhash(cache, index);
+		void *block = cache->slab + index * self->blocksize;
+		if (!ThinMeta_readBlock(self, block, block_number)) {
+			ThinMetaCache_lruPush(cache, index, false);
+			return NULL;
+		}
+		ThinMetaCache_hash(cache, index, block_number);
+		slot->refs = 1;
+		return block;
+	}
 
 	void *block = aligned_alloc(self->blocksize, self->blocksize);
 	if (!block)
 		return NULL;
-	ssize_t got = pread(self->fd, block, self->blocksize,
-	                    (off_t)(self->blocksize * block_number));
-
-	if ((size_t)got != self->blocksize) {
-		int err = got < 0 ? errno : EIO;
+	if (!ThinMeta_readBlock(self, block, block_number)) {
+		int err = errno;
 		free(block);
 		errno = err;
 		return NULL;
@@ -42,7 +461,19 @@ ThinMeta_getBlock(void *opaque, size_t block_number)
 static void
 ThinMeta_putBlock(void *opaque, const void *block)
 {
-	(void)opaque;
+	ThinMeta *self = opaque;
+	ThinMetaCache *cache = &self->cache;
+	const unsigned char *data = block;
+	if (ThinMetaCopy_owns(&self->copy, block))
+		return;
+	if (cache->slab && data >= cache->slab &&
+	    data < cache->slab + cache->count * self->blocksize)
+	{
+		size_t index = (size_t)(data - cache->slab) / self->blocksize;
+		if (!--cache->slots[index].refs)
+			ThinMetaCache_lruPush(cache, index, true);
+		return;
+	}
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wcast-qual"
 	free((void*)block);
@@ -88,6 +519,20 @@ ThinMeta_new(const char *name,
 	}
 
 	ThinMeta *self = u_malloc0(sizeof(*self));
+	ThinMetaCopy_init(&self->copy);
+	ThinMetaPlan_init(&self->plan);
+	if (!ThinMetaCache_init(&self->cache, blocksize,
+	                        (size_t)opt_metadata_cache))
+	{
+		fprintf(stderr, "fies: failed to allocate metadata cache: %s\n",
+		        strerror(errno));
+		free(self);
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (opt_metadata_jobs > 1 && self->cache.slab)
+		ThinMetaReaders_start(self, opt_metadata_jobs);
 	self->name = strdup(name);
 	self->poolname = strdup(poolname);
 	self->size = size512s * 512;
@@ -118,8 +563,14 @@ ThinMeta_delete(ThinMeta *self)
 {
 	if (!self)
 		return;
+	ThinMetaReaders_stop(self);
 	close(self->fd);
 	ThinMeta_release(self);
+	FiesDMThin_cursorDelete(self->cursor);
+	FiesDMThin_delete(self->dmthin);
+	ThinMetaCache_destroy(&self->cache);
+	ThinMetaCopy_clear(&self->copy);
+	Vector_destroy(&self->plan);
 	free(self->name);
 	free(self->poolname);
 	free(self);
@@ -147,6 +598,13 @@ ThinMeta_loadRoot(ThinMeta *self, bool reserve)
 		}
 		self->release = true;
 	}
+	// Blocks of a previous snapshot may have been reused since.
+	ThinMeta_waitReaders(self);
+	ThinMetaCache_clear(&self->cache);
+	ThinMetaCopy_clear(&self->copy);
+	FiesDMThin_cursorDelete(self->cursor);
+	self->cursor = NULL;
+	FiesDMThin_delete(self->dmthin);
 	self->dmthin = FiesDMThin_new(self, self->size, self->blocksize,
 	                              ThinMeta_getBlock,
 	                              ThinMeta_putBlock);
@@ -157,10 +615,110 @@ ThinMeta_loadRoot(ThinMeta *self, bool reserve)
 		errno = saved_errno;
 		return false;
 	}
+	if (self->readers.count)
+		FiesDMThin_setPrefetch(self->dmthin, ThinMeta_prefetch);
+	if (opt_refcounts)
+		FiesDMThin_setQueryFlags(self->dmthin,
+		                         FIES_DMTHIN_QUERY_REFCOUNTS);
 
 	return true;
 }
 
+static int
+ThinMeta_loadBlocks(void *opaque, const uint64_t *blocks, size_t count)
+{
+	ThinMeta *self = opaque;
+	ThinMetaCopy *copy = &self->copy;
+
+	uint64_t *sorted = malloc(count * sizeof(*sorted));
+	if (!sorted)
+		return -ENOMEM;
+	memcpy(sorted, blocks, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), u64_cmp);
+
+	// Drop duplicates and blocks we already have.
+	size_t unique = 0;
+	for (size_t i = 0; i != count; ++i) {
+		if (unique && sorted[unique-1] == sorted[i])
+			continue;
+		if (sorted[i] >= self->size / self->blocksize) {
+			free(sorted);
+			return -EBADF;
+		}
+		if (ThinMetaCopy_find(copy, (size_t)sorted[i]))
+			continue;
+		sorted[unique++] = sorted[i];
+	}
+	if (!unique) {
+		free(sorted);
+		return 0;
+	}
+
+	ThinMetaCopyChunk chunk;
+	chunk.size = unique * self->blocksize;
+	chunk.data = aligned_alloc(self->blocksize, chunk.size);
+	if (!chunk.data) {
+		free(sorted);
+		return -ENOMEM;
+	}
+
+	// Read runs of consecutive blocks with as few calls as possible.
+	size_t max_run = PRELOAD_READ_MAX / self->blocksize;
+	if (!max_run)
+		max_run = 1;
+	for (size_t i = 0; i != unique;) {
+		size_t run = 1;
+		while (i + run != unique && run != max_run &&
+		       sorted[i + run] == sorted[i] + run)
+		{
+			++run;
+		}
+		size_t bytes = run * self->blocksize;
+		off_t offset = (off_t)(sorted[i] * self->blocksize);
+		ssize_t got = pread(self->fd, chunk.data + i * self->blocksize,
+		                    bytes, offset);
+		if (got < 0 || (size_t)got != bytes) {
+			int err = got < 0 ? errno : EIO;
+			free(chunk.data);
+			free(sorted);
+			return -err;
+		}
+		i += run;
+	}
+
+	Vector_push(&copy->chunks, &chunk);
+	for (size_t i = 0; i != unique; ++i) {
+		ThinMetaCopyBlock entry = {
+			(size_t)sorted[i],
+			chunk.data + i * self->blocksize
+		};
+		Vector_push(&copy->index, &entry);
+	}
+	qsort(Vector_data(&copy->index), Vector_length(&copy->index),
+	      sizeof(ThinMetaCopyBlock), ThinMetaCopyBlock_cmp);
+	copy->bytes += chunk.size;
+	free(sorted);
+	return 0;
+}
+
+// Copy all the metadata needed to map `dev` so that the metadata snapshot can
+// be released right away.
+bool
+ThinMeta_preload(ThinMeta *self, unsigned dev)
+{
+	ThinMetaCopy_clear(&self->copy);
+	int rc = FiesDMThin_loadDevice(self->dmthin, dev, ThinMeta_loadBlocks);
+	if (rc < 0) {
+		ThinMetaCopy_clear(&self->copy);
+		errno = -rc;
+		return false;
+	}
+	// Once a reserved snapshot is released, blocks missing from the copy
+	// can no longer be read consistently.
+	self->copy.sealed = self->release;
+	return true;
+}
+
 GHashTable*
 ThinMetaTable_new()
 {
@@ -225,7 +783,294 @@ ThinMeta_map(ThinMeta        *self,
              FiesFile_Extent *output,
              size_t           count)
 {
-	return FiesDMThin_mapExtents(self->dmthin, dev, logical_start,
-	                             (uint64_t)-1, // to end
-	                             output, count);
+	// Consecutive calls for a volume continue where the previous one
+	// stopped instead of searching the btrees from the top again.
+	if (self->cursor && FiesDMThin_cursorDevice(self->cursor) != dev) {
+		FiesDMThin_cursorDelete(self->cursor);
+		self->cursor = NULL;
+	}
+	if (!self->cursor) {
+		self->cursor = FiesDMThin_cursorNew(self->dmthin, dev);
+		if (!self->cursor)
+			return -errno;
+	}
+	if (FiesDMThin_cursorPosition(self->cursor) != logical_start) {
+		int rc = FiesDMThin_cursorSeek(self->cursor, logical_start);
+		if (rc < 0)
+			return rc;
+	}
+	return FiesDMThin_cursorNext(self->cursor, output, count);
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	Vector *extents;
+	fies_sz size;
+	fies_sz source_size;
+	fies_id source;
+} ThinMetaDiff;
+#pragma clang diagnostic pop
+
+static int
+ThinMeta_diffExtent(void *opaque, const FiesFile_Extent *extent)
+{
+	ThinMetaDiff *diff = opaque;
+	// Copies can only come from within the previous volume, the rest of
+	// a shared range is a hole.
+	fies_sz size = diff->size;
+	if (extent->flags & FIES_FL_COPY && diff->source_size < size)
+		size = diff->source_size;
+	if (extent->logical >= size)
+		return 0;
+	FiesFile_Extent ex = *extent;
+	if (ex.length > size - ex.logical)
+		ex.length = size - ex.logical;
+	if (ex.flags & FIES_FL_COPY)
+		ex.source.file = diff->source;
+	Vector_push(diff->extents, &ex);
+	return 0;
+}
+
+// Copies cover whole shared subtrees including their unmapped blocks. Narrow
+// them down to the ranges the previous volume maps, leaving holes in between.
+static int
+ThinMeta_diffCopies(ThinMeta *self, Vector *extents)
+{
+	const fies_sz dbs = self->dmthin->data_block_size;
+	Vector narrowed;
+	Vector_init_type(&narrowed, FiesFile_Extent);
+	int rc = 0;
+	FiesFile_Extent *ex;
+	Vector_foreach(extents, ex) {
+		if (!(ex->flags & FIES_FL_COPY)) {
+			Vector_push(&narrowed, ex);
+			continue;
+		}
+		const fies_pos end = ex->logical + ex->length;
+		fies_pos at = ex->logical;
+		while (at < end) {
+			FiesFile_Extent mapped[64];
+			const size_t count = sizeof(mapped)/sizeof(mapped[0]);
+			// the cursor only covers whole blocks
+			const fies_sz length = (end - at + dbs - 1) / dbs * dbs;
+			ssize_t got = FiesDMThin_mapExtents(self->dmthin,
+			                                    self->prev_devid,
+			                                    at, length,
+			                                    mapped, count);
+			if (got < 0) {
+				rc = (int)got;
+				goto out;
+			}
+			for (size_t i = 0; i != (size_t)got; ++i) {
+				FiesFile_Extent part = *ex;
+				part.logical = mapped[i].logical;
+				if (part.logical < at)
+					part.logical = at;
+				fies_pos to = mapped[i].logical
+				            + mapped[i].length;
+				if (to > end)
+					to = end;
+				if (part.logical >= to)
+					continue;
+				part.length = to - part.logical;
+				part.source.offset = part.logical;
+				Vector_push(&narrowed, &part);
+			}
+			if ((size_t)got != count)
+				break;
+			at = mapped[count-1].logical + mapped[count-1].length;
+		}
+	}
+	Vector_clear(extents);
+	Vector_foreach(&narrowed, ex)
+		Vector_push(extents, ex);
+out:
+	Vector_destroy(&narrowed);
+	return rc;
+}
+
+static int
+ThinMeta_version(ThinMeta *self, unsigned dev, ThinMetaVersion *version)
+{
+	int rc = FiesDMThin_deviceRoot(self->dmthin, dev, &version->root);
+	if (rc < 0)
+		return rc;
+	return FiesDMThin_deviceDetails(self->dmthin, dev, &version->details);
+}
+
+// Map `dev` as a list of changes against the previously exported volume if
+// that one has not been modified since. Otherwise returns false with errno
+// set to 0. `version` is set in any case, for ThinMeta_setPrevious().
+bool
+ThinMeta_diff(ThinMeta        *self,
+              unsigned         dev,
+              fies_sz          size,
+              ThinMetaVersion *version,
+              Vector          *extents)
+{
+	int rc = ThinMeta_version(self, dev, version);
+	if (rc < 0) {
+		memset(version, 0, sizeof(*version));
+		errno = -rc;
+		return false;
+	}
+	errno = 0;
+	if (!self->prev_valid || self->prev_devid == dev)
+		return false;
+	// The previous snapshot was released since, so its root block may
+	// have been reused for a new version of the volume. The details
+	// catch those which were recreated, snapshotted or provisioned.
+	ThinMetaVersion prev;
+	rc = ThinMeta_version(self, self->prev_devid, &prev);
+	if (rc < 0 || prev.root != self->prev_version.root ||
+	    memcmp(&prev.details, &self->prev_version.details,
+	           sizeof(prev.details)))
+	{
+		verbose(VERBOSE_ACTIONS,
+		        "device %u changed since it was exported\n",
+		        self->prev_devid);
+		errno = 0;
+		return false;
+	}
+
+	ThinMetaDiff diff = {
+		extents, size, self->prev_size, self->prev_fileid
+	};
+	rc = FiesDMThin_diff(self->dmthin, dev, prev.root,
+	                     ThinMeta_diffExtent, &diff);
+	if (rc == 0)
+		rc = ThinMeta_diffCopies(self, extents);
+	if (rc < 0) {
+		Vector_clear(extents);
+		errno = -rc;
+		return false;
+	}
+	return true;
+}
+
+void
+ThinMeta_setPrevious(ThinMeta              *self,
+                     unsigned               dev,
+                     fies_sz                size,
+                     const ThinMetaVersion *version,
+                     fies_id                fileid)
+{
+	self->prev_valid = true;
+	self->prev_devid = dev;
+	self->prev_size = size;
+	self->prev_version = *version;
+	self->prev_fileid = fileid;
+}
+
+ssize_t
+ThinMeta_mapDiff(Vector          *extents,
+                 fies_pos         logical_start,
+                 FiesFile_Extent *output,
+                 size_t           count)
+{
+	// first extent ending after logical_start
+	size_t a = 0, b = Vector_length(extents);
+	while (a != b) {
+		size_t i = a + (b-a)/2;
+		const FiesFile_Extent *ex = Vector_at(extents, i);
+		if (ex->logical + ex->length <= logical_start)
+			a = i+1;
+		else
+			b = i;
+	}
+	size_t got = 0;
+	for (; a != Vector_length(extents) && got != count; ++a)
+		output[got++] = *(FiesFile_Extent*)Vector_at(extents, a);
+	if (got && output[0].logical < logical_start) {
+		fies_sz shift = logical_start - output[0].logical;
+		output[0].logical += shift;
+		output[0].length -= shift;
+		if (output[0].flags & FIES_FL_COPY)
+			output[0].source.offset += shift;
+		else
+			output[0].physical += shift;
+	}
+	return (ssize_t)got;
+}
+
+void
+ThinMeta_queue(ThinMeta *self, unsigned dev, fies_sz size)
+{
+	ThinMetaPlan_queue(&self->plan, dev, size);
+}
+
+// Map all queued volumes with one walk over the pool's metadata. Shared
+// subtrees and data blocks are only passed for the first volume using them,
+// later volumes copy them from there.
+bool
+ThinMeta_plan(ThinMeta *self)
+{
+	size_t count = Vector_length(&self->plan);
+	uint32_t *devices = malloc(count * sizeof(*devices));
+	if (!devices)
+		return false;
+	ThinMetaPlanned *vol;
+	size_t i = 0;
+	Vector_foreach(&self->plan, vol)
+		devices[i++] = vol->devid;
+	int rc = FiesDMThin_mapDevices(self->dmthin, devices, count,
+	                               ThinMetaPlan_extent, &self->plan);
+	free(devices);
+	if (rc == 0)
+		rc = ThinMetaPlan_resolve(&self->plan, self->poolname);
+	if (rc < 0) {
+		Vector_foreach(&self->plan, vol)
+			Vector_clear(&vol->extents);
+		errno = -rc;
+		return false;
+	}
+	self->planned = true;
+	return true;
+}
+
+// Claim the next planned entry for `dev`, volumes may be listed twice.
+bool
+ThinMeta_planned(ThinMeta *self, unsigned dev, size_t *index)
+{
+	for (size_t i = 0; i != Vector_length(&self->plan); ++i) {
+		ThinMetaPlanned *vol = Vector_at(&self->plan, i);
+		if (vol->devid != dev || vol->opened)
+			continue;
+		vol->opened = true;
+		*index = i;
+		return true;
+	}
+	return false;
+}
+
+void
+ThinMeta_setWritten(ThinMeta *self, size_t index, fies_id fileid)
+{
+	ThinMetaPlanned *vol = Vector_at(&self->plan, index);
+	vol->written = true;
+	vol->fileid = fileid;
+}
+
+ssize_t
+ThinMeta_mapPlanned(ThinMeta        *self,
+                    size_t           index,
+                    fies_pos         logical_start,
+                    FiesFile_Extent *output,
+                    size_t           count)
+{
+	ThinMetaPlanned *vol = Vector_at(&self->plan, index);
+	ssize_t got = ThinMeta_mapDiff(&vol->extents, logical_start,
+	                               output, count);
+	for (ssize_t i = 0; i < got; ++i) {
+		if (!(output[i].flags & FIES_FL_COPY))
+			continue;
+		const ThinMetaPlanned *source =
+			Vector_at(&self->plan, (size_t)output[i].source.file);
+		// Volumes are written in the order they were planned in.
+		if (!source->written)
+			return -EBADF;
+		output[i].source.file = source->fileid;
+	}
+	return got;
 }
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../../lib/util.h"
+#include "../../lib/fies.h"
+#include "../cli_common.h"
+#include "dmthin_plan.h"
+
+// Planning of --single-pass exports, see ThinMeta_plan(). Works on the
+// extents passed by FiesDMThin_mapDevices() only, without the metadata.
+
+static int
+u64_cmp(const void *pa, const void *pb)
+{
+	uint64_t a = *(const uint64_t*)pa;
+	uint64_t b = *(const uint64_t*)pb;
+	return a < b ? -1 : a > b;
+}
+
+static void
+ThinMetaPlanned_destroy(void *pvol)
+{
+	ThinMetaPlanned *vol = pvol;
+	Vector_destroy(&vol->extents);
+}
+
+void
+ThinMetaPlan_init(Vector *plan)
+{
+	Vector_init_type(plan, ThinMetaPlanned);
+	Vector_set_destructor(plan, ThinMetaPlanned_destroy);
+}
+
+void
+ThinMetaPlan_queue(Vector *plan, unsigned dev, fies_sz size)
+{
+	ThinMetaPlanned vol;
+	memset(&vol, 0, sizeof(vol));
+	vol.devid = dev;
+	vol.size = size;
+	Vector_init_type(&vol.extents, FiesFile_Extent);
+	Vector_push(plan, &vol);
+}
+
+// Callback for FiesDMThin_mapDevices(), with the plan as `opaque`.
+int
+ThinMetaPlan_extent(void *opaque, size_t index, const FiesFile_Extent *extent)
+{
+	ThinMetaPlanned *vol = Vector_at(opaque, index);
+	if (extent->logical >= vol->size)
+		return 0;
+	FiesFile_Extent ex = *extent;
+	if (ex.length > vol->size - ex.logical)
+		ex.length = vol->size - ex.logical;
+	Vector_push(&vol->extents, &ex);
+	return 0;
+}
+
+// Copies of shared subtrees cover the subtree's whole key range, including
+// unmapped blocks, and the last one extends to the end of the volume. Narrow
+// them down to the ranges the source volume maps, which keeps them within
+// the source's size and leaves the rest as holes. Sources come earlier in
+// the plan, so their own copies are already narrowed down.
+static void
+ThinMetaPlan_copies(Vector *plan)
+{
+	Vector narrowed;
+	Vector_init_type(&narrowed, FiesFile_Extent);
+	ThinMetaPlanned *vol;
+	Vector_foreach(plan, vol) {
+		FiesFile_Extent *ex;
+		Vector_foreach(&vol->extents, ex) {
+			if (!(ex->flags & FIES_FL_COPY)) {
+				Vector_push(&narrowed, ex);
+				continue;
+			}
+			ThinMetaPlanned *source =
+				Vector_at(plan, (size_t)ex->source.file);
+			const fies_pos end = ex->logical + ex->length;
+			// first source extent ending after the copy's start
+			size_t a = 0, b = Vector_length(&source->extents);
+			while (a != b) {
+				size_t i = a + (b-a)/2;
+				const FiesFile_Extent *sx =
+					Vector_at(&source->extents, i);
+				if (sx->logical + sx->length <= ex->logical)
+					a = i+1;
+				else
+					b = i;
+			}
+			for (; a != Vector_length(&source->extents); ++a) {
+				const FiesFile_Extent *sx =
+					Vector_at(&source->extents, a);
+				if (sx->logical >= end)
+					break;
+				FiesFile_Extent part = *ex;
+				if (sx->logical > part.logical)
+					part.logical = sx->logical;
+				fies_pos to = sx->logical + sx->length;
+				if (to > end)
+					to = end;
+				part.length = to - part.logical;
+				part.source.offset = part.logical;
+				Vector_push(&narrowed, &part);
+			}
+		}
+		Vector_clear(&vol->extents);
+		Vector_foreach(&narrowed, ex)
+			Vector_push(&vol->extents, ex);
+		Vector_clear(&narrowed);
+	}
+	Vector_destroy(&narrowed);
+}
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	fies_pos physical;
+	fies_sz  length;
+	fies_pos logical;
+	size_t   index;
+} ThinMetaPlanRef;
+#pragma clang diagnostic pop
+
+static int
+ThinMetaPlanRef_cmp(const void *pa, const void *pb)
+{
+	const ThinMetaPlanRef *a = pa;
+	const ThinMetaPlanRef *b = pb;
+	if (a->physical != b->physical)
+		return a->physical < b->physical ? -1 : 1;
+	if (a->index != b->index)
+		return a->index < b->index ? -1 : 1;
+	return a->logical < b->logical ? -1 : a->logical > b->logical;
+}
+
+static int
+ThinMetaPlan_extentCmp(const void *pa, const void *pb)
+{
+	const FiesFile_Extent *a = pa;
+	const FiesFile_Extent *b = pb;
+	return a->logical < b->logical ? -1 : a->logical > b->logical;
+}
+
+// Sort a volume's extents and merge the pieces ThinMetaPlan_shared() cut.
+static void
+ThinMetaPlan_merge(Vector *extents)
+{
+	size_t count = Vector_length(extents);
+	FiesFile_Extent *list = Vector_data(extents);
+	qsort(list, count, sizeof(*list), ThinMetaPlan_extentCmp);
+	size_t out = 0;
+	for (size_t i = 0; i != count; ++i) {
+		FiesFile_Extent *ex = &list[i];
+		FiesFile_Extent *prev = out ? &list[out-1] : NULL;
+		if (prev && prev->flags == ex->flags &&
+		    prev->logical + prev->length == ex->logical &&
+		    ((ex->flags & FIES_FL_COPY)
+		      ? prev->source.file == ex->source.file &&
+		        prev->source.offset + prev->length == ex->source.offset
+		      : prev->physical + prev->length == ex->physical))
+		{
+			prev->length += ex->length;
+			continue;
+		}
+		list[out++] = *ex;
+	}
+	Vector_remove(extents, out, count - out);
+}
+
+// Data blocks mapped by more than one volume are only sent for the first of
+// them, the other volumes copy them from there. Sweeps over the data extents
+// of all volumes in physical order, cutting them where they overlap.
+static int
+ThinMetaPlan_shared(Vector *plan, const char *poolname)
+{
+	Vector refs;
+	Vector_init_type(&refs, ThinMetaPlanRef);
+	size_t index = 0;
+	ThinMetaPlanned *vol;
+	Vector_foreach(plan, vol) {
+		size_t count = Vector_length(&vol->extents);
+		size_t kept = 0;
+		for (size_t i = 0; i != count; ++i) {
+			FiesFile_Extent *ex = Vector_at(&vol->extents, i);
+			if (ex->flags & FIES_FL_COPY) {
+				*(FiesFile_Extent*)Vector_at(&vol->extents,
+				                             kept++) = *ex;
+				continue;
+			}
+			ThinMetaPlanRef ref = {
+				ex->physical, ex->length, ex->logical, index
+			};
+			Vector_push(&refs, &ref);
+		}
+		Vector_remove(&vol->extents, kept, count - kept);
+		++index;
+	}
+
+	size_t count = Vector_length(&refs);
+	ThinMetaPlanRef *list = Vector_data(&refs);
+	uint64_t *bounds = malloc(2 * count * sizeof(*bounds));
+	size_t *active = malloc(count * sizeof(*active));
+	if (count && (!bounds || !active)) {
+		free(bounds);
+		free(active);
+		Vector_destroy(&refs);
+		return -ENOMEM;
+	}
+	qsort(list, count, sizeof(*list), ThinMetaPlanRef_cmp);
+	for (size_t i = 0; i != count; ++i) {
+		bounds[2*i] = list[i].physical;
+		bounds[2*i+1] = list[i].physical + list[i].length;
+	}
+	qsort(bounds, 2*count, sizeof(*bounds), u64_cmp);
+
+	unsigned long long data_bytes = 0, copy_bytes = 0;
+	size_t next = 0, nactive = 0;
+	for (size_t k = 0; k+1 < 2*count; ++k) {
+		const fies_pos from = bounds[k], to = bounds[k+1];
+		if (from == to)
+			continue;
+		while (next != count && list[next].physical <= from)
+			active[nactive++] = next++;
+		// The first volume mapping the range sends it.
+		const ThinMetaPlanRef *owner = NULL;
+		size_t kept = 0;
+		for (size_t i = 0; i != nactive; ++i) {
+			const ThinMetaPlanRef *ref = &list[active[i]];
+			if (ref->physical + ref->length <= from)
+				continue;
+			active[kept++] = active[i];
+			if (!owner || ref->index < owner->index)
+				owner = ref;
+		}
+		nactive = kept;
+		for (size_t i = 0; i != nactive; ++i) {
+			const ThinMetaPlanRef *ref = &list[active[i]];
+			FiesFile_Extent ex;
+			memset(&ex, 0, sizeof(ex));
+			ex.logical = ref->logical + (from - ref->physical);
+			ex.length = to - from;
+			if (ref->index == owner->index) {
+				ex.flags = FIES_FL_DATA;
+				ex.physical = from;
+				data_bytes += ex.length;
+			} else {
+				ex.flags = FIES_FL_COPY;
+				ex.source.file = (fies_id)owner->index;
+				ex.source.offset = owner->logical +
+				                   (from - owner->physical);
+				copy_bytes += ex.length;
+			}
+			vol = Vector_at(plan, ref->index);
+			Vector_push(&vol->extents, &ex);
+		}
+	}
+	free(bounds);
+	free(active);
+	Vector_destroy(&refs);
+
+	Vector_foreach(plan, vol)
+		ThinMetaPlan_merge(&vol->extents);
+	verbose(VERBOSE_ACTIONS,
+	        "%s: %llu bytes of data, %llu bytes mapped more than once\n",
+	        poolname, data_bytes, copy_bytes);
+	return 0;
+}
+
+// Turn the extents passed to ThinMetaPlan_extent() into the final plan.
+int
+ThinMetaPlan_resolve(Vector *plan, const char *poolname)
+{
+	ThinMetaPlan_copies(plan);
+	return ThinMetaPlan_shared(plan, poolname);
+}
@@ -0,0 +1,28 @@
+#ifndef FIES_SRC_CLI_DMTHIN_PLAN_H
+#define FIES_SRC_CLI_DMTHIN_PLAN_H
+
+#include "../../lib/vector.h"
+#include "../../lib/fies.h"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+// A volume mapped by ThinMeta_plan(). Copies refer to volumes by their index
+// in the plan until they are looked up by ThinMeta_mapPlanned().
+typedef struct {
+	unsigned                         devid;
+	fies_sz                          size;
+	bool                             opened;
+	bool                             written;
+	fies_id                          fileid;
+	VectorOf(struct FiesFile_Extent) extents;
+} ThinMetaPlanned;
+#pragma clang diagnostic pop
+
+void ThinMetaPlan_init(Vector *plan);
+void ThinMetaPlan_queue(Vector *plan, unsigned dev, fies_sz size);
+int  ThinMetaPlan_extent(void *plan,
+                         size_t index,
+                         const struct FiesFile_Extent *extent);
+int  ThinMetaPlan_resolve(Vector *plan, const char *poolname);
+
+#endif
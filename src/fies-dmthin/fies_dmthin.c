@@ -34,6 +34,12 @@ static bool                  opt_incremental     = false;
 static const char           *opt_snapshot_list   = NULL;
 static const char           *opt_data_device     = NULL;
 static const char           *opt_metadata_device = NULL;
+unsigned long long           opt_metadata_cache  = 16*1024*1024;
+bool                         opt_preload_metadata = false;
+unsigned long                opt_metadata_jobs   = 1;
+bool                         opt_snapshot_diff   = false;
+bool                         opt_refcounts       = true;
+bool                         opt_single_pass     = false;
 
 static bool option_error = false;
 
@@ -57,6 +63,16 @@ usage(FILE *out, int exit_code)
 #define OPT_SNAPSHOT_LIST    (0x1000+'L')
 #define OPT_DATA_DEVICE      (0x1000+'d')
 #define OPT_METADATA_DEVICE  (0x1000+'m')
+#define OPT_METADATA_CACHE   (0x1100+'m')
+#define OPT_PRELOAD_METADATA (0x1100+'p')
+#define OPT_NO_PRELOAD_METADATA (0x1000+'p')
+#define OPT_METADATA_JOBS    (0x1000+'j')
+#define OPT_SNAPSHOT_DIFF    (0x1100+'D')
+#define OPT_NO_SNAPSHOT_DIFF (0x1000+'D')
+#define OPT_REFCOUNTS        (0x1100+'r')
+#define OPT_NO_REFCOUNTS     (0x1000+'r')
+#define OPT_SINGLE_PASS      (0x1100+'S')
+#define OPT_NO_SINGLE_PASS   (0x1000+'S')
 
 static struct option longopts[] = {
 	{ "help",                    no_argument, NULL, 'h' },
@@ -72,6 +88,16 @@ static struct option longopts[] = {
 	{ "snapshot-list",     required_argument, NULL, OPT_SNAPSHOT_LIST },
 	{ "data-device",       required_argument, NULL, OPT_DATA_DEVICE },
 	{ "metadata-device",   required_argument, NULL, OPT_METADATA_DEVICE },
+	{ "metadata-cache",    required_argument, NULL, OPT_METADATA_CACHE },
+	{ "preload-metadata",        no_argument, NULL, OPT_PRELOAD_METADATA },
+	{ "no-preload-metadata",     no_argument, NULL, OPT_NO_PRELOAD_METADATA },
+	{ "metadata-jobs",     required_argument, NULL, OPT_METADATA_JOBS },
+	{ "snapshot-diff",           no_argument, NULL, OPT_SNAPSHOT_DIFF },
+	{ "no-snapshot-diff",        no_argument, NULL, OPT_NO_SNAPSHOT_DIFF },
+	{ "refcounts",               no_argument, NULL, OPT_REFCOUNTS },
+	{ "no-refcounts",            no_argument, NULL, OPT_NO_REFCOUNTS },
+	{ "single-pass",             no_argument, NULL, OPT_SINGLE_PASS },
+	{ "no-single-pass",          no_argument, NULL, OPT_NO_SINGLE_PASS },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -107,6 +133,31 @@ handle_option(int c, int oopt, const char *oarg)
 	case OPT_SNAPSHOT_LIST:   opt_snapshot_list = oarg; break;
 	case OPT_DATA_DEVICE:     opt_data_device = oarg; break;
 	case OPT_METADATA_DEVICE: opt_metadata_device = oarg; break;
+	case OPT_METADATA_CACHE:
+		if (!str_to_size(oarg, &opt_metadata_cache)) {
+			fprintf(stderr, "fies-dmthin: "
+			        "invalid metadata cache size: %s\n", oarg);
+			option_error = true;
+		}
+		break;
+	case OPT_PRELOAD_METADATA:    opt_preload_metadata = true; break;
+	case OPT_NO_PRELOAD_METADATA: opt_preload_metadata = false; break;
+	case OPT_METADATA_JOBS:
+		if (!str_to_ulong(oarg, &opt_metadata_jobs) ||
+		    !opt_metadata_jobs || opt_metadata_jobs > 1024)
+		{
+			fprintf(stderr,
+			        "fies-dmthin: invalid number of jobs: %s\n",
+			        oarg);
+			option_error = true;
+		}
+		break;
+	case OPT_SNAPSHOT_DIFF:    opt_snapshot_diff = true; break;
+	case OPT_NO_SNAPSHOT_DIFF: opt_snapshot_diff = false; break;
+	case OPT_REFCOUNTS:        opt_refcounts = true; break;
+	case OPT_NO_REFCOUNTS:     opt_refcounts = false; break;
+	case OPT_SINGLE_PASS:      opt_single_pass = true; break;
+	case OPT_NO_SINGLE_PASS:   opt_single_pass = false; break;
 	case '?':
 		fprintf(stderr, "fies-dmthin: unrecognized option: %c\n",
 		        oopt);
@@ -352,7 +403,13 @@ typedef struct DMThinVolume {
 	ThinMeta *meta;
 	unsigned int devid;
 	int fd;
+	fies_sz size;
 	bool suspended;
+	ThinMetaVersion version;
+	bool diffed;
+	VectorOf(FiesFile_Extent) diff;
+	bool planned;
+	size_t plan_index;
 } DMTV;
 #pragma clang diagnostic pop
 
@@ -368,13 +425,29 @@ DMTV_destroy(DMTV *self)
 	free(self->volname);
 	if (self->fd >= 0)
 		close(self->fd);
+	Vector_destroy(&self->diff);
 	free(self);
 }
 
+static void
+DMTV_pdestroy(void *pself)
+{
+	DMTV *self = *(DMTV**)pself;
+	if (self)
+		DMTV_destroy(self);
+}
+
 static void
 DMTV_close(FiesFile *handle)
 {
-	DMTV_destroy(handle->opaque);
+	DMTV *self = handle->opaque;
+	if (self->planned)
+		ThinMeta_setWritten(self->meta, self->plan_index,
+		                    handle->fileid);
+	if (self->version.root)
+		ThinMeta_setPrevious(self->meta, self->devid, self->size,
+		                     &self->version, handle->fileid);
+	DMTV_destroy(self);
 }
 
 static ssize_t
@@ -409,6 +482,12 @@ DMTV_nextExtents(FiesFile *handle,
 {
 	(void)writer;
 	DMTV *self = handle->opaque;
+	if (self->planned)
+		return ThinMeta_mapPlanned(self->meta, self->plan_index,
+		                           logical_start, buffer, count);
+	if (self->diffed)
+		return ThinMeta_mapDiff(&self->diff, logical_start,
+		                        buffer, count);
 	return ThinMeta_map(self->meta, self->devid,
 	                    logical_start, buffer, count);
 }
@@ -422,10 +501,11 @@ dmthin_file_funcs = {
 	.get_os_fd     = DMTV_os_fd,
 };
 
-static FiesFile*
-DMThinVolume_open(const char *volume_or_device,
-                  FiesWriter *writer,
-                  GHashTable *thin_metadevs)
+// Look up the volume's pool and open it.
+static DMTV*
+DMThinVolume_new(const char *volume_or_device,
+                 FiesWriter *writer,
+                 GHashTable *thin_metadevs)
 {
 	int saved_errno, err;
 	const char *errstr = NULL;
@@ -435,6 +515,7 @@ DMThinVolume_open(const char *volume_or_device,
 		return NULL;
 
 	self->fd = -1;
+	Vector_init_type(&self->diff, FiesFile_Extent);
 
 	// Get the volume name, input could already be the name, but could also
 	// be a device node. We need a name to query the device mapper.
@@ -490,14 +571,88 @@ DMThinVolume_open(const char *volume_or_device,
 		errstr = "failed to get size of thin data volume";
 		goto out;
 	}
+	self->size = (fies_sz)bdev512secs * 512;
+	return self;
+
+out:
+	err = errno;
+	FiesWriter_setError(writer, err, errstr);
+	DMTV_destroy(self);
+	errno = err;
+	return NULL;
+}
+
+// Map the volume with the other volumes of its pool, see ThinMeta_plan().
+static bool
+DMThinVolume_usePlan(DMTV *self, const char **errstr)
+{
+	if (!self->meta->planned) {
+		self->suspended = true;
+		if (!ThinMeta_loadRoot(self->meta, true)) {
+			*errstr = "failed to reserve or load metadata snapshot";
+			return false;
+		}
+		if (!ThinMeta_plan(self->meta)) {
+			*errstr = "failed to map the pool's volumes";
+			return false;
+		}
+		ThinMeta_release(self->meta);
+	}
+	if (!ThinMeta_planned(self->meta, self->devid, &self->plan_index)) {
+		errno = ENOENT;
+		*errstr = "volume was not planned for";
+		return false;
+	}
+	self->planned = true;
+	return true;
+}
 
+// Map the volume on its own in the pool's metadata snapshot.
+static bool
+DMThinVolume_map(DMTV *self, const char **errstr)
+{
 	//if (!DMSuspend(self->volname, true)) {
-	//	errstr = "failed to suspend volume";
-	//	goto out;
+	//	*errstr = "failed to suspend volume";
+	//	return false;
 	//}
 	self->suspended = true;
 	if (!ThinMeta_loadRoot(self->meta, true)) {
-		errstr = "failed to reserve or load metadata snapshot";
+		*errstr = "failed to reserve or load metadata snapshot";
+		return false;
+	}
+	if (opt_snapshot_diff) {
+		self->diffed = ThinMeta_diff(self->meta, self->devid,
+		                             self->size, &self->version,
+		                             &self->diff);
+		if (!self->diffed && errno) {
+			*errstr = "failed to compare with the previous volume";
+			return false;
+		}
+		if (self->diffed)
+			ThinMeta_release(self->meta);
+	}
+	if (opt_preload_metadata && !self->diffed) {
+		if (!ThinMeta_preload(self->meta, self->devid)) {
+			*errstr = "failed to read the volume's metadata";
+			return false;
+		}
+		verbose(VERBOSE_ACTIONS, "%s: read %zu bytes of metadata\n",
+		        self->volname, self->meta->copy.bytes);
+		ThinMeta_release(self->meta);
+	}
+	return true;
+}
+
+static FiesFile*
+DMThinVolume_open(DMTV *self, FiesWriter *writer)
+{
+	int saved_errno, err;
+	const char *errstr = NULL;
+
+	if (opt_single_pass) {
+		if (!DMThinVolume_usePlan(self, &errstr))
+			goto out;
+	} else if (!DMThinVolume_map(self, &errstr)) {
 		goto out;
 	}
 
@@ -507,7 +662,7 @@ DMThinVolume_open(const char *volume_or_device,
 		goto out;
 	}
 	FiesFile *file = FiesFile_new(self, &dmthin_file_funcs,
-	                              xformed_name, NULL, bdev512secs*512,
+	                              xformed_name, NULL, self->size,
 	                              FIES_M_FREG | 0600,
 	                              self->meta->fid);
 	saved_errno = errno;
@@ -533,19 +688,32 @@ typedef struct RawDMThinVolume {
 	int data_fd;
 	unsigned int devid;
 	fies_sz size;
+	ThinMetaVersion version;
+	bool diffed;
+	VectorOf(FiesFile_Extent) diff;
+	bool planned;
+	size_t plan_index;
 } RawDMTV;
 
 static void
 RawDMTV_destroy(RawDMTV *self)
 {
 	// Don't close the data fd...
+	Vector_destroy(&self->diff);
 	free(self);
 }
 
 static void
 RawDMTV_close(FiesFile *handle)
 {
-	RawDMTV_destroy(handle->opaque);
+	RawDMTV *self = handle->opaque;
+	if (self->planned)
+		ThinMeta_setWritten(self->meta, self->plan_index,
+		                    handle->fileid);
+	if (self->version.root)
+		ThinMeta_setPrevious(self->meta, self->devid, self->size,
+		                     &self->version, handle->fileid);
+	RawDMTV_destroy(self);
 }
 
 static ssize_t
@@ -569,6 +737,12 @@ RawDMTV_nextExtents(FiesFile *handle,
 {
 	(void)writer;
 	RawDMTV *self = handle->opaque;
+	if (self->planned)
+		return ThinMeta_mapPlanned(self->meta, self->plan_index,
+		                           logical_start, buffer, count);
+	if (self->diffed)
+		return ThinMeta_mapDiff(&self->diff, logical_start,
+		                        buffer, count);
 	return ThinMeta_map(self->meta, self->devid,
 	                    logical_start, buffer, count);
 }
@@ -616,8 +790,34 @@ OpenThinVolume(const struct RawDeviceOpt *entry,
 		return NULL;
 	}
 	self->devid = entry->devid;
+	self->size = entry->size;
 	self->meta = meta;
 	self->data_fd = data_fd;
+	Vector_init_type(&self->diff, FiesFile_Extent);
+	if (opt_single_pass) {
+		self->planned = ThinMeta_planned(meta, self->devid,
+		                                 &self->plan_index);
+		if (!self->planned) {
+			free(xformed_name);
+			FiesWriter_setError(writer, ENOENT,
+			                    "volume was not planned for");
+			RawDMTV_destroy(self);
+			errno = ENOENT;
+			return NULL;
+		}
+	} else if (opt_snapshot_diff) {
+		self->diffed = ThinMeta_diff(meta, self->devid, entry->size,
+		                             &self->version, &self->diff);
+		if (!self->diffed && errno) {
+			int saved_errno = errno;
+			free(xformed_name);
+			FiesWriter_setError(writer, saved_errno,
+			    "failed to compare with the previous volume");
+			RawDMTV_destroy(self);
+			errno = saved_errno;
+			return NULL;
+		}
+	}
 
 	FiesFile *file = FiesFile_new(self, &raw_dmthin_file_funcs,
 	                              xformed_name, NULL, entry->size,
@@ -639,6 +839,8 @@ OpenThinVolume(const struct RawDeviceOpt *entry,
 
 static GHashTable *gThinMetaDevices = NULL;
 static ThinMeta *gRawMetaDevice = NULL;
+// Looked up before the first one is opened, for --single-pass.
+static VectorOf(DMTV*) gThinVolumes;
 
 static void
 cleanupDevices()
@@ -666,8 +868,10 @@ handleSignal()
 static void
 cleanupMain()
 {
+	Vector_destroy(&gThinVolumes);
 	cleanupDevices();
 	Vector_destroy(&opt_xform);
+	xform_cleanup();
 	Vector_destroy(&raw_device_entries);
 }
 
@@ -847,6 +1051,8 @@ main(int argc, char **argv)
 	Vector_set_destructor(&opt_xform, (Vector_dtor*)RexReplace_pdestroy);
 
 	Vector_init_type(&raw_device_entries, struct RawDeviceOpt);
+	Vector_init_type(&gThinVolumes, DMTV*);
+	Vector_set_destructor(&gThinVolumes, DMTV_pdestroy);
 
 	atexit(cleanupMain);
 	signal(SIGINT, handleSignal);
@@ -939,12 +1145,23 @@ main(int argc, char **argv)
 			    "fies-dmthin: failed to open metadata device\n");
 			goto out_err;
 		}
+		struct RawDeviceOpt *entry;
 		if (!ThinMeta_loadRoot(gRawMetaDevice, false)) {
 			fprintf(stderr, "fies-dmthin: "
 			        "failed to load metadata superblock\n");
 			goto out_err;
 		}
-		struct RawDeviceOpt *entry;
+		if (opt_single_pass) {
+			Vector_foreach(&raw_device_entries, entry)
+				ThinMeta_queue(gRawMetaDevice, entry->devid,
+				               entry->size);
+			if (!ThinMeta_plan(gRawMetaDevice)) {
+				fprintf(stderr, "fies-dmthin: "
+				        "failed to map the volumes: %s\n",
+				        strerror(errno));
+				goto out_err;
+			}
+		}
 		Vector_foreach(&raw_device_entries, entry) {
 			FiesFile *file =
 			    OpenThinVolume(entry, fies, gRawMetaDevice,
@@ -959,10 +1176,32 @@ main(int argc, char **argv)
 	} else {
 		gThinMetaDevices = ThinMetaTable_new();
 
+		// Each pool maps all of its volumes when the first one is
+		// opened, so they all need to be known in advance.
+		for (int i = optind; opt_single_pass && i != argc; ++i) {
+			DMTV *vol = DMThinVolume_new(argv[i], fies,
+			                             gThinMetaDevices);
+			if (!vol)
+				goto out_errno;
+			Vector_push(&gThinVolumes, &vol);
+			ThinMeta_queue(vol->meta, vol->devid, vol->size);
+		}
+
 		for (int i = optind; i != argc; ++i) {
 			const char *arg = argv[i];
-			FiesFile *file =
-			    DMThinVolume_open(arg, fies, gThinMetaDevices);
+			DMTV *vol;
+			if (opt_single_pass) {
+				DMTV **slot = Vector_at(&gThinVolumes,
+				                        (size_t)(i - optind));
+				vol = *slot;
+				*slot = NULL;
+			} else {
+				vol = DMThinVolume_new(arg, fies,
+				                       gThinMetaDevices);
+				if (!vol)
+					goto out_errno;
+			}
+			FiesFile *file = DMThinVolume_open(vol, fies);
 			if (!file)
 				goto out_errno;
 			verbose(VERBOSE_FILES, "%s\n", arg);
@@ -973,6 +1212,13 @@ main(int argc, char **argv)
 	}
 
 	err = 0;
+	if (!common.quiet && meta_cache_misses) {
+		fprintf(stderr,
+		        "fies-dmthin: metadata cache: %llu hits, %llu misses, "
+		        "%llu read ahead\n",
+		        meta_cache_hits, meta_cache_misses,
+		        meta_cache_prefetched);
+	}
 	goto out;
 
 out_errno:
@@ -1,8 +1,12 @@
 #ifndef FIES_SRC_CLI_DMTHIN_H
 #define FIES_SRC_CLI_DMTHIN_H
 
+#include <pthread.h>
+
 #include "../../lib/map.h"
+#include "../../lib/vector.h"
 #include "../../include/fies/dmthin.h"
+#include "dmthin_plan.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Weverything"
@@ -18,17 +22,105 @@ bool DMThinPoolInfo(const char *dmname,
 
 typedef struct FiesDMThin FiesDMThin;
 
+extern unsigned long long opt_metadata_cache;
+extern bool opt_preload_metadata;
+extern unsigned long opt_metadata_jobs;
+extern bool opt_snapshot_diff;
+extern bool opt_refcounts;
+extern bool opt_single_pass;
+extern unsigned long long meta_cache_hits;
+extern unsigned long long meta_cache_misses;
+extern unsigned long long meta_cache_prefetched;
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	size_t blocknr;
+	size_t refs;
+	size_t hash_next;
+	size_t lru_prev;
+	size_t lru_next;
+	size_t job_next;
+	bool   valid;
+	bool   queued;  // handed to the readers, not yet waited for
+	bool   pending; // read in progress (protected by the readers' mutex)
+	int    error;
+} ThinMetaCacheSlot;
+
+// Fixed number of metadata blocks kept in one aligned slab (for O_DIRECT).
+// Blocks handed out by the getBlock callback are pinned until put back, the
+// others are evicted in least recently used order.
+typedef struct {
+	unsigned char     *slab;
+	ThinMetaCacheSlot *slots;
+	size_t             count;
+	size_t            *buckets;
+	unsigned int       bucket_bits;
+	size_t             lru_head; // most recently used
+	size_t             lru_tail;
+} ThinMetaCache;
+
+// Threads reading announced btree nodes into the cache ahead of time.
+typedef struct {
+	pthread_t      *threads;
+	size_t          count;
+	pthread_mutex_t mutex;
+	pthread_cond_t  work;
+	pthread_cond_t  done;
+	size_t          head; // queue of cache slots to fill
+	size_t          tail;
+	bool            quit;
+} ThinMetaReaders;
+
+typedef struct {
+	size_t         blocknr;
+	unsigned char *data;
+} ThinMetaCopyBlock;
+
+typedef struct {
+	unsigned char *data;
+	size_t         size;
+} ThinMetaCopyChunk;
+
+// Private copy of the metadata blocks of one volume, read in sorted batches
+// so the reserved metadata snapshot can be released before the data export.
+typedef struct {
+	VectorOf(ThinMetaCopyBlock) index;  // sorted by block number
+	VectorOf(ThinMetaCopyChunk) chunks; // one aligned buffer per batch
+	size_t                      bytes;
+	bool                        sealed; // the snapshot is gone
+} ThinMetaCopy;
+
+// The state of a volume as of its export, for --snapshot-diff. Blocks are
+// reused once a metadata snapshot is released, so the root alone does not
+// prove that a volume is unchanged.
+typedef struct {
+	uint64_t                        root;
+	struct FiesDMThin_DeviceDetails details;
+} ThinMetaVersion;
+
 typedef struct {
 	char       *name;
 	char       *poolname;
 	FiesDMThin *dmthin;
+	struct FiesDMThin_Cursor *cursor; // of the volume being mapped
 	int         fd;
 	fies_id     fid;
 	size_t      size;
 	size_t      blocksize;
 	bool        release;
+	ThinMetaCache cache;
+	ThinMetaCopy  copy;
+	ThinMetaReaders readers;
+	// The volume exported last, for --snapshot-diff.
+	bool        prev_valid;
+	unsigned    prev_devid;
+	fies_sz     prev_size;
+	ThinMetaVersion prev_version;
+	fies_id     prev_fileid;
+	// All volumes to export from this pool, for --single-pass.
+	VectorOf(ThinMetaPlanned) plan;
+	bool        planned;
 } ThinMeta;
 #pragma clang diagnostic pop
 // For *raw* access only:
@@ -45,10 +137,34 @@ ThinMeta*   ThinMetaTable_addPool(GHashTable*,
                                   FiesWriter *writer);
 void ThinMeta_release(ThinMeta*);
 bool ThinMeta_loadRoot(ThinMeta*, bool reserve);
+bool ThinMeta_preload(ThinMeta*, unsigned dev);
 ssize_t ThinMeta_map(ThinMeta*,
                      unsigned dev,
                      fies_pos logical_start,
                      FiesFile_Extent *buffer,
                      size_t count);
+bool ThinMeta_diff(ThinMeta*,
+                   unsigned dev,
+                   fies_sz size,
+                   ThinMetaVersion *version,
+                   Vector *extents);
+void ThinMeta_setPrevious(ThinMeta*,
+                          unsigned dev,
+                          fies_sz size,
+                          const ThinMetaVersion *version,
+                          fies_id fileid);
+ssize_t ThinMeta_mapDiff(Vector *extents,
+                         fies_pos logical_start,
+                         FiesFile_Extent *buffer,
+                         size_t count);
+void ThinMeta_queue(ThinMeta*, unsigned dev, fies_sz size);
+bool ThinMeta_plan(ThinMeta*);
+bool ThinMeta_planned(ThinMeta*, unsigned dev, size_t *index);
+void ThinMeta_setWritten(ThinMeta*, size_t index, fies_id fileid);
+ssize_t ThinMeta_mapPlanned(ThinMeta*,
+                            size_t index,
+                            fies_pos logical_start,
+                            FiesFile_Extent *buffer,
+                            size_t count);
 
 #endif
@@ -34,6 +34,8 @@ static char   *opt_devname         = NULL;
 static char   *opt_filename        = NULL;
 static bool    opt_final_snapshot  = true;
 static bool    opt_wildcards_slash = false;
+static unsigned long long opt_writeback = 0;
+static bool    opt_skip_zeroes     = false;
 
 static bool option_error = false;
 
@@ -58,6 +60,9 @@ usage(FILE *out, int exit_code)
 #define OPT_RINCLUDE           (0x2100+'i')
 #define OPT_WILD_SLASH         (0x1200+'w')
 #define OPT_NO_WILD_SLASH      (0x2200+'w')
+#define OPT_WRITEBACK          (0x4000+'w')
+#define OPT_SKIP_ZEROES        (0x1100+'z')
+#define OPT_NO_SKIP_ZEROES     (0x1000+'z')
 
 static struct option longopts[] = {
 	{ "help",                     no_argument, NULL, 'h' },
@@ -83,6 +88,10 @@ static struct option longopts[] = {
 	{ "wildcards-match-slash",    no_argument, NULL, OPT_WILD_SLASH },
 	{ "no-wildcards-match-slash", no_argument, NULL, OPT_NO_WILD_SLASH},
 
+	{ "writeback",          required_argument, NULL, OPT_WRITEBACK },
+	{ "skip-zeroes",              no_argument, NULL, OPT_SKIP_ZEROES },
+	{ "no-skip-zeroes",           no_argument, NULL, OPT_NO_SKIP_ZEROES },
+
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -126,6 +135,16 @@ handle_option(int c, int oopt, const char *oarg)
 	case OPT_NO_FINAL_SNAP:  opt_final_snapshot = false; break;
 	case OPT_WILD_SLASH:     opt_wildcards_slash = true; break;
 	case OPT_NO_WILD_SLASH:  opt_wildcards_slash = false; break;
+	case OPT_SKIP_ZEROES:    opt_skip_zeroes = true; break;
+	case OPT_NO_SKIP_ZEROES: opt_skip_zeroes = false; break;
+	case OPT_WRITEBACK:
+		if (!str_to_size(oarg, &opt_writeback)) {
+			fprintf(stderr,
+			        "fies-restore: invalid writeback size: %s\n",
+			        oarg);
+			option_error = true;
+		}
+		break;
 
 	case OPT_EXCLUDE: {
 		FileMatch entry = {
@@ -188,6 +207,7 @@ static int     stream_fd         = STDIN_FILENO;
 static char   *snap_lastname     = NULL;
 static size_t  snap_size         = 0;
 static int     snap_outfd        = -1;
+static Writeback snap_writeback;
 static bool    snap_cur_done     = false;
 static char   *snap_cur_handle   = NULL;
 
@@ -195,6 +215,9 @@ static unsigned int snap_discard_zeroes = (unsigned int)-1;
 static int snap_can_punch_hole = -1;
 static int snap_can_zero_range = -1;
 
+// Granularity at which --skip-zeroes looks for zero blocks.
+#define SNAP_ZERO_BLOCK_SIZE ((size_t)4096)
+
 static bool
 snap_run_command(char **template_args, const char *size_arg)
 {
@@ -248,6 +271,7 @@ snap_run_command(char **template_args, const char *size_arg)
 static int
 snap_close_output()
 {
+	writeback_finish(&snap_writeback);
 	close(snap_outfd);
 	snap_outfd = -1;
 	if (!snap_run_command(opt_cmd_close, NULL))
@@ -267,6 +291,7 @@ snap_open_output(int extra_mode)
 		        opt_filename, strerror(errno));
 		return rc;
 	}
+	writeback_init(&snap_writeback, snap_outfd, opt_writeback);
 	return 0;
 }
 
@@ -275,6 +300,7 @@ snap_take_snapshot(bool final)
 {
 	bool reopen = (opt_cmd_open || opt_cmd_close);
 
+	writeback_finish(&snap_writeback);
 	fsync(snap_outfd);
 	if (final || reopen) {
 		int rc = snap_close_output();
@@ -555,6 +581,59 @@ snap_make_zero(void *opaque, void *out, fies_pos pos, fies_sz count)
 	return (ssize_t)count;
 }
 
+// Deallocate a range which has to read as zeroes.
+static ssize_t
+snap_write_zeroes(void *opaque, void *out, fies_pos pos, fies_sz count)
+{
+	if (snap_can_punch_hole != 0) {
+		int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+		if (fallocate(snap_outfd, mode, (off_t)pos, (off_t)count) == 0)
+		{
+			snap_can_punch_hole = 1;
+			return (ssize_t)count;
+		}
+		if (errno != ENODEV && errno != ENOTSUP && errno != EOPNOTSUPP)
+			return -errno;
+		snap_can_punch_hole = 0;
+	}
+	// Unlike snap_punch_hole() this only discards if it zeroes the data.
+	return snap_make_zero(opaque, out, pos, count);
+}
+
+static fies_ssz
+snap_pwrite_skip_zeroes(void *opaque, void *out,
+                        const char *buf, size_t count, fies_pos pos)
+{
+	size_t done = 0;
+	while (done != count) {
+		bool zero;
+		size_t len = zero_run_length(buf + done, count - done,
+		                             pos + done, SNAP_ZERO_BLOCK_SIZE,
+		                             &zero);
+		ssize_t put;
+		if (zero) {
+			verbose(VERBOSE_ACTIONS, "skip zeroes: %zx : %zx\n",
+			        pos + done, len);
+			put = snap_write_zeroes(opaque, out, pos + done, len);
+		} else {
+			put = pwrite(snap_outfd, buf + done, len,
+			             (off_t)(pos + done));
+			if (put < 0)
+				put = -errno;
+			else
+				writeback_wrote(&snap_writeback,
+				                (off_t)(pos + done),
+				                (size_t)put);
+		}
+		if (put < 0)
+			return done ? (fies_ssz)done : put;
+		done += (size_t)put;
+		if ((size_t)put != len)
+			break;
+	}
+	return (fies_ssz)done;
+}
+
 static fies_ssz
 snap_pwrite(void *opaque,
             void *out,
@@ -570,7 +649,13 @@ snap_pwrite(void *opaque,
 	}
 	if (!buf)
 		return snap_make_zero(opaque, out, pos, count);
-	return (fies_ssz)pwrite(snap_outfd, buf, (size_t)count, (off_t)pos);
+	if (opt_skip_zeroes)
+		return snap_pwrite_skip_zeroes(opaque, out, buf,
+		                               (size_t)count, pos);
+	ssize_t put = pwrite(snap_outfd, buf, (size_t)count, (off_t)pos);
+	if (put > 0)
+		writeback_wrote(&snap_writeback, (off_t)pos, (size_t)put);
+	return (fies_ssz)put;
 }
 
 static int
@@ -628,6 +713,7 @@ main_cleanup()
 	Vector_destroy(&opt_exclude);
 	Vector_destroy(&opt_include);
 	Vector_destroy(&opt_xform);
+	xform_cleanup();
 	u_strfreev(opt_cmd_create);
 	u_strfreev(opt_cmd_resize);
 	u_strfreev(opt_cmd_open);
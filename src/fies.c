@@ -49,6 +49,10 @@ usage(FILE *out, int exit_code)
 #define OPT_NO_HARDLINKS       (0x1000+'h')
 #define OPT_XATTRS             (0x1100+'x')
 #define OPT_NO_XATTRS          (0x1000+'x')
+#define OPT_ALLOC_HINTS        (0x1100+'A')
+#define OPT_NO_ALLOC_HINTS     (0x1000+'A')
+#define OPT_SKIP_ZEROES        (0x1100+'z')
+#define OPT_NO_SKIP_ZEROES     (0x1000+'z')
 #define OPT_ACLS               (0x1100+'a')
 #define OPT_NO_ACLS            (0x1000+'a')
 #define OPT_ONE_FS             (0xf100+'x')
@@ -78,6 +82,12 @@ usage(FILE *out, int exit_code)
 #define OPT_WARNING            (0x1000+'w')
 #define OPT_TIME               (0x4000+'T')
 #define OPT_DEBUG              (0x4000+'d')
+#define OPT_WRITEBACK          (0x4000+'w')
+#define OPT_JOBS               (0x4000+'j')
+#define OPT_MANIFEST           (0x1000+'m')
+#define OPT_DELTA              (0x1000+'D')
+#define OPT_DELTA_ROLLING      (0x1100+'D')
+#define OPT_NO_DELTA_ROLLING   (0x1200+'D')
 
 #define FIES_SHORTOPTS "hvctxrRC:f:s:T:"
 static struct option longopts[] = {
@@ -101,6 +111,8 @@ static struct option longopts[] = {
 	{ "xattrs",                   no_argument, NULL, OPT_XATTRS },
 	{ "noxattrs",                 no_argument, NULL, OPT_NO_XATTRS },
 	{ "no-xattrs",                no_argument, NULL, OPT_NO_XATTRS },
+	{ "alloc-hints",              no_argument, NULL, OPT_ALLOC_HINTS },
+	{ "no-alloc-hints",           no_argument, NULL, OPT_NO_ALLOC_HINTS },
 	{ "acls",                     no_argument, NULL, OPT_ACLS },
 	{ "noacls",                   no_argument, NULL, OPT_NO_ACLS },
 	{ "no-acls",                  no_argument, NULL, OPT_NO_ACLS },
@@ -122,11 +134,19 @@ static struct option longopts[] = {
 	{ "noincremental",            no_argument, NULL, OPT_NO_INCREMENTAL },
 	{ "no-incremental",           no_argument, NULL, OPT_NO_INCREMENTAL },
 	{ "ref-file",           required_argument, NULL, OPT_REF_FILE },
+	{ "manifest",           required_argument, NULL, OPT_MANIFEST },
+	{ "delta",              required_argument, NULL, OPT_DELTA },
+	{ "delta-rolling",            no_argument, NULL, OPT_DELTA_ROLLING },
+	{ "no-delta-rolling",         no_argument, NULL, OPT_NO_DELTA_ROLLING },
 	{ "wildcards",                no_argument, NULL, OPT_WILDCARDS },
 	{ "no-wildcards",             no_argument, NULL, OPT_NO_WILDCARDS },
 	{ "wildcards-match-slash",    no_argument, NULL, OPT_WILD_SLASH },
 	{ "no-wildcards-match-slash", no_argument, NULL, OPT_NO_WILD_SLASH},
 	{ "clone",              required_argument, NULL, OPT_CLONE },
+	{ "writeback",          required_argument, NULL, OPT_WRITEBACK },
+	{ "jobs",               required_argument, NULL, OPT_JOBS },
+	{ "skip-zeroes",              no_argument, NULL, OPT_SKIP_ZEROES },
+	{ "no-skip-zeroes",           no_argument, NULL, OPT_NO_SKIP_ZEROES },
 	{ "files-from",         required_argument, NULL, 'T' },
 	{ "transforming-files-from",
 	                        required_argument, NULL, OPT_XFORM_FILES_FROM},
@@ -158,20 +178,29 @@ bool                         opt_hardlinks        = true;
 bool                         opt_incremental      = false;
 static bool                  opt_xattrs           = false;
 static bool                  opt_acls             = false;
+static bool                  opt_alloc_hints      = false;
 bool                         opt_noxdev           = false;
 long                         opt_uid              = -1;
 long                         opt_gid              = -1;
 static bool                  opt_wildcards        = false;
 static bool                  opt_wildcards_slash  = false;
 clone_mode_t                 opt_clone            = CLONE_AUTO;
+unsigned long long           opt_writeback        = 0;
+bool                         opt_skip_zeroes      = false;
+unsigned long                opt_jobs             = 1;
 VectorOf(RexReplace*)        opt_xform;
 static VectorOf(FileMatch)   opt_exclude;
 static VectorOf(FileMatch)   opt_include;
+static FileMatchSet          opt_exclude_set;
+static FileMatchSet          opt_include_set;
 static VectorOf(const char*) opt_xattr_exclude;
 static VectorOf(Regex*)      opt_xattr_rexclude;
 static VectorOf(const char*) opt_xattr_include;
 static VectorOf(Regex*)      opt_xattr_rinclude;
 static VectorOf(const char*) opt_ref_files;
+const char                  *opt_manifest         = NULL;
+unsigned long long           opt_delta            = 0;
+static bool                  opt_delta_rolling    = false;
 static bool                  opt_null             = false;
 VectorOf(from_file_t)        opt_files_from_list;
 VectorOf(from_file_t)        opt_ref_files_from_list;
@@ -187,7 +216,7 @@ static bool option_error = false;
 
 static int   stream_fd = -1;
 uint32_t     fies_flags = 0;
-clone_info_t clone_info = { 0, 0, 0 };
+clone_info_t clone_info = { 0, 0, 0, 0, 0, 0, 0 };
 
 static void
 handle_re_opt(const char *pattern, Vector *dest)
@@ -317,6 +346,10 @@ handle_option(int c, int oopt, const char *oarg)
 	case OPT_NO_HARDLINKS:       opt_hardlinks = false; break;
 	case OPT_XATTRS:             opt_xattrs = true; break;
 	case OPT_NO_XATTRS:          opt_xattrs = false; break;
+	case OPT_ALLOC_HINTS:        opt_alloc_hints = true; break;
+	case OPT_NO_ALLOC_HINTS:     opt_alloc_hints = false; break;
+	case OPT_SKIP_ZEROES:        opt_skip_zeroes = true; break;
+	case OPT_NO_SKIP_ZEROES:     opt_skip_zeroes = false; break;
 	case OPT_ACLS:               opt_acls = true; break;
 	case OPT_NO_ACLS:            opt_acls = false; break;
 	case OPT_ONE_FS:             opt_noxdev = true; break;
@@ -332,6 +365,18 @@ handle_option(int c, int oopt, const char *oarg)
 	case OPT_REF_FILE:
 		Vector_push(&opt_ref_files, &oarg);
 		break;
+	case OPT_MANIFEST:
+		opt_manifest = oarg;
+		break;
+	case OPT_DELTA:
+		if (!str_to_size(oarg, &opt_delta)) {
+			fprintf(stderr, "fies: invalid delta block size: %s\n",
+			        oarg);
+			option_error = true;
+		}
+		break;
+	case OPT_DELTA_ROLLING:      opt_delta_rolling = true; break;
+	case OPT_NO_DELTA_ROLLING:   opt_delta_rolling = false; break;
 	case OPT_UID:
 		if (!arg_stol(oarg, &opt_uid, "--uid", "fies"))
 			option_error = true;
@@ -392,6 +437,22 @@ handle_option(int c, int oopt, const char *oarg)
 			option_error = true;
 		}
 		break;
+	case OPT_WRITEBACK:
+		if (!str_to_size(oarg, &opt_writeback)) {
+			fprintf(stderr, "fies: invalid writeback size: %s\n",
+			        oarg);
+			option_error = true;
+		}
+		break;
+	case OPT_JOBS:
+		if (!str_to_ulong(oarg, &opt_jobs) || !opt_jobs ||
+		    opt_jobs > 1024)
+		{
+			fprintf(stderr, "fies: invalid number of jobs: %s\n",
+			        oarg);
+			option_error = true;
+		}
+		break;
 	case 'T': {
 		from_file_t entry = { .file = oarg, .transforming = false };
 		Vector_push(&opt_files_from_list, &entry);
@@ -555,31 +616,32 @@ path_matches_file_match(char *path,
                         size_t pathlen,
                         mode_t st_mode,
                         Vector *vec,
+                        FileMatchSet *set,
                         bool head)
 {
-	FileMatch *it;
-	Vector_foreach(vec, it) {
-		const char *part;
-		size_t pi = pathlen;
-		if (head) {
-			char *tok = strchr(path, '/');
-			while (tok) {
-				*tok = 0;
-				if (FileMatch_matches(it, path, st_mode)) {
-					*tok = '/';
-					return true;
-				}
+	// The patterns are complete once we start looking at files.
+	if (!set->compiled)
+		FileMatchSet_compile(set, vec);
+
+	if (head) {
+		char *tok = strchr(path, '/');
+		while (tok) {
+			*tok = 0;
+			if (FileMatchSet_matches(set, path, st_mode)) {
 				*tok = '/';
-				tok = strchr(tok+1, '/');
-			}
-			if (FileMatch_matches(it, path, st_mode))
 				return true;
-		} else {
-			while ( (part = next_tail_component(path, &pi)) ) {
-				if (FileMatch_matches(it, part, st_mode))
-					return true;
 			}
+			*tok = '/';
+			tok = strchr(tok+1, '/');
 		}
+		return FileMatchSet_matches(set, path, st_mode);
+	}
+
+	const char *part;
+	size_t pi = pathlen;
+	while ( (part = next_tail_component(path, &pi)) ) {
+		if (FileMatchSet_matches(set, part, st_mode))
+			return true;
 	}
 	return false;
 }
@@ -611,11 +673,13 @@ opt_is_path_excluded(const char *in_path,
 
 	if (!skipincludes &&
 	    !Vector_empty(&opt_include) &&
-	    !path_matches_file_match(path, len, perms, &opt_include, head))
+	    !path_matches_file_match(path, len, perms, &opt_include,
+	                             &opt_include_set, head))
 	{
 		return true;
 	}
-	return path_matches_file_match(path, len, perms, &opt_exclude, head);
+	return path_matches_file_match(path, len, perms, &opt_exclude,
+	                               &opt_exclude_set, head);
 }
 
 static bool
@@ -652,6 +716,8 @@ main_cleanup()
 	close_stream();
 	Vector_destroy(&opt_files_from_list);
 	Vector_destroy(&opt_ref_files_from_list);
+	FileMatchSet_destroy(&opt_exclude_set);
+	FileMatchSet_destroy(&opt_include_set);
 	Vector_destroy(&opt_exclude);
 	Vector_destroy(&opt_include);
 	Vector_destroy(&opt_xattr_exclude);
@@ -659,6 +725,7 @@ main_cleanup()
 	Vector_destroy(&opt_xattr_include);
 	Vector_destroy(&opt_xattr_rinclude);
 	Vector_destroy(&opt_xform);
+	xform_cleanup();
 	Vector_destroy(&opt_ref_files);
 }
 
@@ -754,24 +821,46 @@ fies_cli_create(int argc, char **argv)
 		usage(stderr, EXIT_FAILURE);
 	}
 
-	if (!open_stream(O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO))
+	// Relative to the current directory, before -C and --chroot.
+	if (!create_open_manifest()) {
+		create_finish();
 		return 1;
+	}
 
-	if (!change_directory())
+	if (!open_stream(O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO)) {
+		create_finish();
 		return 1;
+	}
+
+	if (!change_directory()) {
+		create_finish();
+		return 1;
+	}
 
+	uint32_t flags = FIES_F_WHOLE_FILES;
+	if (opt_alloc_hints)
+		flags |= FIES_F_ALLOC_HINTS;
 	struct FiesWriter *fies = FiesWriter_newFull(&create_writer_funcs,
 	                                             &stream_fd,
-	                                             FIES_F_WHOLE_FILES);
+	                                             flags);
 	if (!fies) {
 		fprintf(stderr, "fies: failed to create fies writer: %s\n",
 		        strerror(errno));
+		create_finish();
 		return 1;
 	}
 
 	int rc = 0;
 	const char *err;
 
+	if (opt_delta) {
+		rc = FiesWriter_setDelta(fies, opt_delta,
+		                         opt_delta_rolling ? FIES_DELTA_ROLLING
+		                                           : 0);
+		if (rc < 0)
+			goto out_errmsg;
+	}
+
 	const char **refpp;
 	Vector_foreach(&opt_ref_files, refpp) {
 		rc = create_add(fies, *refpp, true);
@@ -803,6 +892,10 @@ fies_cli_create(int argc, char **argv)
 			goto out_errmsg;
 	}
 
+	rc = create_close_manifest(fies);
+	if (rc < 0)
+		goto out_errmsg;
+
 	goto out;
 
 out_errmsg:
@@ -812,6 +905,7 @@ out_errmsg:
 	fprintf(stderr, "fies: %s\n", err);
 
 out:
+	create_finish();
 	FiesWriter_delete(fies);
 
 	return rc == 0 ? 0 : 1;
@@ -881,6 +975,12 @@ fies_cli_extract(int argc, char **argv, bool list_only)
 		fprintf(stderr, "fies: %s\n", err);
 	}
 	FiesReader_delete(fies);
+	int finish_rc = extract_finish();
+	if (rc == 0 && finish_rc < 0) {
+		fprintf(stderr, "fies: extraction incomplete: %s\n",
+		        strerror(-finish_rc));
+		rc = finish_rc;
+	}
 
 	if (rc != 0)
 		return 1;
@@ -898,6 +998,31 @@ fies_cli_extract(int argc, char **argv, bool list_only)
 		fprintf(stderr, "fies: data shared in the stream: %s\n", ssh);
 		fprintf(stderr, "fies:       successfully cloned: %s\n", sh);
 		fprintf(stderr, "fies:                    copied: %s\n", cp);
+		const struct {
+			const char *what;
+			unsigned long long size;
+		} paths[] = {
+			{ "copy_file_range", clone_info.copy_range },
+			{ "sendfile",        clone_info.sendfile },
+			{ "read/write",      clone_info.user_copy },
+			{ "skipped holes",   clone_info.holes },
+		};
+		for (size_t i = 0; i != sizeof(paths)/sizeof(paths[0]); ++i) {
+			if (!paths[i].size)
+				continue;
+			format_size(paths[i].size, cp, sizeof(cp));
+			fprintf(stderr, "fies: %25s: %s\n",
+			        paths[i].what, cp);
+		}
+	}
+	if (!common.quiet && zero_skipped) {
+		char sz[32];
+		format_size(zero_skipped, sz, sizeof(sz));
+		fprintf(stderr, "fies: skipped zero blocks: %s\n", sz);
+	}
+	if (!common.quiet && fd_cache_misses) {
+		fprintf(stderr, "fies: file handle cache: %llu hits, %llu reopened\n",
+		        fd_cache_hits, fd_cache_misses);
 	}
 
 	return 0;
@@ -959,6 +1084,9 @@ main(int argc, char **argv)
 	Vector_set_destructor(&opt_include,
 	                      (Vector_dtor*)FileMatch_destroy);
 
+	FileMatchSet_init(&opt_exclude_set);
+	FileMatchSet_init(&opt_include_set);
+
 	Vector_init_type(&opt_xattr_exclude, const char*);
 
 	Vector_init_type(&opt_xattr_rexclude, Regex*);
@@ -1011,6 +1139,18 @@ main(int argc, char **argv)
 			        " when creating an archive\n");
 			return 1;
 		}
+		if (opt_delta) {
+			fprintf(stderr,
+			        "fies: --delta option can only be used"
+			        " when creating an archive\n");
+			return 1;
+		}
+		if (opt_manifest) {
+			fprintf(stderr,
+			        "fies: --manifest option can only be used"
+			        " when creating an archive\n");
+			return 1;
+		}
 	}
 
 	int rc;
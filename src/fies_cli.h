@@ -19,8 +19,13 @@ extern long                  opt_gid;
 extern VectorOf(RexReplace*) opt_xform;
 extern bool                  opt_incremental;
 extern clone_mode_t          opt_clone;
+extern unsigned long long    opt_writeback;
+extern bool                  opt_skip_zeroes;
+extern unsigned long         opt_jobs;
 extern VectorOf(from_file_t) opt_files_from_list;
 extern VectorOf(from_file_t) opt_ref_files_from_list;
+extern const char           *opt_manifest;
+extern unsigned long long    opt_delta;
 
 extern uint32_t              fies_flags;
 
@@ -28,8 +33,16 @@ typedef struct {
 	unsigned long long stream_shared;
 	unsigned long long shared;
 	unsigned long long unshared;
+	// How the unshared data was copied:
+	unsigned long long copy_range;
+	unsigned long long sendfile;
+	unsigned long long user_copy;
+	unsigned long long holes;
 } clone_info_t;
 extern clone_info_t          clone_info;
+extern unsigned long long    zero_skipped;
+extern unsigned long long    fd_cache_hits;
+extern unsigned long long    fd_cache_misses;
 
 int create_add(FiesWriter *fies, const char *arg, bool as_ref);
 int do_create_add(FiesWriter *fies,
@@ -44,6 +57,10 @@ extern struct FiesReader_Funcs list_reader_funcs;
 extern struct FiesReader_Funcs extract_reader_funcs;
 
 void create_init(void);
+void create_finish(void);
+bool create_open_manifest(void);
+int  create_close_manifest(FiesWriter *fies);
+int  extract_finish(void);
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
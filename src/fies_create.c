@@ -8,16 +8,23 @@
 #include <errno.h>
 #include <dirent.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 #include "../lib/fies.h"
-#include "../lib/map.h"
+#include "../lib/vector.h"
 
 #include "cli_common.h"
 #include "util.h"
 #include "fies_regex.h"
 #include "fies_cli.h"
+#include "manifest.h"
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
@@ -25,12 +32,22 @@ typedef struct FileLink {
 	dev_t   device;
 	ino_t   inode;
 	fies_id fileid;
+	nlink_t remaining; // links not seen yet, 0 marks an empty slot
+	char   *unsent;    // unchanged link not in the stream, see --manifest
 } FileLink;
 #pragma clang diagnostic pop
-static Map *file_links;
+// Open addressing hash table of files with more than one link which were
+// already written or skipped as unchanged, linear probing, the size is a power
+// of two.
+static FileLink *file_links;
+static size_t    file_links_size;
+static size_t    file_links_count;
 
 static struct FiesFile_Funcs file_funcs;
 
+static Manifest manifest;
+static bool     manifest_ready;
+
 static ssize_t
 my_file_get_xattr(struct FiesFile *handle,
                    const char *name,
@@ -41,13 +58,6 @@ my_file_get_xattr(struct FiesFile *handle,
 	return fies_os_file_funcs.get_xattr(handle, name, pbuffer);
 }
 
-void
-create_init()
-{
-	memcpy(&file_funcs, &fies_os_file_funcs, sizeof(file_funcs));
-	file_funcs.get_xattr = my_file_get_xattr;
-}
-
 static struct dirent*
 DIR_read(DIR *dir, struct dirent *data)
 {
@@ -62,59 +72,874 @@ DIR_read(DIR *dir, struct dirent *data)
 #endif
 }
 
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	char *name;
+	ino_t ino;
+	unsigned char type; // DT_* or DT_UNKNOWN
+} DirEntry;
+#pragma clang diagnostic pop
+
+static void
+DirEntry_destroy(void *p)
+{
+	free(((DirEntry*)p)->name);
+}
+
+static int
+DirEntry_cmp_ino(const void *pa, const void *pb)
+{
+	const DirEntry *a = pa;
+	const DirEntry *b = pb;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+static void
+DirEntry_vector_init(VectorOf(DirEntry) *vec)
+{
+	Vector_init_type(vec, DirEntry);
+	Vector_set_destructor(vec, DirEntry_destroy);
+}
+
+// Read a whole directory, sorted by inode number. Opening files in inode
+// order rather than in hash order avoids seeking around the inode tables of
+// most file systems when the caches are cold.
+static int
+list_directory(int fd, VectorOf(DirEntry) *names)
+{
+	int dirfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dirfd < 0)
+		return -errno;
+	DIR *dir = fdopendir(dirfd);
+	if (!dir) {
+		int rc = -errno;
+		close(dirfd);
+		return rc;
+	}
+	rewinddir(dir);
+	int rc = 0;
+	struct dirent data;
+	struct dirent *entry;
+	while ((entry = DIR_read(dir, &data))) {
+		if (!strcmp(entry->d_name, ".") ||
+		    !strcmp(entry->d_name, ".."))
+		{
+			continue;
+		}
+		DirEntry dent = {
+			.name = strdup(entry->d_name),
+			.ino = entry->d_ino,
+			.type = entry->d_type,
+		};
+		if (!dent.name) {
+			rc = -errno;
+			break;
+		}
+		Vector_push(names, &dent);
+	}
+	closedir(dir);
+	if (rc == 0)
+		qsort(Vector_data(names), Vector_length(names),
+		      sizeof(DirEntry), DirEntry_cmp_ino);
+	return rc;
+}
+
+// With a known d_type exclusions can be checked before opening the file.
+static bool
+dent_type_known(const DirEntry *dent)
+{
+	if (dent->type == DT_UNKNOWN)
+		return false;
+	// When dereferencing, the type of the link target is what counts.
+	return !(opt_dereference && dent->type == DT_LNK);
+}
+
+static bool
+dent_is_excluded(const DirEntry *dent, const char *fullpath)
+{
+	if (!dent_type_known(dent))
+		return false;
+	return opt_is_path_excluded(fullpath, DTTOIF(dent->type), true, false);
+}
+
+// With --jobs, directory entries are opened, stat()ed and listed by worker
+// threads ahead of time. The writer still consumes them in the order of a
+// serial walk, falling back to opening an entry itself whenever prefetching
+// did not succeed, so the stream does not depend on the number of threads.
+enum {
+	PREFETCH_QUEUED,
+	PREFETCH_DONE,
+	PREFETCH_SKIPPED,
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct PrefetchEntry {
+	struct PrefetchEntry *next;
+	int dirfd;
+	const DirEntry *dent;
+	int state;
+	int fd;
+	bool checked;
+	bool listed;
+	VectorOf(DirEntry) listing;
+} PrefetchEntry;
+#pragma clang diagnostic pop
+
+static pthread_t       *prefetch_threads;
+static size_t           prefetch_thread_count;
+static pthread_mutex_t  prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   prefetch_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   prefetch_done = PTHREAD_COND_INITIALIZER;
+static PrefetchEntry   *prefetch_head;
+static PrefetchEntry   *prefetch_tail;
+static bool             prefetch_quit;
+// Number of entries which may still be submitted (each can hold an fd).
+static size_t           prefetch_budget;
+// How far ahead of the writer to prefetch within a directory.
+static size_t           prefetch_window;
+
+static void
+prefetch_entry(PrefetchEntry *entry)
+{
+	unsigned char type = entry->dent->type;
+	if (type == DT_UNKNOWN) {
+		struct statx stx;
+		if (statx(entry->dirfd, entry->dent->name, AT_SYMLINK_NOFOLLOW,
+		          STATX_TYPE, &stx) != 0)
+		{
+			return;
+		}
+		type = IFTODT(stx.stx_mode);
+	}
+	// Anything else may block in open() or needs special treatment, leave
+	// it to the writer.
+	if (type != DT_REG && type != DT_DIR)
+		return;
+	int fd = openat(entry->dirfd, entry->dent->name,
+	                O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	// The writer only knows whether the entry is excluded once it has the
+	// file's mode, so, like it, only open the file.
+	if (!entry->checked) {
+		entry->fd = fd;
+		return;
+	}
+	(void)flistxattr(fd, NULL, 0);
+	if (type == DT_REG) {
+		// Flush and load the extent tree, the writer will map the
+		// extents with the same flags.
+		struct fiemap fm;
+		memset(&fm, 0, sizeof(fm));
+		fm.fm_length = FIEMAP_MAX_OFFSET;
+		fm.fm_flags = FIEMAP_FLAG_SYNC;
+		(void)ioctl(fd, FS_IOC_FIEMAP, &fm);
+	} else if (opt_recurse) {
+		if (list_directory(fd, &entry->listing) == 0)
+			entry->listed = true;
+		else
+			Vector_clear(&entry->listing);
+	}
+	entry->fd = fd;
+}
+
+static void*
+prefetch_thread(void *opaque)
+{
+	(void)opaque;
+	pthread_mutex_lock(&prefetch_mutex);
+	while (true) {
+		while (!prefetch_head && !prefetch_quit)
+			pthread_cond_wait(&prefetch_work, &prefetch_mutex);
+		PrefetchEntry *entry = prefetch_head;
+		if (!entry)
+			break;
+		prefetch_head = entry->next;
+		if (!prefetch_head)
+			prefetch_tail = NULL;
+		pthread_mutex_unlock(&prefetch_mutex);
+
+		prefetch_entry(entry);
+
+		pthread_mutex_lock(&prefetch_mutex);
+		entry->state = PREFETCH_DONE;
+		pthread_cond_broadcast(&prefetch_done);
+	}
+	pthread_mutex_unlock(&prefetch_mutex);
+	return NULL;
+}
+
+// Excluded entries are not queued so that they are never touched.
+static void
+prefetch_submit(PrefetchEntry *entry, int dirfd, const DirEntry *dent,
+                const char *dirpath)
+{
+	entry->next = NULL;
+	entry->dirfd = dirfd;
+	entry->dent = dent;
+	entry->state = PREFETCH_QUEUED;
+	entry->fd = -1;
+	entry->checked = dent_type_known(dent);
+	entry->listed = false;
+	DirEntry_vector_init(&entry->listing);
+	if (entry->checked) {
+		char *path = make_path(dirpath, dent->name, NULL);
+		bool excluded = !path || dent_is_excluded(dent, path);
+		free(path);
+		if (excluded) {
+			entry->state = PREFETCH_SKIPPED;
+			return;
+		}
+	}
+	--prefetch_budget;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	if (prefetch_tail)
+		prefetch_tail->next = entry;
+	else
+		prefetch_head = entry;
+	prefetch_tail = entry;
+	pthread_cond_signal(&prefetch_work);
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+static void
+prefetch_wait(PrefetchEntry *entry)
+{
+	pthread_mutex_lock(&prefetch_mutex);
+	while (entry->state == PREFETCH_QUEUED)
+		pthread_cond_wait(&prefetch_done, &prefetch_mutex);
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+static void
+prefetch_release(PrefetchEntry *entry)
+{
+	if (entry->fd >= 0)
+		close(entry->fd);
+	Vector_destroy(&entry->listing);
+	if (entry->state != PREFETCH_SKIPPED)
+		++prefetch_budget;
+}
+
+static void
+prefetch_start(unsigned long jobs)
+{
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0 ||
+	    lim.rlim_cur == RLIM_INFINITY ||
+	    lim.rlim_cur > 16384)
+	{
+		prefetch_budget = 4096;
+	} else {
+		prefetch_budget = (size_t)lim.rlim_cur / 4;
+	}
+	prefetch_window = jobs * 4;
+
+	prefetch_threads = malloc(jobs * sizeof(*prefetch_threads));
+	if (!prefetch_threads)
+		return;
+	for (unsigned long i = 0; i != jobs; ++i) {
+		int rc = pthread_create(&prefetch_threads[i], NULL,
+		                        prefetch_thread, NULL);
+		if (rc != 0) {
+			showerr("fies: failed to start thread: %s\n",
+			        strerror(rc));
+			break;
+		}
+		++prefetch_thread_count;
+	}
+}
+
+static void
+prefetch_stop(void)
+{
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_quit = true;
+	pthread_cond_broadcast(&prefetch_work);
+	pthread_mutex_unlock(&prefetch_mutex);
+	for (size_t i = 0; i != prefetch_thread_count; ++i)
+		pthread_join(prefetch_threads[i], NULL);
+	free(prefetch_threads);
+	prefetch_threads = NULL;
+	prefetch_thread_count = 0;
+}
+
+void
+create_init()
+{
+	memcpy(&file_funcs, &fies_os_file_funcs, sizeof(file_funcs));
+	file_funcs.get_xattr = my_file_get_xattr;
+	if (opt_jobs > 1)
+		prefetch_start(opt_jobs);
+}
+
+void
+create_finish()
+{
+	if (prefetch_thread_count)
+		prefetch_stop();
+	for (size_t i = 0; i != file_links_size; ++i)
+		free(file_links[i].unsent);
+	free(file_links);
+	file_links = NULL;
+	file_links_size = file_links_count = 0;
+	if (manifest_ready)
+		Manifest_destroy(&manifest);
+	manifest_ready = false;
+}
+
+bool
+create_open_manifest()
+{
+	if (!opt_manifest)
+		return true;
+	int rc = Manifest_open(&manifest, opt_manifest);
+	manifest_ready = true;
+	if (rc < 0) {
+		showerr("fies: manifest %s: %s\n", opt_manifest, strerror(-rc));
+		return false;
+	}
+	return true;
+}
+
+// Files from the previous manifest which were not seen in this run, children
+// before their parent directories. Then replace the manifest.
+int
+create_close_manifest(FiesWriter *fies)
+{
+	if (!manifest_ready)
+		return 0;
+	int rc;
+	for (size_t i = Vector_length(&manifest.entries); i--;) {
+		const ManifestEntry *old = Vector_at(&manifest.entries, i);
+		if (old->seen)
+			continue;
+		verbose(VERBOSE_FILES, "removed: %s\n", old->path);
+		rc = FiesWriter_unlink(fies, old->path);
+		if (rc < 0)
+			return rc;
+	}
+	rc = Manifest_commit(&manifest);
+	if (rc < 0)
+		showerr("fies: writing manifest %s: %s\n",
+		        opt_manifest, strerror(-rc));
+	return rc;
+}
+
+// Record all of a file's extents in the fingerprint, and keep the shared ones
+// to clone from the old version of the file once it changes. Their content
+// is hashed separately, see manifest_hash_extents().
+static int
+manifest_map_extents(FiesWriter *fies, struct FiesFile *file,
+                     ManifestEntry *entry)
+{
+	const size_t capacity = 1024;
+	FiesFile_Extent *exbuf = malloc(capacity * sizeof(*exbuf));
+	if (!exbuf)
+		return -errno;
+	VectorOf(ManifestExtent) shared;
+	Vector_init_type(&shared, ManifestExtent);
+
+	int rc = 0;
+	fies_pos at = 0;
+	while (at < file->filesize) {
+		fies_ssz got = file->funcs->next_extents(file, fies, at,
+		                                         exbuf, capacity);
+		if (got <= 0) {
+			rc = (int)got;
+			break;
+		}
+		fies_pos next = at;
+		for (size_t i = 0; i != (size_t)got; ++i) {
+			const FiesFile_Extent *ex = &exbuf[i];
+			entry->fingerprint = Manifest_fingerprint(
+				entry->fingerprint, ex);
+			next = ex->logical + ex->length;
+			if ((ex->flags & FIES_FL_EXTYPE_MASK) != FIES_FL_DATA ||
+			    !(ex->flags & FIES_FL_SHARED))
+			{
+				continue;
+			}
+			ManifestExtent mex = {
+				ex->logical, ex->physical, ex->length, 0
+			};
+			Vector_push(&shared, &mex);
+		}
+		if (next <= at)
+			break;
+		at = next;
+	}
+	free(exbuf);
+	if (rc < 0) {
+		Vector_destroy(&shared);
+		return rc;
+	}
+	entry->extent_count = Vector_length(&shared);
+	entry->extents = Vector_release(&shared);
+	return 0;
+}
+
+// Unchanged files still have the same shared extents as recorded.
+static bool
+manifest_copy_hashes(ManifestEntry *entry, const ManifestEntry *old)
+{
+	if (entry->extent_count != old->extent_count)
+		return false;
+	for (size_t i = 0; i != entry->extent_count; ++i) {
+		ManifestExtent *ex = &entry->extents[i];
+		const ManifestExtent *oex = &old->extents[i];
+		if (ex->logical != oex->logical ||
+		    ex->physical != oex->physical ||
+		    ex->length != oex->length)
+		{
+			return false;
+		}
+		ex->hash = oex->hash;
+	}
+	return true;
+}
+
+static int
+manifest_hash_extents(struct FiesFile *file, ManifestEntry *entry)
+{
+	if (!entry->extent_count)
+		return 0;
+	const size_t bufsize = 1024*1024;
+	unsigned char *buf = malloc(bufsize);
+	if (!buf)
+		return -errno;
+	int rc = 0;
+	for (size_t i = 0; i != entry->extent_count; ++i) {
+		ManifestExtent *ex = &entry->extents[i];
+		ex->hash = MANIFEST_FINGERPRINT_INIT;
+		fies_pos at = ex->logical;
+		const fies_pos end = ex->logical + ex->length;
+		while (at != end) {
+			size_t step = end - at < bufsize ? (size_t)(end - at)
+			                                 : bufsize;
+			ssize_t got = file->funcs->pread(file, buf, step, at);
+			if (got < 0) {
+				rc = (int)got;
+				goto out;
+			}
+			if ((size_t)got != step) {
+				// Truncated meanwhile, the file changed anyway.
+				entry->extent_count = 0;
+				goto out;
+			}
+			ex->hash = Manifest_contentHash(ex->hash, buf, step);
+			at += step;
+		}
+	}
+out:
+	free(buf);
+	return rc;
+}
+
+static int
+ManifestExtent_physicalCmp(const void *pa, const void *pb)
+{
+	const ManifestExtent *a = pa;
+	const ManifestExtent *b = pb;
+	if (a->physical != b->physical)
+		return a->physical < b->physical ? -1 : 1;
+	if (a->length != b->length)
+		return a->length < b->length ? -1 : 1;
+	return 0;
+}
+
+// Keep only those old extents which the file still has at the same address
+// with the same content. The blocks of others may have been freed and
+// reused, and must not be cloned from.
+static int
+manifest_verify_reference(ManifestEntry *old, const ManifestEntry *entry)
+{
+	size_t count = entry->extent_count;
+	ManifestExtent *sorted = NULL;
+	if (count) {
+		sorted = malloc(count * sizeof(*sorted));
+		if (!sorted)
+			return -errno;
+		memcpy(sorted, entry->extents, count * sizeof(*sorted));
+		qsort(sorted, count, sizeof(*sorted),
+		      ManifestExtent_physicalCmp);
+	}
+	size_t kept = 0;
+	for (size_t i = 0; i != old->extent_count; ++i) {
+		const ManifestExtent *oex = &old->extents[i];
+		const ManifestExtent *cur = count
+			? bsearch(oex, sorted, count, sizeof(*sorted),
+			          ManifestExtent_physicalCmp)
+			: NULL;
+		if (cur && cur->hash == oex->hash)
+			old->extents[kept++] = *oex;
+	}
+	old->extent_count = kept;
+	free(sorted);
+	return 0;
+}
+
+static fies_ssz
+manifest_ref_next_extents(struct FiesFile *handle,
+                          FiesWriter *writer,
+                          fies_pos logical_start,
+                          FiesFile_Extent *buffer,
+                          size_t count)
+{
+	(void)writer;
+	const ManifestEntry *old = handle->opaque;
+	size_t got = 0;
+	for (size_t i = 0; i != old->extent_count && got != count; ++i) {
+		const ManifestExtent *ex = &old->extents[i];
+		if (ex->logical + ex->length <= logical_start)
+			continue;
+		buffer[got].device = 0;
+		buffer[got].logical = ex->logical;
+		buffer[got].physical = ex->physical;
+		buffer[got].length = ex->length;
+		buffer[got].flags = FIES_FL_DATA | FIES_FL_SHARED;
+		++got;
+	}
+	return (fies_ssz)got;
+}
+
+static const struct FiesFile_Funcs manifest_ref_funcs = {
+	.next_extents = manifest_ref_next_extents,
+};
+
+// The receiver still has the old version of a modified file, so its verified
+// extents which are still part of the new version can be cloned from there.
+static int
+manifest_send_reference(FiesWriter *fies, struct FiesFile *file,
+                        ManifestEntry *old)
+{
+	struct FiesFile *ref = FiesFile_new(old, &manifest_ref_funcs,
+	                                    old->path, NULL, old->size,
+	                                    FIES_M_FREG | 0600, file->device);
+	if (!ref)
+		return -errno;
+	int rc = FiesWriter_readRefFile(fies, ref);
+	FiesFile_close(ref);
+	return rc;
+}
+
+// Describe the file as it is now and look it up in the manifest of the
+// previous run. Directories are always sent, other unchanged files are not.
+static int
+manifest_check(FiesWriter *fies,
+               struct FiesFile *file,
+               int dirfd,
+               const char *basepart,
+               const struct stat *stbuf,
+               ManifestEntry *entry,
+               bool *unchanged)
+{
+	struct stat lstbuf;
+	if (!stbuf) {
+		if (fstatat(dirfd, basepart, &lstbuf, AT_SYMLINK_NOFOLLOW) != 0)
+			return -errno;
+		stbuf = &lstbuf;
+	}
+	*unchanged = false;
+	entry->path = file->filename;
+	entry->mode = file->mode;
+	entry->ino = (uint64_t)stbuf->st_ino;
+	entry->size = (uint64_t)stbuf->st_size;
+	entry->mtime_sec = (int64_t)stbuf->st_mtim.tv_sec;
+	entry->mtime_nsec = (uint32_t)stbuf->st_mtim.tv_nsec;
+	entry->ctime_sec = (int64_t)stbuf->st_ctim.tv_sec;
+	entry->ctime_nsec = (uint32_t)stbuf->st_ctim.tv_nsec;
+	entry->fingerprint = MANIFEST_FINGERPRINT_INIT;
+
+	if (FIES_M_HAS_EXTENTS(file->mode)) {
+		int rc = manifest_map_extents(fies, file, entry);
+		if (rc < 0)
+			return rc;
+	}
+
+	ManifestEntry *old = Manifest_find(&manifest, entry->path);
+	if (old) {
+		old->seen = true;
+		*unchanged = (entry->mode & FIES_M_FMT) != FIES_M_FDIR &&
+		             Manifest_unchanged(old, entry);
+	}
+	if (*unchanged && manifest_copy_hashes(entry, old))
+		return 0;
+	int rc = manifest_hash_extents(file, entry);
+	if (rc < 0 || *unchanged || !old)
+		return rc;
+	if (old->extent_count && FIES_M_HAS_EXTENTS(old->mode) &&
+	    FIES_M_HAS_EXTENTS(entry->mode))
+	{
+		rc = manifest_verify_reference(old, entry);
+		if (rc < 0 || !old->extent_count)
+			return rc;
+		return manifest_send_reference(fies, file, old);
+	}
+	return 0;
+}
+
+// Only files which can actually have other links need to be tracked.
+static bool
+is_hardlink_candidate(const struct stat *stbuf)
+{
+	return stbuf->st_nlink > 1 && !S_ISDIR(stbuf->st_mode);
+}
+
+static size_t
+FileLink_hash(dev_t device, ino_t inode)
+{
+	uint64_t h = (uint64_t)inode ^ ((uint64_t)device << 32 |
+	                                (uint64_t)device >> 32);
+	h *= 0x9E3779B97F4A7C15ull;
+	return (size_t)(h ^ (h >> 29));
+}
+
 static FileLink*
-FileLink_new(dev_t device, ino_t inode, fies_id fileid)
+FileLink_find(dev_t device, ino_t inode)
 {
-	FileLink *self = malloc(sizeof(*self));
-	if (!self)
+	if (!file_links_count)
 		return NULL;
-	self->device = device;
-	self->inode = inode;
-	self->fileid = fileid;
-	return self;
+	size_t mask = file_links_size - 1;
+	size_t i = FileLink_hash(device, inode) & mask;
+	for (; file_links[i].remaining; i = (i + 1) & mask) {
+		if (file_links[i].inode == inode &&
+		    file_links[i].device == device)
+		{
+			return &file_links[i];
+		}
+	}
+	return NULL;
+}
+
+static void
+FileLink_put(const FileLink *link)
+{
+	size_t mask = file_links_size - 1;
+	size_t i = FileLink_hash(link->device, link->inode) & mask;
+	while (file_links[i].remaining)
+		i = (i + 1) & mask;
+	file_links[i] = *link;
+	++file_links_count;
+}
+
+// Backward shift deletion so lookups never need tombstones.
+static void
+FileLink_remove(FileLink *link)
+{
+	size_t mask = file_links_size - 1;
+	size_t hole = (size_t)(link - file_links);
+	size_t i = hole;
+	while (true) {
+		i = (i + 1) & mask;
+		if (!file_links[i].remaining)
+			break;
+		size_t home = FileLink_hash(file_links[i].device,
+		                            file_links[i].inode) & mask;
+		// Move the entry into the hole unless its home slot lies
+		// cyclically within (hole, i].
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			file_links[hole] = file_links[i];
+			hole = i;
+		}
+	}
+	file_links[hole].remaining = 0;
+	--file_links_count;
 }
 
 static int
-FileLink_cmp_p(const void *pa, const void *pb)
+FileLink_grow(void)
 {
-	FileLink *a = *(void *const *)pa;
-	FileLink *b = *(void *const *)pb;
-	return (a->device < b->device) ? -1 :
-	       (a->device > b->device) ?  1 :
-	       (a->inode < b->inode) ? -1 :
-	       (a->inode > b->inode) ?  1 :
-	       0;
+	size_t oldsize = file_links_size;
+	FileLink *old = file_links;
+	size_t newsize = oldsize ? oldsize * 2 : 256;
+	FileLink *table = calloc(newsize, sizeof(*table));
+	if (!table)
+		return -errno;
+	file_links = table;
+	file_links_size = newsize;
+	file_links_count = 0;
+	for (size_t i = 0; i != oldsize; ++i) {
+		if (old[i].remaining)
+			FileLink_put(&old[i]);
+	}
+	free(old);
+	return 0;
 }
 
-static const FileLink*
-get_existing_file(const struct stat *stbuf)
+static void
+FileLink_seen(FileLink *link)
 {
-	if (!file_links)
-		return NULL;
-	FileLink key = {
+	if (--link->remaining)
+		return;
+	free(link->unsent);
+	link->unsent = NULL;
+	FileLink_remove(link);
+}
+
+// The receiver already has the file under an unchanged link, send that as a
+// reference file for the new links to point to.
+static int
+FileLink_sendUnsent(FileLink *link, FiesWriter *fies, struct FiesFile *file,
+                    const struct stat *stbuf)
+{
+	ManifestEntry none = { .path = link->unsent };
+	struct FiesFile *ref = FiesFile_new(&none, &manifest_ref_funcs,
+	                                    link->unsent, NULL,
+	                                    (fies_sz)stbuf->st_size,
+	                                    FIES_M_FREG | 0600, file->device);
+	if (!ref)
+		return -errno;
+	int rc = FiesWriter_readRefFile(fies, ref);
+	link->fileid = ref->fileid;
+	FiesFile_close(ref);
+	if (rc < 0)
+		return rc;
+	free(link->unsent);
+	link->unsent = NULL;
+	return 0;
+}
+
+// Look up a file we already wrote, once all its links were seen it is
+// forgotten. Returns 1 if it was found.
+static int
+take_existing_file(FiesWriter *fies, struct FiesFile *file,
+                   const struct stat *stbuf, fies_id *fileid)
+{
+	FileLink *link = FileLink_find(stbuf->st_dev, stbuf->st_ino);
+	if (!link)
+		return 0;
+	if (link->unsent) {
+		int rc = FileLink_sendUnsent(link, fies, file, stbuf);
+		if (rc < 0)
+			return rc;
+	}
+	*fileid = link->fileid;
+	FileLink_seen(link);
+	return 1;
+}
+
+static int
+register_existing_file(struct FiesFile *file, const struct stat *stbuf,
+                       char *unsent)
+{
+	if ((file_links_count + 1) * 2 > file_links_size) {
+		int rc = FileLink_grow();
+		if (rc < 0)
+			return rc;
+	}
+	FileLink link = {
 		.device = stbuf->st_dev,
-		.inode = stbuf->st_ino
+		.inode = stbuf->st_ino,
+		.fileid = file->fileid,
+		.remaining = stbuf->st_nlink - 1,
+		.unsent = unsent,
 	};
-	return Map_getp(file_links, &key);
+	FileLink_put(&link);
+	return 0;
 }
 
+// Unchanged files are left out of the stream, but their inode may have gained
+// new links since. Remember the inode so those are sent as links to it.
+// Returns 0 if the inode was already sent under a new link, the unchanged one
+// then has to be linked to it as well.
 static int
-register_existing_file(struct FiesFile *file, const struct stat *stbuf)
+skip_existing_file(struct FiesFile *file, const struct stat *stbuf)
 {
-	if (!file_links) {
-		file_links = Map_new_type(FileLink_cmp_p,
-		                          FileLink*, NULL,
-		                          FileLink, free);
-		if (!file_links)
+	FileLink *link = FileLink_find(stbuf->st_dev, stbuf->st_ino);
+	if (!link) {
+		char *unsent = strdup(file->filename);
+		if (!unsent)
 			return -errno;
+		int rc = register_existing_file(file, stbuf, unsent);
+		if (rc < 0)
+			free(unsent);
+		return rc < 0 ? rc : 1;
 	}
-	FileLink *link = FileLink_new(stbuf->st_dev,
-	                              stbuf->st_ino,
-	                              file->fileid);
-	if (!link)
-		return -errno;
-	Map_insert(file_links, &link, link);
-	return 0;
+	if (!link->unsent)
+		return 0;
+	FileLink_seen(link);
+	return 1;
+}
+
+static int
+create_add_entry(struct FiesWriter *fies,
+                 int dirfd,
+                 const char *basepart,
+                 const char *fullpath,
+                 dev_t dev,
+                 const char *xformed,
+                 bool as_ref,
+                 bool checked,
+                 PrefetchEntry *pre);
+
+static int
+create_add_dir(struct FiesWriter *fies,
+               int fd,
+               const char *xformed,
+               dev_t dev,
+               VectorOf(DirEntry) *names)
+{
+	int retval = 0;
+	size_t count = Vector_length(names);
+	PrefetchEntry *entries = NULL;
+	if (prefetch_thread_count && count) {
+		entries = calloc(count, sizeof(*entries));
+		if (!entries)
+			return -errno;
+	}
+
+	size_t submitted = 0;
+	for (size_t i = 0; i != count; ++i) {
+		PrefetchEntry *pre = NULL;
+		if (entries) {
+			while (submitted != count &&
+			       submitted < i + prefetch_window &&
+			       prefetch_budget)
+			{
+				prefetch_submit(&entries[submitted], fd,
+				                Vector_at(names, submitted),
+				                xformed);
+				++submitted;
+			}
+			if (i < submitted) {
+				pre = &entries[i];
+				prefetch_wait(pre);
+			}
+		}
+
+		const DirEntry *dent = Vector_at(names, i);
+		char *inpath = make_path(xformed, dent->name, NULL);
+		if (!inpath) {
+			retval = -errno;
+		} else if (dent_is_excluded(dent, inpath)) {
+			warn(WARN_EXCLUDED, "fies: excluding: %s\n", inpath);
+			retval = 0;
+		} else {
+			bool checked = dent_type_known(dent);
+			retval = create_add_entry(fies, fd, dent->name, inpath,
+			                          dev, NULL, false, checked,
+			                          pre);
+		}
+		free(inpath);
+		if (pre)
+			prefetch_release(pre);
+		if (retval < 0) {
+			// Workers may still be using our directory handle.
+			for (++i; i < submitted; ++i) {
+				prefetch_wait(&entries[i]);
+				prefetch_release(&entries[i]);
+			}
+			break;
+		}
+	}
+	free(entries);
+	return retval;
 }
 
 int
@@ -125,9 +950,26 @@ do_create_add(struct FiesWriter *fies,
               dev_t dev,
               const char *xformed,
               bool as_ref)
+{
+	return create_add_entry(fies, dirfd, basepart, fullpath, dev, xformed,
+	                        as_ref, false, NULL);
+}
+
+static int
+create_add_entry(struct FiesWriter *fies,
+                 int dirfd,
+                 const char *basepart,
+                 const char *fullpath,
+                 dev_t dev,
+                 const char *xformed,
+                 bool as_ref,
+                 bool checked,
+                 PrefetchEntry *pre)
 {
 	const bool is_recursion = (dirfd != AT_FDCWD);
 	int retval = -EINVAL;
+	ManifestEntry mf_entry = { .path = NULL, .extents = NULL };
+	bool mf_record = false;
 	// FIXME: opt_acls
 
 	char *xform_path = NULL;
@@ -142,7 +984,13 @@ do_create_add(struct FiesWriter *fies,
 	if (opt_dereference)
 		flags |= FIES_FILE_FOLLOW_SYMLINKS;
 
-	struct FiesFile *file = FiesFile_openat(dirfd, basepart, fies, flags);
+	struct FiesFile *file;
+	if (pre && pre->fd >= 0) {
+		file = FiesFile_fdopen(pre->fd, basepart, fies, flags);
+		pre->fd = -1;
+	} else {
+		file = FiesFile_openat(dirfd, basepart, fies, flags);
+	}
 	if (!file) {
 		retval = -errno;
 		showerr("fies: open(%s): %s\n", fullpath, strerror(errno));
@@ -158,7 +1006,9 @@ do_create_add(struct FiesWriter *fies,
 		retval = -EFAULT;
 		goto out;
 	}
-	if (opt_is_path_excluded(fullpath, perms, is_recursion, false)) {
+	if (!checked &&
+	    opt_is_path_excluded(fullpath, perms, is_recursion, false))
+	{
 		warn(WARN_EXCLUDED, "fies: excluding: %s\n", fullpath);
 		retval = 0;
 		goto out;
@@ -205,69 +1055,123 @@ do_create_add(struct FiesWriter *fies,
 			}
 			dev = stbuf.st_dev;
 		}
+	}
+	const bool hardlink = fd >= 0 && !as_ref && opt_hardlinks &&
+	                      is_hardlink_candidate(&stbuf);
+
+	if (manifest_ready && !as_ref) {
+		bool unchanged;
+		retval = manifest_check(fies, file, dirfd, basepart,
+		                        fd >= 0 ? &stbuf : NULL,
+		                        &mf_entry, &unchanged);
+		if (retval < 0) {
+			const char *err = FiesWriter_getError(fies);
+			showerr("fies: %s: %s\n",
+			        fullpath, err ? err : strerror(-retval));
+			goto out;
+		}
+		mf_record = true;
+		if (unchanged && hardlink) {
+			retval = skip_existing_file(file, &stbuf);
+			if (retval < 0) {
+				showerr("fies: indexing file %s: %s\n",
+				        file->filename, strerror(-retval));
+				goto out;
+			}
+			unchanged = retval;
+		}
+		if (unchanged) {
+			verbose(VERBOSE_EXCLUSIONS, "fies: unchanged: %s\n",
+			        fullpath);
+			goto record;
+		}
+	}
 
-		const FileLink *old = opt_hardlinks ? get_existing_file(&stbuf)
-		                                    : NULL;
-		if (old) {
-			file->mode &= (unsigned)~FIES_M_FMT;
-			file->mode |= FIES_M_FHARD;
-			free(file->linkdest);
-			file->linkdest = NULL;
-			file->fileid = old->fileid;
-		} else if (opt_hardlinks) {
-			register_file = true;
+	fies_id oldid;
+	if (!hardlink) {
+		register_file = false;
+	} else if ((retval = take_existing_file(fies, file, &stbuf,
+	                                        &oldid)) != 0)
+	{
+		if (retval < 0) {
+			const char *err = FiesWriter_getError(fies);
+			showerr("fies: writing file %s: %s\n",
+			        xformed, err ? err : strerror(-retval));
+			goto out;
 		}
+		file->mode &= (unsigned)~FIES_M_FMT;
+		file->mode |= FIES_M_FHARD;
+		free(file->linkdest);
+		file->linkdest = NULL;
+		file->fileid = oldid;
+	} else {
+		register_file = true;
 	}
 
 	verbose(VERBOSE_FILES, "%s\n", xformed);
-	retval = FiesWriter_writeFile(fies, file);
+	if (!as_ref) {
+		retval = FiesWriter_writeFile(fies, file);
+	} else if (opt_delta) {
+		// The writer keeps reading from the file.
+		retval = FiesWriter_readDeltaRefFile(fies, file);
+		file = NULL;
+	} else {
+		retval = FiesWriter_readRefFile(fies, file);
+	}
 	if (retval < 0) {
 		const char *err = FiesWriter_getError(fies);
 		showerr("fies: writing file %s: %s\n",
-		        file->filename, err ? err : strerror(-retval));
+		        xformed, err ? err : strerror(-retval));
 		goto out;
 	}
 	if (register_file) {
-		retval = register_existing_file(file, &stbuf);
+		retval = register_existing_file(file, &stbuf, NULL);
 		if (retval < 0) {
 			showerr("fies: indexing file %s: %s\n",
 			        file->filename, strerror(-retval));
 			goto out;
 		}
 	}
-	if (fd >= 0)
-		fd = dup(fd);
-	FiesFile_close(file);
-	file = NULL;
-
+record:
+	if (mf_record) {
+		retval = Manifest_add(&manifest, &mf_entry);
+		if (retval < 0) {
+			showerr("fies: writing manifest: %s\n",
+			        strerror(-retval));
+			goto out;
+		}
+	}
 	retval = 0;
 	if (opt_recurse && filetype == FIES_M_FDIR) {
 		assert(fd >= 0);
-		DIR *dir = fdopendir(fd);
-		struct dirent data;
-		struct dirent *entry;
-		while ((entry = DIR_read(dir, &data))) {
-			if (!strcmp(entry->d_name, ".") ||
-			    !strcmp(entry->d_name, ".."))
-			{
-				continue;
-			}
-			char *inpath = make_path(xformed, entry->d_name,
-			                         NULL);
-			if (!inpath) {
-				retval = -errno;
+		VectorOf(DirEntry) listing;
+		VectorOf(DirEntry) *names = &listing;
+		DirEntry_vector_init(&listing);
+		if (pre && pre->listed) {
+			names = &pre->listing;
+		} else {
+			retval = list_directory(fd, &listing);
+			if (retval < 0) {
+				showerr("fies: opendir(%s): %s\n",
+				        fullpath, strerror(-retval));
+				Vector_destroy(&listing);
 				goto out;
 			}
-			retval = do_create_add(fies, fd, entry->d_name,
-			                         inpath, dev, NULL, false);
-			free(inpath);
-			if (retval < 0)
-				break;
 		}
-		closedir(dir);
+		fd = dup(fd);
+		FiesFile_close(file);
+		file = NULL;
+		if (fd < 0)
+			retval = -errno;
+		else
+			retval = create_add_dir(fies, fd, xformed, dev, names);
+		Vector_destroy(&listing);
+		if (fd >= 0)
+			close(fd);
 	}
 
 out:
+	free(mf_entry.extents);
 	free(xform_path);
 	FiesFile_close(file);
 	return retval;
@@ -15,6 +15,7 @@
 
 #include <sys/sendfile.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 
 #include "../lib/fies_linux.h"
 #include "../lib/fies.h"
@@ -29,24 +30,86 @@
 #include "fies_regex.h"
 #include "fies_cli.h"
 
-#define FIES_FATTR_MTIME 0x01
+#define FIES_FATTR_MTIME    0x01
+// File was created with O_TMPFILE and still needs to be linked into place.
+#define FIES_FATTR_UNLINKED 0x02
+#define FIES_FATTR_OWNER    0x04
+// File was freshly created and not yet written to, so it reads as zeroes.
+#define FIES_FATTR_ZEROED   0x08
+// Finished file whose descriptor may be closed, see FileHandle_cache().
+#define FIES_FATTR_CACHED   0x10
+// The descriptor of a cached file has been closed.
+#define FIES_FATTR_CLOSED   0x20
+// copy_file_range() into this file failed, eg. across file systems.
+#define FIES_FATTR_NOCOPYRANGE 0x40
+// The descriptor of a cached file was reopened for reading only.
+#define FIES_FATTR_RDONLY   0x80
+
+// Upper bound for merging adjacent copy extents into a single clone call.
+#define CLONE_MERGE_MAX ((fies_sz)1024*1024*1024)
+
+// Chunk size for copy_file_range()/sendfile() when cloning is not possible.
+#define COPY_CHUNK_SIZE ((size_t)64*1024*1024)
+// Buffer size for the read/write fallback.
+#define COPY_BUFFER_SIZE ((size_t)1024*1024)
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	char *name;
+	char *value;
+	size_t length;
+} XattrEntry;
+
 typedef struct {
 	int fd;
-	int dirfd;
 	uint32_t mode;
 	char *fullpath;
-	char *target;
-	// Things like the modification time need to be set after we're done
-	// modifying the file ;-).
+	char *target; // symlink destination
+	// Metadata is collected here and applied in a final pass once all
+	// files have been written, see apply_deferred_meta().
 	uint32_t flags;
 	struct timespec time[2];
+	uid_t uid;
+	gid_t gid;
+	VectorOf(XattrEntry) xattrs;
 	size_t blocksize;
+	Writeback writeback;
+	dev_t dev;
+	ino_t ino;
+	int open_flags;
+	// fd cache LRU list
+	void *lru_prev;
+	void *lru_next;
 } FileHandle;
+
+// Streams from snapshot tools often contain long runs of small adjacent
+// FIES_FL_COPY extents from the same source. We collect them here and only
+// issue the clone once a packet does not continue the range.
+typedef struct {
+	FileHandle *dst;
+	FileHandle *src;
+	fies_pos dstoff;
+	fies_pos srcoff;
+	fies_sz length;
+} CloneRange;
 #pragma clang diagnostic pop
 
+static CloneRange clone_pending;
+
+// First error which could not be returned to the reader, eg. from flushing
+// clones when a file is closed. Reported by extract_finish().
+static int extract_error = 0;
+
+static void
+extract_setError(int rc)
+{
+	if (rc < 0 && !extract_error)
+		extract_error = rc;
+}
+
+static int clone_flush(void *opaque);
+
 static ssize_t
 do_read(void *opaque, void *data, size_t count)
 {
@@ -55,6 +118,219 @@ do_read(void *opaque, void *data, size_t count)
 	return got < 0 ? -errno : got;
 }
 
+// All handles in creation order, for the final metadata pass.
+static VectorOf(FileHandle*) handles;
+static bool handles_ready = false;
+
+// Open directory handles keyed by their path so that files can be created
+// relative to their parent with *at() calls instead of having every syscall
+// walk the full path. Directories in the cache are known to exist.
+// When full the least recently used directory is closed.
+#define DIR_CACHE_MAX 128
+typedef struct {
+	int fd;
+	unsigned long used;
+} DirCacheEntry;
+static MapOf(char*, DirCacheEntry) dir_cache;
+static bool dir_cache_ready = false;
+static unsigned long dir_cache_clock = 0;
+
+static void
+dir_cache_close_p(void *pentry)
+{
+	close(((DirCacheEntry*)pentry)->fd);
+}
+
+static void
+dir_cache_evict()
+{
+	size_t count = Vector_length(&dir_cache.keys);
+	size_t oldest = 0;
+	for (size_t i = 1; i != count; ++i) {
+		const DirCacheEntry *entry = Vector_at(&dir_cache.values, i);
+		const DirCacheEntry *old = Vector_at(&dir_cache.values, oldest);
+		if (entry->used < old->used)
+			oldest = i;
+	}
+	Vector_remove(&dir_cache.keys, oldest, 1);
+	Vector_remove(&dir_cache.values, oldest, 1);
+}
+
+static void
+dir_cache_insert(const char *dir, int fd)
+{
+	if (!dir_cache_ready) {
+		Map_init_type(&dir_cache, Map_strcmp,
+		              char*, Map_pfree,
+		              DirCacheEntry, dir_cache_close_p);
+		dir_cache_ready = true;
+	}
+	// Note that this must not invalidate the handle passed in, but may
+	// close any other cached handle.
+	if (Vector_length(&dir_cache.keys) >= DIR_CACHE_MAX)
+		dir_cache_evict();
+	char *key = strdup(dir);
+	if (!key) {
+		close(fd);
+		return;
+	}
+	DirCacheEntry entry = { fd, ++dir_cache_clock };
+	Map_insert(&dir_cache, &key, &entry);
+}
+
+// Get a handle to a directory, creating missing path components. The handle
+// is owned by the cache and stays valid until the next dir_cache_*() call.
+static int
+dir_cache_get(const char *dir, int *pdirfd)
+{
+	if (!*dir)
+		dir = ".";
+
+	DirCacheEntry *cached = dir_cache_ready ? Map_getp(&dir_cache, dir)
+	                                        : NULL;
+	if (cached) {
+		cached->used = ++dir_cache_clock;
+		*pdirfd = cached->fd;
+		return 0;
+	}
+
+	int fd;
+	if (!strcmp(dir, "/") || !strcmp(dir, ".")) {
+		fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+		dir_cache_insert(dir, fd);
+		*pdirfd = fd;
+		return 0;
+	}
+
+	int rc;
+	int parentfd = AT_FDCWD;
+	const char *name = dir;
+	const char *slash = strrchr(dir, '/');
+	if (slash) {
+		char *parent = slash == dir ? strdup("/")
+		                            : strndup(dir, (size_t)(slash-dir));
+		if (!parent)
+			return -errno;
+		rc = dir_cache_get(parent, &parentfd);
+		free(parent);
+		if (rc < 0)
+			return rc;
+		name = slash+1;
+		if (!*name) {
+			// trailing slash
+			*pdirfd = parentfd;
+			return 0;
+		}
+	}
+
+	if (mkdirat(parentfd, name, 0777) != 0 && errno != EEXIST) {
+		rc = -errno;
+		warn(WARN_MKDIR, "fies: failed to create path: %s\n", dir);
+		return rc;
+	}
+	fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	dir_cache_insert(dir, fd);
+	*pdirfd = fd;
+	return 0;
+}
+
+// Split a path into a handle to its parent directory and its base name,
+// which points into the path.
+static int
+dir_cache_parent(char *path, int *pdirfd, const char **pname)
+{
+	char *slash = strrchr(path, '/');
+	if (!slash) {
+		*pdirfd = AT_FDCWD;
+		*pname = path;
+		return 0;
+	}
+	if (!slash[1])
+		return -EINVAL;
+	int rc;
+	if (slash == path) {
+		rc = dir_cache_get("/", pdirfd);
+	} else {
+		*slash = 0;
+		rc = dir_cache_get(path, pdirfd);
+		*slash = '/';
+	}
+	*pname = slash+1;
+	return rc;
+}
+
+int
+extract_finish()
+{
+	int rc = extract_error;
+	extract_error = 0;
+	if (handles_ready)
+		Vector_destroy(&handles);
+	handles_ready = false;
+	if (dir_cache_ready)
+		Map_destroy(&dir_cache);
+	dir_cache_ready = false;
+	return rc;
+}
+
+static bool tmpfile_usable = true;
+static bool link_empty_path_usable = true;
+
+static int
+link_fd_as(int fd, int dirfd, const char *name)
+{
+	// AT_EMPTY_PATH requires CAP_DAC_READ_SEARCH, otherwise go through
+	// procfs.
+	if (link_empty_path_usable) {
+		if (linkat(fd, "", dirfd, name, AT_EMPTY_PATH) == 0)
+			return 0;
+		if (errno != ENOENT && errno != EPERM)
+			return -errno;
+		link_empty_path_usable = false;
+	}
+	char procpath[64];
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%i", fd);
+	if (linkat(AT_FDCWD, procpath, dirfd, name, AT_SYMLINK_FOLLOW) != 0)
+		return -errno;
+	return 0;
+}
+
+// Link an O_TMPFILE file descriptor into the file system, atomically
+// replacing whatever currently exists at the destination: linkat() cannot
+// replace files, so link it to a temporary name and rename that into place.
+static int
+link_fd(int fd, int dirfd, const char *name)
+{
+	static unsigned int counter = 0;
+	char tmpname[64];
+	int rc;
+	do {
+		snprintf(tmpname, sizeof(tmpname), ".fies-link.%li.%u",
+		         (long)getpid(), counter++);
+		rc = link_fd_as(fd, dirfd, tmpname);
+	} while (rc == -EEXIST);
+	if (rc < 0)
+		return rc;
+	if (renameat(dirfd, tmpname, dirfd, name) != 0) {
+		rc = -errno;
+		(void)unlinkat(dirfd, tmpname, 0);
+		return rc;
+	}
+	return 0;
+}
+
+static void
+XattrEntry_destroy(void *pentry)
+{
+	XattrEntry *entry = pentry;
+	free(entry->name);
+	free(entry->value);
+}
+
 static FileHandle*
 FileHandle_new(int fd, uint32_t mode, char *fullpath)
 {
@@ -62,35 +338,366 @@ FileHandle_new(int fd, uint32_t mode, char *fullpath)
 	if (!self)
 		return NULL;
 	self->fd = fd;
-	self->dirfd = AT_FDCWD;
 	self->mode = mode;
 	self->fullpath = fullpath;
 	self->time[0].tv_nsec = UTIME_OMIT;
+	Vector_init_type(&self->xattrs, XattrEntry);
+	Vector_set_destructor(&self->xattrs, XattrEntry_destroy);
+	if (!handles_ready) {
+		Vector_init_type(&handles, FileHandle*);
+		handles_ready = true;
+	}
+	Vector_push(&handles, &self);
 	return self;
 }
 
+static int
+FileHandle_link(FileHandle *self)
+{
+	if (!(self->flags & FIES_FATTR_UNLINKED))
+		return 0;
+
+	verbose(VERBOSE_ACTIONS, "link tmpfile: %s\n", self->fullpath);
+	int dirfd;
+	const char *name;
+	int rc = dir_cache_parent(self->fullpath, &dirfd, &name);
+	if (rc == 0)
+		rc = link_fd(self->fd, dirfd, name);
+	if (rc < 0) {
+		// The file stays unlinked, and its descriptor open, so a
+		// later attempt may still succeed.
+		showerr("fies: failed to link %s into place: %s\n",
+		        self->fullpath, strerror(-rc));
+		extract_setError(rc);
+		return rc;
+	}
+	self->flags &= ~FIES_FATTR_UNLINKED;
+	return 0;
+}
+
+// Replace the placeholder file of a symlink with the actual link.
 static void
-FileHandle_delete(FileHandle *self)
+FileHandle_symlink(FileHandle *self)
 {
-	if (self->fd != -1)
-		close(self->fd);
-	if (self->dirfd != -1 && self->dirfd != AT_FDCWD)
-		close(self->dirfd);
-	if (self->mode == FIES_M_FLNK) {
-		if (unlink(self->fullpath) != 0) {
-			showerr("fies: failed to remove temporary file: %s\n",
+	if (self->mode != FIES_M_FLNK || !self->target)
+		return;
+	int dirfd;
+	const char *name;
+	int rc = dir_cache_parent(self->fullpath, &dirfd, &name);
+	if (rc < 0) {
+		showerr("fies: symlink failed: %s: %s\n",
+		        self->fullpath, strerror(-rc));
+	} else {
+		if (unlinkat(dirfd, name, 0) != 0) {
+			showerr("fies: failed to remove temporary "
+			        "file: %s: %s\n",
 			        self->fullpath, strerror(errno));
 		}
-		if (symlink(self->target, self->fullpath) != 0) {
+		if (symlinkat(self->target, dirfd, name) != 0) {
 			showerr("fies: symlink failed: %s: %s\n",
 			        self->fullpath, strerror(errno));
 		}
 	}
+	free(self->target);
+	self->target = NULL;
+}
+
+// Finished files are kept in an LRU list and have their file descriptors
+// closed when there are too many, to be reopened when they are cloned from.
+static FileHandle *fd_lru_head = NULL;
+static FileHandle *fd_lru_tail = NULL;
+static size_t      fd_lru_count = 0;
+static size_t      fd_cache_max = 0;
+unsigned long long fd_cache_hits = 0;
+unsigned long long fd_cache_misses = 0;
+
+static size_t
+fd_cache_limit()
+{
+	if (fd_cache_max)
+		return fd_cache_max;
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0 ||
+	    lim.rlim_cur == RLIM_INFINITY ||
+	    lim.rlim_cur > 65536)
+	{
+		fd_cache_max = 32768;
+	} else {
+		// Leave room for files being written and directory handles.
+		fd_cache_max = (size_t)lim.rlim_cur / 2;
+		if (fd_cache_max < 16)
+			fd_cache_max = 16;
+	}
+	return fd_cache_max;
+}
+
+static void
+FileHandle_lruRemove(FileHandle *self)
+{
+	FileHandle *prev = self->lru_prev;
+	FileHandle *next = self->lru_next;
+	if (prev)
+		prev->lru_next = next;
+	else
+		fd_lru_head = next;
+	if (next)
+		next->lru_prev = prev;
+	else
+		fd_lru_tail = prev;
+	self->lru_prev = self->lru_next = NULL;
+	--fd_lru_count;
+}
+
+static void
+FileHandle_lruPush(FileHandle *self)
+{
+	self->lru_prev = NULL;
+	self->lru_next = fd_lru_head;
+	if (fd_lru_head)
+		fd_lru_head->lru_prev = self;
+	else
+		fd_lru_tail = self;
+	fd_lru_head = self;
+	++fd_lru_count;
+}
+
+static void
+FileHandle_evict(FileHandle *self)
+{
+	FileHandle_lruRemove(self);
+	verbose(VERBOSE_ACTIONS, "closing cached file: %s\n",
+	        self->fullpath);
+	close(self->fd);
+	self->fd = -1;
+	self->writeback.fd = -1;
+	self->flags |= FIES_FATTR_CLOSED;
+}
+
+static void
+fd_cache_evict()
+{
+	size_t limit = fd_cache_limit();
+	while (fd_lru_count > limit)
+		FileHandle_evict(fd_lru_tail);
+}
+
+// Mark a file as finished so its descriptor may be closed under pressure.
+// Files without a name cannot be reopened and are never cached.
+static void
+FileHandle_cache(FileHandle *self)
+{
+	if (self->fd == -1 ||
+	    (self->flags & (FIES_FATTR_CACHED | FIES_FATTR_UNLINKED)))
+	{
+		return;
+	}
+	self->flags |= FIES_FATTR_CACHED;
+	FileHandle_lruPush(self);
+	fd_cache_evict();
+}
+
+// Make sure the handle's file descriptor is open, writable if `write` is set.
+// Closed files are reopened read-only unless they are written to, as they may
+// have lost their write permissions since.
+static int
+FileHandle_open(FileHandle *self, bool write)
+{
+	if (self->fd != -1 && write && (self->flags & FIES_FATTR_RDONLY))
+		FileHandle_evict(self);
+	if (self->fd != -1) {
+		if (self->flags & FIES_FATTR_CACHED) {
+			++fd_cache_hits;
+			if (fd_lru_head != self) {
+				FileHandle_lruRemove(self);
+				FileHandle_lruPush(self);
+			}
+		}
+		return 0;
+	}
+	if (!(self->flags & FIES_FATTR_CLOSED))
+		return -EBADF;
+
+	++fd_cache_misses;
+	verbose(VERBOSE_ACTIONS, "reopening: %s\n", self->fullpath);
+	int dirfd;
+	const char *name;
+	int rc = dir_cache_parent(self->fullpath, &dirfd, &name);
+	if (rc < 0)
+		return rc;
+	const int access = write ? self->open_flags : O_RDONLY;
+	int fd = openat(dirfd, name, access | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	// Make sure the file has not been replaced in the meantime.
+	struct stat stbuf;
+	if (fstat(fd, &stbuf) != 0 ||
+	    stbuf.st_dev != self->dev || stbuf.st_ino != self->ino)
+	{
+		close(fd);
+		showerr("fies: file was replaced during extraction: %s\n",
+		        self->fullpath);
+		return -ESTALE;
+	}
+	self->fd = fd;
+	self->flags &= ~(FIES_FATTR_CLOSED | FIES_FATTR_RDONLY);
+	if (access != self->open_flags)
+		self->flags |= FIES_FATTR_RDONLY;
+	if ((self->mode & FIES_M_FMT) == FIES_M_FREG)
+		writeback_init(&self->writeback, fd, opt_writeback);
+	FileHandle_lruPush(self);
+	fd_cache_evict();
+	return 0;
+}
+
+static void
+FileHandle_delete(FileHandle *self)
+{
+	if (self->lru_prev || self->lru_next || fd_lru_head == self)
+		FileHandle_lruRemove(self);
+	// Files which never saw their end still get linked so that partial
+	// extractions behave the same as without O_TMPFILE.
+	(void)FileHandle_link(self);
+	if (self->fd != -1)
+		close(self->fd);
+	FileHandle_symlink(self);
+	Vector_destroy(&self->xattrs);
 	free(self->fullpath);
 	free(self->target);
 	free(self);
 }
 
+// Resolve a handle without a file descriptor: directories yield their cached
+// handle and no name, other files their parent directory and base name.
+static int
+FileHandle_at(FileHandle *self, int *pdirfd, const char **pname)
+{
+	if ((self->mode & FIES_M_FMT) != FIES_M_FDIR)
+		return dir_cache_parent(self->fullpath, pdirfd, pname);
+	*pname = NULL;
+	return dir_cache_get(self->fullpath, pdirfd);
+}
+
+static void
+FileHandle_applyMeta(FileHandle *self)
+{
+	if (!(self->flags & FIES_FATTR_OWNER) &&
+	    !(self->flags & FIES_FATTR_MTIME) &&
+	    Vector_empty(&self->xattrs))
+	{
+		return;
+	}
+
+	int rc;
+	int fd = self->fd;
+	const char *name = NULL;
+	if (fd == -1) {
+		rc = FileHandle_at(self, &fd, &name);
+		if (rc < 0) {
+			showerr("fies: %s: %s\n", self->fullpath, strerror(-rc));
+			return;
+		}
+	}
+
+	if (self->flags & FIES_FATTR_OWNER) {
+		verbose(VERBOSE_ACTIONS, "chown: %s %u %u\n",
+		        self->fullpath, self->uid, self->gid);
+		if (name)
+			rc = fchownat(fd, name, self->uid, self->gid,
+			              AT_SYMLINK_NOFOLLOW);
+		else
+			rc = fchown(fd, self->uid, self->gid);
+		if (rc != 0)
+			warn(WARN_CHOWN, "fies: chown: %s (ignoring error)\n",
+			     strerror(errno));
+	}
+
+	XattrEntry *xa;
+	Vector_foreach(&self->xattrs, xa) {
+		verbose(VERBOSE_ACTIONS,
+		        "setxattr: %s: %s = data of size %zu\n",
+		        self->fullpath, xa->name, xa->length);
+		if (name)
+			rc = lsetxattr(self->fullpath, xa->name, xa->value,
+			               xa->length, 0);
+		else
+			rc = fsetxattr(fd, xa->name, xa->value, xa->length, 0);
+		if (rc != 0)
+			warn(WARN_XATTR, "fies: setxattr: %s\n",
+			     strerror(errno));
+	}
+	Vector_clear(&self->xattrs);
+
+	// Last since changing xattrs updates the change time, and some file
+	// systems update the modification time along with it.
+	if (self->flags & FIES_FATTR_MTIME) {
+		verbose(VERBOSE_ACTIONS, "setmtime: %s %zu %zu\n",
+		        self->fullpath, (size_t)self->time[1].tv_sec,
+		        (size_t)self->time[1].tv_nsec);
+		if (name)
+			rc = utimensat(fd, name, self->time,
+			               AT_SYMLINK_NOFOLLOW);
+		else
+			rc = futimens(fd, self->time);
+		if (rc != 0)
+			warn(WARN_MTIME,
+			     "fies: futimens: %s (ignoring error)\n",
+			     strerror(errno));
+	}
+	self->flags &= ~(uint32_t)(FIES_FATTR_OWNER | FIES_FATTR_MTIME);
+}
+
+static size_t
+path_depth(const char *path)
+{
+	size_t depth = 0;
+	for (; *path; ++path)
+		if (*path == '/')
+			++depth;
+	return depth;
+}
+
+// Files first, grouped by directory, then directories from the bottom up so
+// that no later change touches a directory's modification time again.
+static int
+handle_meta_order(const void *pa, const void *pb)
+{
+	const FileHandle *a = *(FileHandle*const*)pa;
+	const FileHandle *b = *(FileHandle*const*)pb;
+	bool adir = (a->mode & FIES_M_FMT) == FIES_M_FDIR;
+	bool bdir = (b->mode & FIES_M_FMT) == FIES_M_FDIR;
+	if (adir != bdir)
+		return adir ? 1 : -1;
+	if (adir) {
+		size_t adepth = path_depth(a->fullpath);
+		size_t bdepth = path_depth(b->fullpath);
+		if (adepth != bdepth)
+			return adepth > bdepth ? -1 : 1;
+	}
+	return strcmp(a->fullpath, b->fullpath);
+}
+
+static void
+apply_deferred_meta()
+{
+	if (!handles_ready)
+		return;
+
+	// Finish all modifications of the directory tree first.
+	FileHandle **pfh;
+	Vector_foreach(&handles, pfh) {
+		(void)FileHandle_link(*pfh);
+		FileHandle_symlink(*pfh);
+	}
+
+	qsort(Vector_data(&handles), Vector_length(&handles),
+	      sizeof(FileHandle*), handle_meta_order);
+	Vector_foreach(&handles, pfh)
+		FileHandle_applyMeta(*pfh);
+
+	Vector_destroy(&handles);
+	handles_ready = false;
+}
+
 static char*
 opt_transform_filename(const char *in_filename)
 {
@@ -102,24 +709,6 @@ opt_transform_filename(const char *in_filename)
 	return xform;
 }
 
-// create directories up to dirname(file) allowing us to create the file in it
-static void
-make_dir_tree(char *file)
-{
-	char *next = file;
-	while ( (next = strchr(next+1, '/')) ) {
-		*next = 0;
-		int rc = mkdir(file, 0777);
-		if (rc != 0 && errno != EEXIST) {
-			warn(WARN_MKDIR, "fies: failed to create path: %s\n",
-			     file);
-			*next = '/';
-			return;
-		}
-		*next = '/';
-	}
-}
-
 static int
 do_create(void *opaque,
           const char *in_filename,
@@ -169,37 +758,76 @@ do_create(void *opaque,
 		size = 0;
 	}
 
-	if (unlink(filename) != 0 && errno != ENOENT &&
+	if (filetype == FIES_M_FDIR) {
+		size_t len = strlen(filename);
+		while (len > 1 && filename[len-1] == '/')
+			filename[--len] = 0;
+	}
+
+	int dirfd;
+	const char *base;
+	retval = dir_cache_parent(filename, &dirfd, &base);
+	if (retval < 0) {
+		showerr("fies: %s: %s\n", filename, strerror(-retval));
+		goto err_out;
+	}
+
+	// Regular files are created as anonymous inodes and only linked into
+	// place (replacing existing files) once they are complete.
+	bool unlinked = false;
+	if (filetype == FIES_M_FREG && tmpfile_usable) {
+		fd = openat(dirfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, perms);
+		if (fd >= 0)
+			unlinked = true;
+		else if (errno == EOPNOTSUPP || errno == EISDIR ||
+		         errno == EINVAL)
+			tmpfile_usable = false;
+		else
+			warn(WARN_UNLINK, "fies: O_TMPFILE in directory of %s: "
+			     "%s\n", filename, strerror(errno));
+	}
+
+	if (!unlinked && unlinkat(dirfd, base, 0) != 0 && errno != ENOENT &&
 	    !(filetype == FIES_M_FDIR && errno == EISDIR))
 	{
 		warn(WARN_UNLINK, "fies: error unlinking %s: %s\n",
 		     filename, strerror(errno));
 	}
 
+	// Directories stay open in the directory cache, so their handle does
+	// not hold on to a file descriptor.
+	int statfd;
 	if (filetype == FIES_M_FDIR) {
 		verbose(VERBOSE_FILES, "%s/\n", filename);
-		openmode = O_DIRECTORY;
 		verbose(VERBOSE_ACTIONS, "mkdir: %s\n", filename);
-		if (mkdir(filename, perms) != 0 && errno != EEXIST) {
+		if (mkdirat(dirfd, base, perms) != 0 && errno != EEXIST) {
 			retval = -errno;
 			showerr("fies: mkdir(%s): %s\n",
 			        filename, strerror(errno));
 			goto err_out;
 		}
+		retval = dir_cache_get(filename, &statfd);
+		if (retval < 0) {
+			showerr("fies: open(%s): %s\n",
+			        filename, strerror(-retval));
+			goto err_out;
+		}
 	} else {
 		verbose(VERBOSE_FILES, "%s\n", filename);
 		verbose(VERBOSE_ACTIONS, "create: %s\n", filename);
+		if (!unlinked)
+			fd = openat(dirfd, base, openmode | O_CLOEXEC, perms);
+		if (fd < 0) {
+			retval = -errno;
+			showerr("fies: open(%s): %s\n",
+			        filename, strerror(errno));
+			goto err_out;
+		}
+		statfd = fd;
 	}
 
-	make_dir_tree(filename);
-	fd = open(filename, openmode, perms);
-	if (fd < 0) {
-		retval = -errno;
-		showerr("fies: open(%s): %s\n", filename, strerror(errno));
-		goto err_out;
-	}
 	struct stat stbuf;
-	if (fstat(fd, &stbuf) != 0) {
+	if (fstat(statfd, &stbuf) != 0) {
 		retval = -errno;
 		showerr("fies: stat(%s): %s\n", filename, strerror(errno));
 		goto err_out;
@@ -212,7 +840,7 @@ do_create(void *opaque,
 	if (opt_uid != -1 || opt_gid != -1) {
 		uid_t uid = (opt_uid != -1) ? (uid_t)opt_uid : (uid_t)-1;
 		gid_t gid = (opt_gid != -1) ? (gid_t)opt_gid : (gid_t)-1;
-		if (chown(filename, uid, gid) != 0) {
+		if (fchown(statfd, uid, gid) != 0) {
 			warn(WARN_CHOWN, "fies: chown(%s): %s\n",
 			     filename, strerror(errno));
 		}
@@ -223,11 +851,6 @@ do_create(void *opaque,
 		goto err_out;
 	}
 
-	if (filetype == FIES_M_FDIR) {
-		close(fd);
-		fd = -1;
-	}
-
 	FileHandle *handle = FileHandle_new(fd, mode, filename);
 	if (!handle) {
 		retval = -errno;
@@ -235,6 +858,15 @@ do_create(void *opaque,
 		goto err_out;
 	}
 	handle->blocksize = (size_t)stbuf.st_blksize;
+	handle->dev = stbuf.st_dev;
+	handle->ino = stbuf.st_ino;
+	handle->open_flags = O_RDWR;
+	if (unlinked)
+		handle->flags |= FIES_FATTR_UNLINKED;
+	if (filetype == FIES_M_FREG) {
+		handle->flags |= FIES_FATTR_ZEROED;
+		writeback_init(&handle->writeback, fd, opt_writeback);
+	}
 
 	*out_handle = handle;
 	return 0;
@@ -263,7 +895,15 @@ do_reference(void *opaque,
 	if (!filename)
 		return -errno;
 
-	int fd = open(filename, O_RDONLY);
+	int dirfd;
+	const char *base;
+	int fd = -1;
+	retval = dir_cache_parent(filename, &dirfd, &base);
+	if (retval < 0) {
+		showerr("fies: %s: %s\n", filename, strerror(-retval));
+		goto err_out;
+	}
+	fd = openat(dirfd, base, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
 		retval = -errno;
 		showerr("fies: open(%s): %s\n", filename, strerror(errno));
@@ -292,6 +932,11 @@ do_reference(void *opaque,
 		goto err_out;
 	}
 	handle->blocksize = (size_t)stbuf.st_blksize;
+	handle->dev = stbuf.st_dev;
+	handle->ino = stbuf.st_ino;
+	handle->open_flags = O_RDONLY;
+	// References are only ever read from.
+	FileHandle_cache(handle);
 
 	*out_handle = handle;
 	return 0;
@@ -325,15 +970,36 @@ do_hardlink(void *opaque, void *psrc, const char *in_filename)
 	verbose(VERBOSE_FILES, "%s => %s\n", filename, src->fullpath);
 	verbose(VERBOSE_ACTIONS, "link: %s => %s\n", filename, src->fullpath);
 	int ret;
-	if (unlink(filename) != 0 && errno != ENOENT) {
+	int srcdirfd, dirfd;
+	const char *srcbase, *base;
+	ret = FileHandle_link(src);
+	if (ret < 0)
+		goto out;
+	ret = dir_cache_parent(src->fullpath, &srcdirfd, &srcbase);
+	if (ret < 0)
+		goto out;
+	// Looking up the destination may evict the source directory.
+	if (srcdirfd != AT_FDCWD) {
+		srcdirfd = fcntl(srcdirfd, F_DUPFD_CLOEXEC, 0);
+		if (srcdirfd < 0) {
+			ret = -errno;
+			goto out;
+		}
+	}
+	ret = dir_cache_parent(filename, &dirfd, &base);
+	if (ret < 0)
+		goto out_close;
+	if (unlinkat(dirfd, base, 0) != 0 && errno != ENOENT) {
 		ret = -errno;
 		showerr("fies: failed to unlink %s: %s\n",
 		        filename, strerror(-ret));
-		free(filename);
-		return ret;
+		goto out_close;
 	}
-	make_dir_tree(filename);
-	ret = link(src->fullpath, filename) == 0 ? 0 : -errno;
+	ret = linkat(srcdirfd, srcbase, dirfd, base, 0) == 0 ? 0 : -errno;
+out_close:
+	if (srcdirfd != AT_FDCWD)
+		close(srcdirfd);
+out:
 	free(filename);
 	return ret;
 }
@@ -354,7 +1020,6 @@ do_mknod(void *opaque,
 {
 	(void)opaque;
 	int retval = 0;
-	int dirfd = -1;
 	mode_t perms = 0666;
 	if (!fies_mode_to_stat(mode, &perms)) {
 		warn(0, "fies: bad fies file mode flags\n");
@@ -380,29 +1045,18 @@ do_mknod(void *opaque,
 	verbose(VERBOSE_ACTIONS, "mknod: %s %u %u\n",
 	        filename, major_id, minor_id);
 
-	// Since we don't want to open the device itself we open a directory
-	// handle and use fchmodat() & friends.
-	char *dir, *base;
-	path_parts(filename, &dir, &base, PATH_PARTS_RELATIVE_DOT);
-	if (!dir || !base) {
-		showerr("fies: invalid path: %s\n", filename);
-		retval = -EINVAL;
-		goto err_out;
-	}
-
-	make_dir_tree(dir);
-	mkdir(dir, 0777);
-	dirfd = open(dir, O_DIRECTORY);
-	if (dirfd < 0) {
-		retval = -errno;
-		showerr("fies: error opening directory %s: %s\n",
-		        dir, strerror(errno));
+	// Since we don't want to open the device itself we work relative to
+	// its parent directory and use fchownat() & friends.
+	int dirfd;
+	const char *base;
+	retval = dir_cache_parent(filename, &dirfd, &base);
+	if (retval < 0) {
+		showerr("fies: error opening directory of %s: %s\n",
+		        filename, strerror(-retval));
 		goto err_out;
 	}
-	free(dir);
-	dir = NULL;
 
-	if (unlinkat(dirfd, filename, 0) != 0 && errno != ENOENT) {
+	if (unlinkat(dirfd, base, 0) != 0 && errno != ENOENT) {
 		retval = -errno;
 		showerr("fies: failed to unlink %s: %s\n",
 		        filename, strerror(errno));
@@ -416,15 +1070,13 @@ do_mknod(void *opaque,
 	}
 
 	FileHandle *fh = FileHandle_new(-1, mode, filename);
-	fh->dirfd = dirfd;
-	fh->target = base;
+	if (!fh) {
+		retval = -errno;
+		goto err_out;
+	}
 	*handle = fh;
 	return 0;
 err_out:
-	if (dirfd != -1)
-		close(dirfd);
-	free(dir);
-	free(base);
 	free(filename);
 	return retval;
 }
@@ -448,15 +1100,24 @@ do_symlink(void *opaque,
 	verbose(VERBOSE_FILES, "-> %s\n", filename, target);
 	verbose(VERBOSE_ACTIONS, "symlink: %s -> %s\n", filename, target);
 
-	if (unlink(filename) != 0 && errno != ENOENT) {
+	int dirfd;
+	const char *base;
+	retval = dir_cache_parent(filename, &dirfd, &base);
+	if (retval < 0) {
+		showerr("fies: error opening directory of %s: %s\n",
+		        filename, strerror(-retval));
+		goto err_out;
+	}
+
+	if (unlinkat(dirfd, base, 0) != 0 && errno != ENOENT) {
 		retval = -errno;
 		showerr("fies: failed to unlink %s: %s\n",
 		        filename, strerror(errno));
 		goto err_out;
 	}
 
-	make_dir_tree(filename);
-	int fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0000);
+	int fd = openat(dirfd, base, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+	                0000);
 	if (fd < 0) {
 		retval = -errno;
 		showerr("fies: failed to create file for symlink: %s: %s\n",
@@ -474,11 +1135,51 @@ err_out:
 	return retval;
 }
 
+// Files removed since the stream this one is an update to. These come after
+// all files, directories after their contents.
+static int
+do_unlink(void *opaque, const char *in_filename)
+{
+	(void)opaque;
+	if (opt_is_path_excluded(in_filename, 0, false, true)) {
+		verbose(VERBOSE_EXCLUSIONS, "fies: excluding: %s\n",
+		        in_filename);
+		return 0;
+	}
+	char *filename = opt_transform_filename(in_filename);
+	if (!filename)
+		return -errno;
+	verbose(VERBOSE_FILES, "rm %s\n", filename);
+	verbose(VERBOSE_ACTIONS, "unlink: %s\n", filename);
+
+	int rc = unlinkat(AT_FDCWD, filename, 0);
+	if (rc != 0 && (errno == EISDIR || errno == EPERM)) {
+		rc = unlinkat(AT_FDCWD, filename, AT_REMOVEDIR);
+		// The directory cache must not hand out removed directories.
+		if (rc == 0 && dir_cache_ready)
+			Map_clear(&dir_cache);
+	}
+	if (rc != 0 && errno != ENOENT) {
+		warn(WARN_UNLINK, "fies: error removing %s: %s\n",
+		     filename, strerror(errno));
+	}
+	free(filename);
+	return 0;
+}
+
 static ssize_t
 do_send(void *opaque, void *out, fies_pos pos, size_t count)
 {
 	int fdin = *(int*)opaque;
 	FileHandle *fhout = out;
+	// Zero detection needs to see the data.
+	if (opt_skip_zeroes)
+		return -ENOTSUP;
+	int rc = clone_flush(opaque);
+	if (rc < 0)
+		return rc;
+	if ((rc = FileHandle_open(fhout, true)) < 0)
+		return rc;
 	off_t sk = lseek(fhout->fd, (off_t)pos, SEEK_SET);
 	if (sk < 0)
 		return sk;
@@ -486,14 +1187,21 @@ do_send(void *opaque, void *out, fies_pos pos, size_t count)
 	        pos, count, fhout->fullpath);
 	ssize_t put = sendfile(fhout->fd, fdin, NULL, count);
 	verbose(VERBOSE_ACTIONS, "send:   returned %zi\n", put);
-	return put < 0 ? -errno : put;
+	if (put < 0)
+		return -errno;
+	writeback_wrote(&fhout->writeback, sk, (size_t)put);
+	return put;
 }
 
 static int
 do_punch_hole(void *opaque, void *out, fies_pos off, size_t length)
 {
-	(void)opaque;
 	FileHandle *fhout = out;
+	int rc = clone_flush(opaque);
+	if (rc < 0)
+		return rc;
+	if ((rc = FileHandle_open(fhout, true)) < 0)
+		return rc;
 	verbose(VERBOSE_ACTIONS, "punch hole: %zx : %zx => %s\n",
 	        off, length, fhout->fullpath);
 	if (fallocate(fhout->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
@@ -509,12 +1217,14 @@ make_zero(void *opaque, void *out, fies_pos pos, size_t count)
 {
 	FileHandle *fhout = out;
 	int mode = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+	int rc = FileHandle_open(fhout, true);
+	if (rc < 0)
+		return rc;
 	verbose(VERBOSE_ACTIONS, "zero-out: %zx : %zx => %s\n",
 	        pos, count, fhout->fullpath);
 	if (fallocate(fhout->fd, mode, (off_t)pos, (off_t)count) == 0)
 		return (ssize_t)count;
 
-	int rc;
 	if (errno == EOPNOTSUPP) {
 		verbose(VERBOSE_ACTIONS, "zero-out failed, punching hole\n");
 		rc = do_punch_hole(opaque, out, pos, count);
@@ -526,16 +1236,186 @@ make_zero(void *opaque, void *out, fies_pos pos, size_t count)
 	return (ssize_t)count;
 }
 
+unsigned long long zero_skipped = 0;
+
+// Data in the stream can still be all zeroes. Since stream extents do not
+// overlap, such blocks can be skipped in freshly created files, otherwise we
+// punch holes into the file.
+static ssize_t
+pwrite_skip_zeroes(void *opaque, FileHandle *fhout,
+                   const char *buf, size_t count, fies_pos pos)
+{
+	size_t blocksize = fhout->blocksize ? fhout->blocksize : 4096;
+	size_t done = 0;
+	while (done != count) {
+		bool zero;
+		size_t len = zero_run_length(buf + done, count - done,
+		                             pos + done, blocksize, &zero);
+		if (zero && !(fhout->flags & FIES_FATTR_ZEROED)) {
+			if (do_punch_hole(opaque, fhout, pos + done, len) != 0)
+				zero = false;
+		}
+		if (zero) {
+			verbose(VERBOSE_ACTIONS, "skip zeroes: %zx : %zx => %s\n",
+			        pos + done, len, fhout->fullpath);
+			zero_skipped += len;
+			done += len;
+			continue;
+		}
+		verbose(VERBOSE_ACTIONS, "write: %zx : %zx => %s\n",
+		        pos + done, len, fhout->fullpath);
+		ssize_t put = pwrite(fhout->fd, buf + done, len,
+		                     (off_t)(pos + done));
+		if (put < 0)
+			return done ? (ssize_t)done : -errno;
+		writeback_wrote(&fhout->writeback, (off_t)(pos + done),
+		                (size_t)put);
+		done += (size_t)put;
+		if ((size_t)put != len)
+			break;
+	}
+	return (ssize_t)done;
+}
+
 static ssize_t
 do_pwrite(void *opaque, void *out, const void *buf, size_t count, fies_pos pos)
 {
 	FileHandle *fhout = out;
+	int rc = clone_flush(opaque);
+	if (rc < 0)
+		return rc;
 	if (!buf)
 		return make_zero(opaque, out, pos, count);
+	if ((rc = FileHandle_open(fhout, true)) < 0)
+		return rc;
+	if (opt_skip_zeroes)
+		return pwrite_skip_zeroes(opaque, fhout, buf, count, pos);
 	verbose(VERBOSE_ACTIONS, "write: %zx : %zx => %s\n",
 	        pos, count, fhout->fullpath);
 	ssize_t put = pwrite(fhout->fd, buf, count, (off_t)pos);
-	return put < 0 ? -errno : put;
+	if (put < 0)
+		return -errno;
+	writeback_wrote(&fhout->writeback, (off_t)pos, (size_t)put);
+	return put;
+}
+
+static bool copy_file_range_usable = true;
+static bool sendfile_usable = true;
+
+static int
+copy_user(FileHandle *dstfh, fies_pos dstoff,
+          FileHandle *srcfh, fies_pos srcoff,
+          fies_sz len)
+{
+	size_t bufsize = len < COPY_BUFFER_SIZE ? (size_t)len
+	                                        : COPY_BUFFER_SIZE;
+	void *buf = malloc(bufsize);
+	if (!buf)
+		return -errno;
+	int rc = 0;
+	while (len) {
+		size_t step = len < bufsize ? (size_t)len : bufsize;
+		ssize_t got = pread(srcfh->fd, buf, step, (off_t)srcoff);
+		if (got <= 0) {
+			rc = got < 0 ? -errno : -EIO;
+			break;
+		}
+		ssize_t put = pwrite(dstfh->fd, buf, (size_t)got,
+		                     (off_t)dstoff);
+		if (put <= 0) {
+			rc = put < 0 ? -errno : -EIO;
+			break;
+		}
+		clone_info.user_copy += (unsigned long long)put;
+		writeback_wrote(&dstfh->writeback, (off_t)dstoff, (size_t)put);
+		srcoff += (fies_sz)put;
+		dstoff += (fies_sz)put;
+		len -= (fies_sz)put;
+	}
+	free(buf);
+	return rc;
+}
+
+static bool
+copy_errno_is_fallback(int err)
+{
+	return err == ENOSYS || err == EXDEV || err == EINVAL ||
+	       err == EOPNOTSUPP || err == ENOTSUP;
+}
+
+// Copy a data region in chunks, preferring copy_file_range() which lets the
+// kernel or the file system offload the copy, then sendfile(), then a plain
+// read/write loop.
+static int
+copy_data(FileHandle *dstfh, fies_pos dstoff,
+          FileHandle *srcfh, fies_pos srcoff,
+          fies_sz len)
+{
+	while (len) {
+		size_t step = len < COPY_CHUNK_SIZE ? (size_t)len
+		                                    : COPY_CHUNK_SIZE;
+		ssize_t put = -1;
+		if (copy_file_range_usable &&
+		    !(dstfh->flags & FIES_FATTR_NOCOPYRANGE))
+		{
+			off_t soff = (off_t)srcoff;
+			off_t doff = (off_t)dstoff;
+			put = copy_file_range(srcfh->fd, &soff,
+			                      dstfh->fd, &doff,
+			                      step, 0);
+			if (put > 0) {
+				clone_info.copy_range +=
+					(unsigned long long)put;
+				goto advance;
+			}
+			if (put == 0)
+				return -EIO;
+			if (!copy_errno_is_fallback(errno))
+				return -errno;
+			if (errno == ENOSYS)
+				copy_file_range_usable = false;
+			else
+				dstfh->flags |= FIES_FATTR_NOCOPYRANGE;
+			verbose(VERBOSE_ACTIONS,
+			        "  copy_file_range: %s, falling back\n",
+			        strerror(errno));
+		}
+
+		if (sendfile_usable) {
+			off_t pos = lseek(dstfh->fd, (off_t)dstoff, SEEK_SET);
+			if (pos < 0) {
+				int rc = -errno;
+				showerr("fies: seek failed in %s: %s\n",
+				        dstfh->fullpath, strerror(errno));
+				return rc;
+			}
+			if ((fies_pos)pos != dstoff) {
+				showerr("fies: bad seek offset in %s\n",
+				        dstfh->fullpath);
+				return -EIO;
+			}
+			off_t soff = (off_t)srcoff;
+			put = sendfile(dstfh->fd, srcfh->fd, &soff, step);
+			if (put > 0) {
+				clone_info.sendfile += (unsigned long long)put;
+				goto advance;
+			}
+			if (put == 0)
+				return -EIO;
+			if (!copy_errno_is_fallback(errno))
+				return -errno;
+			sendfile_usable = false;
+		}
+
+		return copy_user(dstfh, dstoff, srcfh, srcoff, len);
+
+	advance:
+		writeback_wrote(&dstfh->writeback, (off_t)dstoff, (size_t)put);
+		srcoff += (fies_sz)put;
+		dstoff += (fies_sz)put;
+		len -= (fies_sz)put;
+	}
+	return 0;
 }
 
 static int
@@ -544,10 +1424,6 @@ do_full_copy(void *opaque,
              void *src, fies_pos srcoff,
              fies_sz len)
 {
-	(void)opaque;
-	(void)dstoff;
-	(void)srcoff;
-
 	FileHandle *srcfh = src;
 	FileHandle *dstfh = dst;
 
@@ -556,45 +1432,75 @@ do_full_copy(void *opaque,
 	        dstoff, dstfh->fullpath,
 	        len);
 
-	off_t pos = lseek(dstfh->fd, (off_t)dstoff, SEEK_SET);
-	if (pos < 0) {
-		int rc = -errno;
-		showerr("fies: seek failed in %s: %s\n",
-		        dstfh->fullpath, strerror(errno));
-		return rc;
-	}
-	if ((fies_pos)pos != dstoff) {
-		showerr("fies: bad seek offset in %s\n", dstfh->fullpath);
-		return -EIO;
-	}
+	clone_info.unshared += len;
 
-	off_t soff = (off_t)srcoff;
-	ssize_t put = sendfile(dstfh->fd, srcfh->fd, &soff, (size_t)len);
-	if (put < 0)
-		return (int)put;
-	if ((fies_sz)put != len) {
-		showerr("fies: short write\n");
-		return -EIO;
+	// Skip over holes in the source, there's no need to read them.
+	const fies_pos srcend = srcoff + len;
+	while (srcoff != srcend) {
+		fies_pos data = srcoff;
+		off_t found = lseek(srcfh->fd, (off_t)srcoff, SEEK_DATA);
+		if (found >= 0)
+			data = (fies_pos)found;
+		else if (errno == ENXIO)
+			data = srcend;
+		if (data > srcend)
+			data = srcend;
+
+		if (data != srcoff) {
+			fies_sz hole = data - srcoff;
+			// The destination may contain older data.
+			if (do_punch_hole(opaque, dst, dstoff, hole) == 0) {
+				clone_info.holes += hole;
+			} else {
+				int rc = copy_data(dstfh, dstoff,
+				                   srcfh, srcoff, hole);
+				if (rc < 0)
+					return rc;
+			}
+			srcoff += hole;
+			dstoff += hole;
+			if (srcoff == srcend)
+				break;
+		}
+
+		fies_pos datend = srcend;
+		found = lseek(srcfh->fd, (off_t)srcoff, SEEK_HOLE);
+		if (found >= 0 && (fies_pos)found > srcoff &&
+		    (fies_pos)found < srcend)
+		{
+			datend = (fies_pos)found;
+		}
+		int rc = copy_data(dstfh, dstoff, srcfh, srcoff,
+		                   datend - srcoff);
+		if (rc < 0) {
+			showerr("fies: copy to %s failed: %s\n",
+			        dstfh->fullpath, strerror(-rc));
+			return rc;
+		}
+		dstoff += datend - srcoff;
+		srcoff = datend;
 	}
-	clone_info.unshared += len;
 	return 0;
 }
 
 static int
-do_clone(void *opaque,
-         void *dst, fies_pos dstoff,
-         void *src, fies_pos srcoff,
-         size_t len)
+do_clone_range(void *opaque,
+               void *dst, fies_pos dstoff,
+               void *src, fies_pos srcoff,
+               size_t len)
 {
-	(void)opaque;
-
-	clone_info.stream_shared += len;
+	FileHandle *srcfh = src;
+	FileHandle *dstfh = dst;
+	int rc;
+	if ((rc = FileHandle_open(srcfh, false)) < 0 ||
+	    (rc = FileHandle_open(dstfh, true)) < 0)
+	{
+		return rc;
+	}
 
 	if (opt_clone == CLONE_NEVER)
 		return do_full_copy(opaque, dst, dstoff, src, srcoff, len);
 
-	FileHandle *srcfh = src;
-	FileHandle *dstfh = dst;
 	verbose(VERBOSE_ACTIONS, "clone: (%s)0x%zx => 0x%zx(%s) : 0x%zx\n",
 	        srcfh->fullpath, srcoff,
 	        dstoff, dstfh->fullpath,
@@ -646,7 +1552,6 @@ do_clone(void *opaque,
 	if (a_srcdiff != a_dstdiff) // case 1 above
 		return do_full_copy(opaque, dst, dstoff, src, srcoff, len);
 
-	int rc;
 	if (a_srcdiff) {
 		rc = do_full_copy(opaque, dst, dstoff, src, srcoff, a_srcdiff);
 		if (rc < 0)
@@ -679,6 +1584,57 @@ do_clone(void *opaque,
 	return 0;
 }
 
+static int
+clone_flush(void *opaque)
+{
+	CloneRange *pending = &clone_pending;
+	if (!pending->length)
+		return 0;
+	fies_sz len = pending->length;
+	pending->length = 0;
+	int rc = do_clone_range(opaque,
+	                        pending->dst, pending->dstoff,
+	                        pending->src, pending->srcoff,
+	                        len);
+	if (rc < 0) {
+		showerr("fies: clone into %s failed: %s\n",
+		        pending->dst->fullpath, strerror(-rc));
+		extract_setError(rc);
+	}
+	return rc;
+}
+
+static int
+do_clone(void *opaque,
+         void *dst, fies_pos dstoff,
+         void *src, fies_pos srcoff,
+         size_t len)
+{
+	clone_info.stream_shared += len;
+
+	CloneRange *pending = &clone_pending;
+	if (pending->length &&
+	    pending->dst == dst &&
+	    pending->src == src &&
+	    pending->dstoff + pending->length == dstoff &&
+	    pending->srcoff + pending->length == srcoff &&
+	    pending->length + len <= CLONE_MERGE_MAX)
+	{
+		pending->length += len;
+		return 0;
+	}
+
+	int rc = clone_flush(opaque);
+	if (rc < 0)
+		return rc;
+	pending->dst = dst;
+	pending->src = src;
+	pending->dstoff = dstoff;
+	pending->srcoff = srcoff;
+	pending->length = len;
+	return 0;
+}
+
 static int
 do_chown(void *opaque, void *pfd, uid_t uid, gid_t gid)
 {
@@ -701,20 +1657,9 @@ do_chown(void *opaque, void *pfd, uid_t uid, gid_t gid)
 		uid = (uid_t)opt_uid;
 	if (opt_gid != -1)
 		gid = (gid_t)opt_gid;
-	int rc;
-	verbose(VERBOSE_ACTIONS, "chown: %s %u %u\n",
-	        fh->fullpath ? fh->fullpath : "", uid, gid);
-	if (fh->fd != -1)
-		rc = fchown(fh->fd, uid, gid);
-	else if (fh->target)
-		rc = fchownat(fh->dirfd, fh->target, uid, gid,
-		              AT_SYMLINK_NOFOLLOW);
-	else
-		rc = -(errno = EFAULT);
-
-	if (rc != 0)
-		warn(WARN_CHOWN, "fies: chown: %s (ignoring error)\n",
-		     strerror(errno));
+	fh->uid = uid;
+	fh->gid = gid;
+	fh->flags |= FIES_FATTR_OWNER;
 	return 0;
 }
 
@@ -731,9 +1676,6 @@ do_set_mtime(void *opaque, void *pfd, struct fies_time time)
 		return 0;
 	}
 
-	verbose(VERBOSE_ACTIONS, "setmtime: %s %zu %zu\n",
-	        fh->fullpath, (size_t)time.secs, (size_t)time.nsecs);
-
 	if (fh->flags & FIES_FATTR_MTIME)
 		warn(WARN_STREAM, "fies: multiple modification times for %s\n",
 		     fh->fullpath);
@@ -759,29 +1701,47 @@ do_set_xattr(void *opaque,
 		return 0;
 	}
 
-	verbose(VERBOSE_ACTIONS, "setxattr: %s: %s = data of size %zu\n",
-	        fh->fullpath, name, length);
-
-	int rc;
-	if (fh->fd != -1) {
-		rc = fsetxattr(fh->fd, name, value, length, 0)
-		     == 0 ? 0 : -errno;
+	XattrEntry entry = { strdup(name), malloc(length ? length : 1),
+	                     length };
+	if (!entry.name || !entry.value) {
+		XattrEntry_destroy(&entry);
+		return -ENOMEM;
 	}
-	else if (fh->target) {
-		int fd = openat(fh->dirfd, fh->target, O_WRONLY);
-		if (fd < 0) {
-			rc = -errno;
-		} else {
-			rc = fsetxattr(fd, name, value, length, 0)
-			     == 0 ? 0 : -errno;
-			close(fd);
+	memcpy(entry.value, value, length);
+	Vector_push(&fh->xattrs, &entry);
+	return 0;
+}
+
+static bool fallocate_usable = true;
+
+static int
+do_preallocate(void *opaque,
+               void *pfd,
+               fies_sz data_size,
+               const struct fies_alloc_range *ranges,
+               size_t count)
+{
+	(void)opaque;
+	FileHandle *fh = pfd;
+	if (fh->fd == -1 || !fallocate_usable)
+		return 0;
+	verbose(VERBOSE_ACTIONS, "preallocate: %s: %zu bytes in %zu ranges\n",
+	        fh->fullpath, (size_t)data_size, count);
+	for (size_t i = 0; i != count; ++i) {
+		if (fallocate(fh->fd, FALLOC_FL_KEEP_SIZE,
+		              (off_t)ranges[i].offset,
+		              (off_t)ranges[i].length) == 0)
+		{
+			continue;
 		}
-	} else {
-		rc = setxattr(fh->fullpath, name, value, length, 0)
-		     == 0 ? 0 : -errno;
+		if (errno == EOPNOTSUPP || errno == ENOSYS)
+			fallocate_usable = false;
+		// This is only a hint, running out of space will show up as
+		// an error once the data arrives.
+		verbose(VERBOSE_ACTIONS, "preallocate failed: %s\n",
+		        strerror(errno));
+		break;
 	}
-	if (rc < 0)
-		warn(WARN_XATTR, "fies: setxattr: %s\n", strerror(-rc));
 	return 0;
 }
 
@@ -796,38 +1756,38 @@ do_meta_end(void *opaque, void *fd)
 static int
 do_close(void *opaque, void *pfd)
 {
-	(void)opaque;
+	int rc = 0;
+	if (clone_pending.length &&
+	    (clone_pending.dst == pfd || clone_pending.src == pfd))
+	{
+		rc = clone_flush(opaque);
+	}
 	FileHandle_delete(pfd);
-	return 0;
+	return rc;
 }
 
 static int
 do_file_done(void *opaque, void *pfd)
 {
-	(void)opaque;
 	FileHandle *fh = pfd;
-	if (fh->flags & FIES_FATTR_MTIME) {
-		int rc;
-		if (fh->fd != -1)
-			rc = futimens(fh->fd, fh->time);
-		else if (fh->target)
-			rc = utimensat(fh->dirfd, fh->target, fh->time,
-			               AT_SYMLINK_NOFOLLOW);
-		else
-			rc = -(errno = EFAULT);
-		if (rc != 0)
-			warn(WARN_MTIME,
-			     "fies: futimens: %s (ignoring error)\n",
-			     strerror(errno));
-	}
+	int rc = clone_flush(opaque);
+	if (rc < 0)
+		return rc;
+	writeback_finish(&fh->writeback);
+	rc = FileHandle_link(fh);
+	if (rc < 0)
+		return rc;
+	FileHandle_cache(fh);
 	return 0;
-
 }
 
+// The reader ignores errors from here, clone_flush() records them for
+// extract_finish().
 static void
 do_finalize(void *opaque)
 {
-	(void)opaque;
+	(void)clone_flush(opaque);
+	apply_deferred_meta();
 }
 
 struct FiesReader_Funcs
@@ -849,7 +1809,9 @@ extract_reader_funcs = {
 	.clone      = do_clone,
 	.file_done  = do_file_done,
 	.close      = do_close,
-	.finalize   = do_finalize
+	.finalize   = do_finalize,
+	.preallocate = do_preallocate,
+	.unlink     = do_unlink,
 };
 
 #pragma clang diagnostic push
@@ -1067,6 +2029,17 @@ list_meta_end(void *opaque, void *fd)
 	return 0;
 }
 
+static int
+list_unlink(void *opaque, const char *filename)
+{
+	(void)opaque;
+	if (common.verbose)
+		printf("removed    %s\n", filename);
+	else
+		printf("%s (removed)\n", filename);
+	return 0;
+}
+
 static int
 list_close(void *opaque, void *fd)
 {
@@ -1150,4 +2123,5 @@ list_reader_funcs = {
 	.clone      = list_clone,
 	.snapshots  = list_snapshots,
 	.close      = list_close,
+	.unlink     = list_unlink,
 };
@@ -48,5 +48,6 @@ char*       RexReplace_apply   (RexReplace *self, const char *text);
 
 char* apply_xform_vec(const char *base, Vector *opt_xform);
 char *opt_apply_xform(const char *filename, VectorOf(RexReplace*) *opt_xform);
+void  xform_cleanup(void);
 
 #endif
@@ -16,8 +16,8 @@ FileMatch_destroy(FileMatch *self)
 	Regex_destroy(self->regex);
 }
 
-bool
-FileMatch_matches(FileMatch *self, const char *path, mode_t st_mode)
+static bool
+FileMatch_typeMatches(const FileMatch *self, mode_t st_mode)
 {
 	int fileflags = 0;
 	if      (S_ISREG(st_mode)) fileflags = FMATCH_F_REG;
@@ -28,11 +28,15 @@ FileMatch_matches(FileMatch *self, const char *path, mode_t st_mode)
 
 	int type = self->flags & FMATCH_MODE_MASK;
 
-	if (type &&
-	    (fileflags == type) != !(self->flags & FMATCH_NEGATIVE))
-	{
+	return !type ||
+	       (fileflags == type) == !(self->flags & FMATCH_NEGATIVE);
+}
+
+bool
+FileMatch_matches(FileMatch *self, const char *path, mode_t st_mode)
+{
+	if (!FileMatch_typeMatches(self, st_mode))
 		return 0;
-	}
 
 	if (self->glob) {
 		if ((self->flags & FMATCH_FIXED_TEXT))
@@ -49,3 +53,208 @@ FileMatch_matches(FileMatch *self, const char *path, mode_t st_mode)
 	return false;
 }
 
+
+enum {
+	FMREF_EXACT,
+	FMREF_PREFIX, // literal*
+	FMREF_SUFFIX, // *literal
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	uint32_t child;   // first child, 0 for none since the root is never one
+	uint32_t sibling;
+	uint32_t refs;    // 1-based index into the refs list, 0 for none
+	unsigned char ch;
+} FileMatchNode;
+
+typedef struct {
+	const FileMatch *match;
+	uint32_t next;    // 1-based like FileMatchNode.refs
+	int kind;
+} FileMatchRef;
+#pragma clang diagnostic pop
+
+void
+FileMatchSet_init(FileMatchSet *self)
+{
+	self->compiled = false;
+	Vector_init_type(&self->prefix, FileMatchNode);
+	Vector_init_type(&self->suffix, FileMatchNode);
+	Vector_init_type(&self->refs, FileMatchRef);
+	Vector_init_type(&self->generic, FileMatch*);
+}
+
+void
+FileMatchSet_destroy(FileMatchSet *self)
+{
+	Vector_destroy(&self->prefix);
+	Vector_destroy(&self->suffix);
+	Vector_destroy(&self->refs);
+	Vector_destroy(&self->generic);
+	self->compiled = false;
+}
+
+static bool
+is_literal(const char *str, size_t len)
+{
+	// Conservatively includes the extglob introducers.
+	for (size_t i = 0; i != len; ++i) {
+		if (strchr("*?[]\\+@!()", str[i]))
+			return false;
+	}
+	return true;
+}
+
+static FileMatchNode*
+trie_node(Vector *trie, uint32_t index)
+{
+	return Vector_at(trie, index);
+}
+
+static uint32_t
+trie_child(Vector *trie, uint32_t node, unsigned char ch)
+{
+	uint32_t it = trie_node(trie, node)->child;
+	while (it && trie_node(trie, it)->ch != ch)
+		it = trie_node(trie, it)->sibling;
+	return it;
+}
+
+static void
+trie_add(Vector *trie, Vector *refs,
+         const char *str, size_t len, bool reverse,
+         const FileMatch *match, int kind)
+{
+	uint32_t node = 0;
+	for (size_t i = 0; i != len; ++i) {
+		unsigned char ch = (unsigned char)str[reverse ? len-1-i : i];
+		uint32_t next = trie_child(trie, node, ch);
+		if (!next) {
+			FileMatchNode entry = {
+				.child = 0,
+				.sibling = trie_node(trie, node)->child,
+				.refs = 0,
+				.ch = ch,
+			};
+			next = (uint32_t)Vector_length(trie);
+			Vector_push(trie, &entry);
+			trie_node(trie, node)->child = next;
+		}
+		node = next;
+	}
+	FileMatchRef ref = {
+		.match = match,
+		.next = trie_node(trie, node)->refs,
+		.kind = kind,
+	};
+	Vector_push(refs, &ref);
+	trie_node(trie, node)->refs = (uint32_t)Vector_length(refs);
+}
+
+void
+FileMatchSet_compile(FileMatchSet *self, VectorOf(FileMatch) *matches)
+{
+	FileMatchSet_destroy(self);
+	FileMatchSet_init(self);
+	FileMatchNode root = { 0, 0, 0, 0 };
+	Vector_push(&self->prefix, &root);
+	Vector_push(&self->suffix, &root);
+
+	FileMatch *it;
+	Vector_foreach(matches, it) {
+		const char *glob = it->glob;
+		size_t len = glob ? strlen(glob) : 0;
+		if (!glob) {
+			Vector_push(&self->generic, &it);
+		} else if ((it->flags & FMATCH_FIXED_TEXT) ||
+		           is_literal(glob, len))
+		{
+			trie_add(&self->prefix, &self->refs, glob, len, false,
+			         it, FMREF_EXACT);
+		} else if (len && glob[len-1] == '*' &&
+		           is_literal(glob, len-1))
+		{
+			trie_add(&self->prefix, &self->refs, glob, len-1, false,
+			         it, FMREF_PREFIX);
+		} else if (glob[0] == '*' && is_literal(glob+1, len-1)) {
+			trie_add(&self->suffix, &self->refs, glob+1, len-1,
+			         true, it, FMREF_SUFFIX);
+		} else {
+			Vector_push(&self->generic, &it);
+		}
+	}
+	self->compiled = true;
+}
+
+// `rest` is the part of the path matched by the asterisk which may only
+// contain slashes if the pattern allows it.
+static bool
+FileMatchSet_refsMatch(FileMatchSet *self, uint32_t ref, bool at_end,
+                       bool rest_has_slash, mode_t st_mode)
+{
+	while (ref) {
+		const FileMatchRef *it = Vector_at(&self->refs, ref-1);
+		ref = it->next;
+		if (it->kind == FMREF_EXACT) {
+			if (!at_end)
+				continue;
+		} else if (rest_has_slash &&
+		           !(it->match->flags & FMATCH_WILDCARD_SLASH))
+		{
+			continue;
+		}
+		if (FileMatch_typeMatches(it->match, st_mode))
+			return true;
+	}
+	return false;
+}
+
+bool
+FileMatchSet_matches(FileMatchSet *self, const char *path, mode_t st_mode)
+{
+	const size_t len = strlen(path);
+	const char *first_slash = memchr(path, '/', len);
+	const char *last_slash = first_slash ? strrchr(path, '/') : NULL;
+
+	Vector *trie = &self->prefix;
+	uint32_t node = 0;
+	for (size_t i = 0; ; ++i) {
+		bool rest_has_slash = last_slash && last_slash >= path+i;
+		if (FileMatchSet_refsMatch(self, trie_node(trie, node)->refs,
+		                           i == len, rest_has_slash, st_mode))
+		{
+			return true;
+		}
+		if (i == len)
+			break;
+		node = trie_child(trie, node, (unsigned char)path[i]);
+		if (!node)
+			break;
+	}
+
+	trie = &self->suffix;
+	node = 0;
+	for (size_t i = 0; ; ++i) {
+		bool rest_has_slash = first_slash &&
+		                      first_slash < path+len-i;
+		if (FileMatchSet_refsMatch(self, trie_node(trie, node)->refs,
+		                           false, rest_has_slash, st_mode))
+		{
+			return true;
+		}
+		if (i == len)
+			break;
+		node = trie_child(trie, node, (unsigned char)path[len-1-i]);
+		if (!node)
+			break;
+	}
+
+	FileMatch **it;
+	Vector_foreach(&self->generic, it) {
+		if (FileMatch_matches(*it, path, st_mode))
+			return true;
+	}
+	return false;
+}
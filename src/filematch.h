@@ -27,4 +27,21 @@ typedef struct {
 void FileMatch_destroy(FileMatch*);
 bool FileMatch_matches(FileMatch*, const char *path, mode_t st_mode);
 
+// A set of FileMatch entries compiled for matching many paths: literal
+// patterns as well as simple `literal*` and `*literal` globs are looked up
+// in a prefix and a suffix trie, the rest is matched one by one.
+typedef struct {
+	bool compiled;
+	VectorOf(FileMatchNode) prefix;
+	VectorOf(FileMatchNode) suffix;
+	VectorOf(FileMatchRef) refs;
+	VectorOf(FileMatch*) generic;
+} FileMatchSet;
+
+void FileMatchSet_init(FileMatchSet*);
+void FileMatchSet_destroy(FileMatchSet*);
+// The entries must not be moved or changed while the set is in use.
+void FileMatchSet_compile(FileMatchSet*, VectorOf(FileMatch) *matches);
+bool FileMatchSet_matches(FileMatchSet*, const char *path, mode_t st_mode);
+
 #endif
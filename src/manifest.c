@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "../lib/fies.h"
+#include "../lib/vector.h"
+
+#include "util.h"
+#include "manifest.h"
+
+// File layout, all numbers little endian:
+//   manifest_header
+//   for each file: manifest_record, path, extent_count * manifest_extent
+//   a manifest_record with a path_length of zero
+
+static const char manifest_magic[8] = { 'F','I','E','S','M','A','N','1' };
+
+struct manifest_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct manifest_record {
+	uint16_t path_length;
+	uint16_t reserved;
+	uint32_t mode;
+	uint64_t ino;
+	uint64_t size;
+	int64_t  mtime_sec;
+	int64_t  ctime_sec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint64_t fingerprint;
+	uint32_t extent_count;
+	uint32_t reserved2;
+};
+
+struct manifest_extent {
+	uint64_t logical;
+	uint64_t physical;
+	uint64_t length;
+	uint64_t hash;
+};
+
+void
+ManifestEntry_destroy(void *p)
+{
+	ManifestEntry *self = p;
+	free(self->path);
+	free(self->extents);
+}
+
+// FNV-1a over the extent fields which change when data is rewritten.
+uint64_t
+Manifest_fingerprint(uint64_t hash, const struct FiesFile_Extent *ex)
+{
+	const uint64_t fields[4] = {
+		ex->logical, ex->physical, ex->length, ex->flags
+	};
+	const unsigned char *bytes = (const unsigned char*)fields;
+	for (size_t i = 0; i != sizeof(fields); ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Hash of a file's data. Data may be passed in pieces, all but the last of
+// which must be a multiple of 8 bytes long.
+uint64_t
+Manifest_contentHash(uint64_t hash, const void *data_, size_t length)
+{
+	const unsigned char *data = data_;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash ^= word * 0xbf58476d1ce4e5b9ULL;
+		hash = ((hash << 27) | (hash >> 37)) * 0x94d049bb133111ebULL;
+	}
+	for (; i != length; ++i) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash ^ (hash >> 31);
+}
+
+static int
+ManifestEntry_cmp(const void *pa, const void *pb)
+{
+	const ManifestEntry *a = pa;
+	const ManifestEntry *b = pb;
+	return strcmp(a->path, b->path);
+}
+
+static int
+Manifest_read(Manifest *self, FILE *in)
+{
+	struct manifest_header hdr;
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, manifest_magic, sizeof(manifest_magic)) != 0)
+	{
+		return -EINVAL;
+	}
+	if (u_le32(hdr.version) != 1)
+		return -ENOTSUP;
+
+	for (;;) {
+		struct manifest_record rec;
+		if (fread(&rec, sizeof(rec), 1, in) != 1)
+			return ferror(in) ? -EIO : -EINVAL; // truncated
+		size_t pathlen = u_le16(rec.path_length);
+		if (!pathlen)
+			break;
+
+		ManifestEntry entry = {
+			.mode = u_le32(rec.mode),
+			.ino = u_le64(rec.ino),
+			.size = u_le64(rec.size),
+			.mtime_sec = i_le64(rec.mtime_sec),
+			.mtime_nsec = u_le32(rec.mtime_nsec),
+			.ctime_sec = i_le64(rec.ctime_sec),
+			.ctime_nsec = u_le32(rec.ctime_nsec),
+			.fingerprint = u_le64(rec.fingerprint),
+			.extent_count = u_le32(rec.extent_count),
+		};
+		entry.path = malloc(pathlen + 1);
+		if (entry.extent_count)
+			entry.extents = malloc(entry.extent_count *
+			                       sizeof(*entry.extents));
+		if (!entry.path || (entry.extent_count && !entry.extents)) {
+			ManifestEntry_destroy(&entry);
+			return -ENOMEM;
+		}
+		if (fread(entry.path, pathlen, 1, in) != 1) {
+			ManifestEntry_destroy(&entry);
+			return -EINVAL;
+		}
+		entry.path[pathlen] = 0;
+		for (size_t i = 0; i != entry.extent_count; ++i) {
+			struct manifest_extent ex;
+			if (fread(&ex, sizeof(ex), 1, in) != 1) {
+				ManifestEntry_destroy(&entry);
+				return -EINVAL;
+			}
+			entry.extents[i].logical = u_le64(ex.logical);
+			entry.extents[i].physical = u_le64(ex.physical);
+			entry.extents[i].length = u_le64(ex.length);
+			entry.extents[i].hash = u_le64(ex.hash);
+		}
+		Vector_push(&self->entries, &entry);
+	}
+
+	qsort(Vector_data(&self->entries), Vector_length(&self->entries),
+	      sizeof(ManifestEntry), ManifestEntry_cmp);
+	return 0;
+}
+
+// Read the manifest from the previous run, if any, and start writing the new
+// one next to it. It replaces the old one in Manifest_commit().
+int
+Manifest_open(Manifest *self, const char *path)
+{
+	memset(self, 0, sizeof(*self));
+	self->dirfd = -1;
+	Vector_init_type(&self->entries, ManifestEntry);
+	Vector_set_destructor(&self->entries, ManifestEntry_destroy);
+
+	char *dir;
+	int rc = path_parts(path, &dir, &self->name, PATH_PARTS_RELATIVE_DOT);
+	if (rc < 0)
+		return rc;
+	if (!self->name) {
+		free(dir);
+		return -EISDIR;
+	}
+	self->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(dir);
+	if (self->dirfd < 0)
+		return -errno;
+	size_t len = strlen(self->name);
+	self->tmpname = malloc(len + sizeof(".tmp"));
+	if (!self->tmpname)
+		return -ENOMEM;
+	memcpy(self->tmpname, self->name, len);
+	memcpy(self->tmpname + len, ".tmp", sizeof(".tmp"));
+
+	int fd = openat(self->dirfd, self->name, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		FILE *in = fdopen(fd, "rb");
+		if (!in) {
+			rc = -errno;
+			close(fd);
+			return rc;
+		}
+		rc = Manifest_read(self, in);
+		fclose(in);
+		if (rc < 0)
+			return rc;
+	} else if (errno != ENOENT) {
+		return -errno;
+	}
+
+	fd = openat(self->dirfd, self->tmpname,
+	            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -errno;
+	self->out = fdopen(fd, "wb");
+	if (!self->out) {
+		rc = -errno;
+		close(fd);
+		unlinkat(self->dirfd, self->tmpname, 0);
+		return rc;
+	}
+	struct manifest_header hdr = {
+		.version = u_le32(1),
+		.reserved = 0
+	};
+	memcpy(hdr.magic, manifest_magic, sizeof(hdr.magic));
+	if (fwrite(&hdr, sizeof(hdr), 1, self->out) != 1)
+		return -errno;
+	return 0;
+}
+
+void
+Manifest_destroy(Manifest *self)
+{
+	if (self->out) {
+		fclose(self->out);
+		unlinkat(self->dirfd, self->tmpname, 0);
+	}
+	if (self->dirfd >= 0)
+		close(self->dirfd);
+	Vector_destroy(&self->entries);
+	free(self->name);
+	free(self->tmpname);
+	memset(self, 0, sizeof(*self));
+	self->dirfd = -1;
+}
+
+ManifestEntry*
+Manifest_find(Manifest *self, const char *path)
+{
+	size_t lo = 0, hi = Vector_length(&self->entries);
+	while (lo != hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		ManifestEntry *entry = Vector_at(&self->entries, mid);
+		int cmp = strcmp(entry->path, path);
+		if (!cmp)
+			return entry;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+bool
+Manifest_unchanged(const ManifestEntry *old, const ManifestEntry *cur)
+{
+	return old->mode == cur->mode &&
+	       old->ino == cur->ino &&
+	       old->size == cur->size &&
+	       old->mtime_sec == cur->mtime_sec &&
+	       old->mtime_nsec == cur->mtime_nsec &&
+	       old->ctime_sec == cur->ctime_sec &&
+	       old->ctime_nsec == cur->ctime_nsec &&
+	       old->fingerprint == cur->fingerprint;
+}
+
+int
+Manifest_add(Manifest *self, const ManifestEntry *entry)
+{
+	size_t pathlen = strlen(entry->path);
+	if (!pathlen || pathlen > 0xFFFF)
+		return -ENAMETOOLONG;
+	struct manifest_record rec = {
+		.path_length = u_le16((uint16_t)pathlen),
+		.mode = u_le32(entry->mode),
+		.ino = u_le64(entry->ino),
+		.size = u_le64(entry->size),
+		.mtime_sec = i_le64(entry->mtime_sec),
+		.ctime_sec = i_le64(entry->ctime_sec),
+		.mtime_nsec = u_le32(entry->mtime_nsec),
+		.ctime_nsec = u_le32(entry->ctime_nsec),
+		.fingerprint = u_le64(entry->fingerprint),
+		.extent_count = u_le32((uint32_t)entry->extent_count),
+	};
+	if (fwrite(&rec, sizeof(rec), 1, self->out) != 1 ||
+	    fwrite(entry->path, pathlen, 1, self->out) != 1)
+	{
+		return -errno;
+	}
+	for (size_t i = 0; i != entry->extent_count; ++i) {
+		struct manifest_extent ex = {
+			u_le64(entry->extents[i].logical),
+			u_le64(entry->extents[i].physical),
+			u_le64(entry->extents[i].length),
+			u_le64(entry->extents[i].hash)
+		};
+		if (fwrite(&ex, sizeof(ex), 1, self->out) != 1)
+			return -errno;
+	}
+	return 0;
+}
+
+int
+Manifest_commit(Manifest *self)
+{
+	struct manifest_record end;
+	memset(&end, 0, sizeof(end));
+	FILE *out = self->out;
+	self->out = NULL;
+	if (fwrite(&end, sizeof(end), 1, out) != 1 || fflush(out) != 0 ||
+	    fsync(fileno(out)) != 0)
+	{
+		int rc = -errno;
+		fclose(out);
+		unlinkat(self->dirfd, self->tmpname, 0);
+		return rc;
+	}
+	if (fclose(out) != 0 ||
+	    renameat(self->dirfd, self->tmpname, self->dirfd, self->name) != 0)
+	{
+		int rc = -errno;
+		unlinkat(self->dirfd, self->tmpname, 0);
+		return rc;
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef FIES_SRC_MANIFEST_H
+#define FIES_SRC_MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../lib/fies.h"
+#include "../lib/vector.h"
+
+// The state of a tree as written by the previous `fies c --manifest` run.
+// Files whose entry still matches are left out of the next stream.
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	fies_pos logical;
+	fies_pos physical;
+	fies_sz  length;
+	uint64_t hash; // of the data, see Manifest_contentHash()
+} ManifestExtent;
+
+typedef struct {
+	char *path;        // name in the stream
+	uint32_t mode;     // FIES_M_*
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	int64_t ctime_sec;
+	uint32_t ctime_nsec;
+	uint64_t fingerprint; // hash of the full extent map
+	// Shared extents of the file. Once the file changed, the file system
+	// may have reused their blocks, so the next run only clones from an
+	// extent if the file still has one at the same address with the same
+	// content hash.
+	size_t extent_count;
+	ManifestExtent *extents;
+	bool seen;
+} ManifestEntry;
+
+typedef struct {
+	VectorOf(ManifestEntry) entries; // sorted by path
+	// Kept relative to the directory so that -C and --chroot don't matter.
+	int dirfd;
+	char *name;
+	char *tmpname;
+	FILE *out;
+} Manifest;
+#pragma clang diagnostic pop
+
+#define MANIFEST_FINGERPRINT_INIT 0xcbf29ce484222325ULL
+
+void ManifestEntry_destroy(void*);
+uint64_t Manifest_fingerprint(uint64_t hash, const struct FiesFile_Extent*);
+uint64_t Manifest_contentHash(uint64_t hash, const void *data, size_t length);
+
+int  Manifest_open(Manifest*, const char *path);
+void Manifest_destroy(Manifest*);
+ManifestEntry* Manifest_find(Manifest*, const char *path);
+bool Manifest_unchanged(const ManifestEntry *old, const ManifestEntry *cur);
+int  Manifest_add(Manifest*, const ManifestEntry*);
+int  Manifest_commit(Manifest*);
+
+#endif
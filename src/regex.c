@@ -255,7 +255,15 @@ struct RexReplace {
 	Regex *regex;
 	size_t  portion_length;
 	VectorOf(REPortion*) portions;
+	// A string every match has to contain, to skip regexec() quickly.
+	char   *literal;
+	size_t  literal_len;
 };
+
+typedef struct {
+	char *data;
+	size_t size;
+} XformBuffer;
 #pragma clang diagnostic pop
 
 static void
@@ -285,6 +293,7 @@ RexReplace_destroy(RexReplace *self)
 {
 	Regex_destroy(self->regex);
 	Vector_destroy(&self->portions);
+	free(self->literal);
 	free(self);
 }
 
@@ -300,6 +309,113 @@ my_isdigit(int c) // because isdigit(3) is locale dependent
 	return ((unsigned)(c-'0')) <= 9;
 }
 
+static inline bool
+my_isalnum(int c)
+{
+	return my_isdigit(c) ||
+	       ((unsigned)(c-'a')) < 26 ||
+	       ((unsigned)(c-'A')) < 26;
+}
+
+// Find the longest run of literal characters outside of groups and bracket
+// expressions which every match of an extended regex must contain. Patterns
+// with alternations are skipped entirely to keep this simple.
+static char*
+regex_required_literal(const char *pattern, size_t *out_len)
+{
+	if (strchr(pattern, '|'))
+		return NULL;
+	size_t plen = strlen(pattern);
+	char *run = malloc(plen+1);
+	char *best = malloc(plen+1);
+	if (!run || !best) {
+		free(run);
+		free(best);
+		return NULL;
+	}
+	size_t runlen = 0, bestlen = 0;
+	int depth = 0;
+	for (const char *p = pattern; *p; ++p) {
+		bool literal = false;
+		char ch = *p;
+		bool end_run = true;
+		switch (ch) {
+		case '\\':
+			if (!p[1] || my_isalnum(p[1])) {
+				// back references and GNU extensions
+				if (p[1])
+					++p;
+				break;
+			}
+			ch = *++p;
+			literal = true;
+			break;
+		case '*': case '?': case '{':
+			// the previous character is optional
+			if (runlen)
+				--runlen;
+			if (ch == '{') {
+				while (p[1] && *p != '}')
+					++p;
+			}
+			break;
+		case '+':
+			break;
+		case '[':
+			// skip the bracket expression, ']' may come first
+			++p;
+			if (*p == '^')
+				++p;
+			if (*p == ']')
+				++p;
+			while (*p && *p != ']') {
+				// [:class:], [=equiv=] and [.coll.] contain
+				// their own ']'
+				if (p[0] == '[' && p[1] &&
+				    strchr(":=.", p[1]))
+				{
+					const char end[] = { p[1], ']', 0 };
+					const char *close = strstr(p+2, end);
+					if (close) {
+						p = close + 2;
+						continue;
+					}
+				}
+				++p;
+			}
+			if (!*p)
+				--p;
+			break;
+		case '(': ++depth; break;
+		case ')': --depth; break;
+		case '.': case '^': case '$':
+			break;
+		default:
+			literal = true;
+			break;
+		}
+		if (literal && depth == 0) {
+			run[runlen++] = ch;
+			end_run = false;
+		}
+		if (!end_run && p[1])
+			continue;
+		if (runlen > bestlen) {
+			memcpy(best, run, runlen);
+			bestlen = runlen;
+		}
+		runlen = 0;
+	}
+	free(run);
+	if (!bestlen) {
+		free(best);
+		return NULL;
+	}
+	best[bestlen] = 0;
+	*out_len = bestlen;
+	return best;
+}
+
 
 RexReplace*
 RexReplace_new(const char *in_pattern, char **out_errstr)
@@ -384,9 +500,11 @@ RexReplace_new(const char *in_pattern, char **out_errstr)
 	free(buffer);
 	buffer = NULL;
 
-	int regflags = REG_EXTENDED;
+	// Regex_new() takes REGEX_F_* flags and always compiles extended
+	// regular expressions.
+	int reflags = 0;
 	while (*in_pattern && *in_pattern == 'i') {
-		regflags |= REG_ICASE;
+		reflags |= REGEX_F_ICASE;
 		++in_pattern;
 	}
 
@@ -395,12 +513,15 @@ RexReplace_new(const char *in_pattern, char **out_errstr)
 		goto out;
 	}
 
-	self->regex = Regex_new(pattern, regflags, out_errstr);
+	self->regex = Regex_new(pattern, reflags, out_errstr);
 	if (!self->regex) {
 		err = errno;
 		errstr = NULL;
 		goto out;
 	}
+	if (!(reflags & REGEX_F_ICASE))
+		self->literal = regex_required_literal(pattern,
+		                                       &self->literal_len);
 
 	free(pattern);
 	return self;
@@ -422,83 +543,135 @@ out:
 	return NULL;
 }
 
-char*
-RexReplace_apply(RexReplace *self, const char *text)
+static bool
+XformBuffer_reserve(XformBuffer *self, size_t size)
 {
-	size_t mcount;
-	RegMatch *m = Regex_exec(self->regex, text, 0, &mcount);
-	if (!m)
-		return strdup(text);
+	if (size <= self->size)
+		return true;
+	char *data = realloc(self->data, size);
+	if (!data)
+		return false;
+	self->data = data;
+	self->size = size;
+	return true;
+}
 
-	size_t full_len = strlen(text);
-	size_t length = full_len;
-	if (m[0].eo < m[0].so) {
-		free(m);
-		errno = EFAULT;
-		return NULL;
+// Replace the first match in `text` and write the result into `out`.
+// Returns 1 if there was a match, 0 if not, or a negative error.
+static int
+RexReplace_applyTo(RexReplace *self, const char *text, size_t full_len,
+                   XformBuffer *out)
+{
+	if (self->literal &&
+	    !memmem(text, full_len, self->literal, self->literal_len))
+	{
+		return 0;
 	}
-	size_t cut = (size_t)(m[0].eo - m[0].so);
-	length = cut < length ? length-cut : 0;
+
+	regmatch_t m[128];
+	size_t mcount = self->regex->regex.re_nsub + 1;
+	if (mcount > sizeof(m)/sizeof(m[0]))
+		mcount = sizeof(m)/sizeof(m[0]);
+	// be safe, don't trust regexec fills them all in all impls
+	memset(m, -1, mcount * sizeof(m[0]));
+	if (regexec(&self->regex->regex, text, mcount, m, 0) != 0)
+		return 0;
+	if (m[0].rm_so < 0 || m[0].rm_eo < m[0].rm_so)
+		return -EFAULT;
+
+	size_t cut = (size_t)(m[0].rm_eo - m[0].rm_so);
+	size_t length = cut < full_len ? full_len-cut : 0;
 	length += self->portion_length;
 	REPortion **pit;
 	Vector_foreach(&self->portions, pit) {
 		REPortion *it = *pit;
 		if (it->sub < 0 || (size_t)it->sub >= mcount)
 			continue;
-		const RegMatch *grp = &m[it->sub];
-		if (grp->eo <= grp->so)
+		const regmatch_t *grp = &m[it->sub];
+		if (grp->rm_so < 0 || grp->rm_eo <= grp->rm_so)
 			continue;
-		size_t grplen = (size_t)(grp->eo - grp->so);
-		length += grplen;
-	}
-	char *out = malloc(length+1);
-	if (!out) {
-		int saved_errno = errno;
-		free(m);
-		errno = saved_errno;
-		return NULL;
+		length += (size_t)(grp->rm_eo - grp->rm_so);
 	}
+	if (!XformBuffer_reserve(out, length+1))
+		return -errno;
 
-	size_t at = (size_t)m[0].so;
-	memcpy(out, text, at);
+	char *dst = out->data;
+	size_t at = (size_t)m[0].rm_so;
+	memcpy(dst, text, at);
 	Vector_foreach(&self->portions, pit) {
 		REPortion *it = *pit;
-		memcpy(&out[at], it->head, it->len);
+		memcpy(&dst[at], it->head, it->len);
 		at += it->len;
 
 		if (it->sub < 0 || (size_t)it->sub >= mcount)
 			continue;
-		const RegMatch *grp = &m[it->sub];
-		if (grp->eo <= grp->so)
+		const regmatch_t *grp = &m[it->sub];
+		if (grp->rm_so < 0 || grp->rm_eo <= grp->rm_so)
 			continue;
-		size_t grplen = (size_t)(grp->eo - grp->so);
-		memcpy(&out[at], &text[grp->so], grplen);
+		size_t grplen = (size_t)(grp->rm_eo - grp->rm_so);
+		memcpy(&dst[at], &text[grp->rm_so], grplen);
 		at += grplen;
 	}
-	size_t tail = full_len - (size_t)m[0].eo;
-	memcpy(&out[at], &text[m[0].eo], tail);
+	size_t tail = full_len - (size_t)m[0].rm_eo;
+	memcpy(&dst[at], &text[m[0].rm_eo], tail);
 	at += tail;
-	out[at] = 0;
-	free(m);
-	return out;
+	dst[at] = 0;
+	return 1;
 }
 
+char*
+RexReplace_apply(RexReplace *self, const char *text)
+{
+	XformBuffer out = { NULL, 0 };
+	int rc = RexReplace_applyTo(self, text, strlen(text), &out);
+	if (rc < 0) {
+		free(out.data);
+		errno = -rc;
+		return NULL;
+	}
+	if (!rc)
+		return strdup(text);
+	return out.data;
+}
+
+// The transforms run for every file, so intermediate results go into two
+// buffers which are reused between calls.
+static XformBuffer xform_buffers[2];
+
 static char*
 do_apply_xform_vec(char *base, Vector *opt_xform)
 {
+	const char *text = base;
+	size_t len = strlen(base);
+	size_t next = 0;
 	RexReplace **it;
 	Vector_foreach(opt_xform, it) {
-		char *newbase = RexReplace_apply(*it, base);
-		if (!newbase) {
-			int err = errno;
+		XformBuffer *out = &xform_buffers[next];
+		int rc = RexReplace_applyTo(*it, text, len, out);
+		if (rc < 0) {
 			free(base);
-			errno = err;
+			errno = -rc;
 			return NULL;
 		}
+		if (!rc)
+			continue;
+		text = out->data;
+		len = strlen(text);
+		next ^= 1;
+	}
+	if (text == base)
+		return base;
+
+	char *result = malloc(len+1);
+	if (!result) {
+		int err = errno;
 		free(base);
-		base = newbase;
+		errno = err;
+		return NULL;
 	}
-	return base;
+	memcpy(result, text, len+1);
+	free(base);
+	return result;
 }
 
 char*
@@ -542,3 +715,14 @@ opt_apply_xform(const char *filename, Vector *opt_xform)
 	errno = err;
 	return out;
 }
+
+// Free the buffers kept between transforms.
+void
+xform_cleanup(void)
+{
+	for (size_t i = 0; i != 2; ++i) {
+		free(xform_buffers[i].data);
+		xform_buffers[i].data = NULL;
+		xform_buffers[i].size = 0;
+	}
+}
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <regex.h>
 
@@ -54,6 +55,18 @@ str_to_ulong(const char *str, unsigned long *numptr)
 	return endp && !*endp && !errno;
 }
 
+bool
+str_to_size(const char *str, unsigned long long *sizep)
+{
+	char *endp = NULL;
+	errno = 0;
+	*sizep = strtoull(str, &endp, 0);
+	if (errno || !endp || endp == str)
+		return false;
+	int skip = multiply_size(sizep, endp);
+	return skip >= 0 && !endp[skip];
+}
+
 bool
 str_to_bool(const char *str, bool default_value)
 {
@@ -449,3 +462,127 @@ crc32c(const void *data_, size_t length)
 		crc = (crc >> 8) ^ table[(data[i] ^ crc)&0xFF];
 	return crc;
 }
+
+bool
+buffer_is_zero(const void *data_, size_t length)
+{
+	typedef uint64_t FIES_ALIAS_U64 __attribute__((__may_alias__));
+	const unsigned char *data = data_;
+	while (length && ((uintptr_t)data & (sizeof(uint64_t)-1))) {
+		if (*data++)
+			return false;
+		--length;
+	}
+	// OR-ing whole cache lines together lets the compiler vectorize this.
+	const FIES_ALIAS_U64 *words = (const void*)data;
+	for (; length >= 64; length -= 64, words += 8) {
+		if (words[0] | words[1] | words[2] | words[3] |
+		    words[4] | words[5] | words[6] | words[7])
+		{
+			return false;
+		}
+	}
+	data = (const void*)words;
+	while (length--) {
+		if (*data++)
+			return false;
+	}
+	return true;
+}
+
+// Get the length of the run of either all-zero or non-zero blocks at the
+// start of a buffer written to the file position pos. Only complete, aligned
+// blocks can be zero, partial blocks at either end count as data.
+size_t
+zero_run_length(const void *data_, size_t length, uint64_t pos,
+                size_t blocksize, bool *zero)
+{
+	const char *data = data_;
+	size_t head = (size_t)(pos % blocksize);
+	size_t at = head ? blocksize - head : blocksize;
+	if (at > length)
+		at = length;
+	bool is_zero = at == blocksize && buffer_is_zero(data, blocksize);
+	while (length - at >= blocksize &&
+	       buffer_is_zero(data + at, blocksize) == is_zero)
+	{
+		at += blocksize;
+	}
+	if (!is_zero && length - at < blocksize)
+		at = length;
+	*zero = is_zero;
+	return at;
+}
+
+void
+writeback_init(Writeback *self, int fd, unsigned long long window)
+{
+	self->fd = fd;
+	self->window = (off_t)window;
+	self->start = self->end = self->dirty = 0;
+	self->prev = self->prev_end = 0;
+}
+
+// Wait for a previously submitted range and drop it from the page cache.
+static void
+writeback_drop(Writeback *self, off_t start, off_t end)
+{
+	if (end <= start)
+		return;
+	(void)sync_file_range(self->fd, start, end - start,
+	                      SYNC_FILE_RANGE_WAIT_BEFORE |
+	                      SYNC_FILE_RANGE_WRITE |
+	                      SYNC_FILE_RANGE_WAIT_AFTER);
+	(void)posix_fadvise(self->fd, start, end - start,
+	                    POSIX_FADV_DONTNEED);
+}
+
+// Start writeback of the current range, then retire the previous one, which
+// by now should mostly be on disk already.
+static void
+writeback_submit(Writeback *self)
+{
+	if (self->end > self->start &&
+	    sync_file_range(self->fd, self->start, self->end - self->start,
+	                    SYNC_FILE_RANGE_WRITE) != 0)
+	{
+		if (errno == ENOSYS || errno == ESPIPE || errno == EINVAL) {
+			// Not supported on this file, stop trying.
+			self->window = 0;
+			return;
+		}
+	}
+	writeback_drop(self, self->prev, self->prev_end);
+	self->prev = self->start;
+	self->prev_end = self->end;
+	self->start = self->end;
+	self->dirty = 0;
+}
+
+void
+writeback_wrote(Writeback *self, off_t pos, size_t length)
+{
+	if (!self->window || self->fd < 0 || !length)
+		return;
+	// Seeks only widen the range, so that scattered writes don't wait
+	// for the previous range every time.
+	const off_t end = pos + (off_t)length;
+	if (!self->dirty || pos < self->start)
+		self->start = pos;
+	if (!self->dirty || end > self->end)
+		self->end = end;
+	self->dirty += (off_t)length;
+	if (self->dirty >= self->window)
+		writeback_submit(self);
+}
+
+void
+writeback_finish(Writeback *self)
+{
+	if (!self->window || self->fd < 0)
+		return;
+	writeback_submit(self);
+	writeback_drop(self, self->prev, self->prev_end);
+	self->start = self->end = self->dirty = 0;
+	self->prev = self->prev_end = 0;
+}
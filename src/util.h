@@ -2,6 +2,7 @@
 #define FIES_SRC_CLI_UTIL_H
 
 #include <stdarg.h>
+#include <sys/types.h>
 
 #include "../lib/util.h"
 #include "../lib/vector.h"
@@ -12,6 +13,7 @@
 bool parse_long(const char **str, long *numptr);
 bool str_to_long(const char *str, long *numptr);
 bool str_to_ulong(const char *str, unsigned long *numptr);
+bool str_to_size(const char *str, unsigned long long *sizep);
 bool str_to_bool(const char *str, bool default_value);
 bool arg_stol(const char *str, long *nump, const char *err, const char *arg0);
 
@@ -34,4 +36,28 @@ int multiply_size(unsigned long long *size, const char *suffix);
 
 uint32_t crc32c(const void *data, size_t length);
 
+bool buffer_is_zero(const void *data, size_t length);
+size_t zero_run_length(const void *data, size_t length, uint64_t pos,
+                       size_t blocksize, bool *zero);
+
+// Bounded dirty page writeback: once a window worth of data has been written
+// writeback of the range spanning it is started, and the range before it is
+// waited for and dropped from the page cache. A window of 0 disables this.
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+typedef struct {
+	int fd;
+	off_t window;
+	off_t start;
+	off_t end;
+	off_t dirty; // bytes written between start and end
+	off_t prev;
+	off_t prev_end;
+} Writeback;
+#pragma clang diagnostic pop
+
+void writeback_init(Writeback*, int fd, unsigned long long window);
+void writeback_wrote(Writeback*, off_t pos, size_t length);
+void writeback_finish(Writeback*);
+
 #endif
@@ -172,6 +172,24 @@ vf_finalize(void *opaque)
 	return self->finalize();
 }
 
+static int
+vf_preallocate(void *opaque,
+               void *fh,
+               fies_sz data_size,
+               const struct fies_alloc_range *ranges,
+               size_t count)
+{
+	auto self = reinter<Reader*>(opaque);
+	return self->preallocate(fh, data_size, ranges, count);
+}
+
+static int
+vf_unlink(void *opaque, const char *filename)
+{
+	auto self = reinter<Reader*>(opaque);
+	return self->unlink(filename);
+}
+
 const FiesReader_Funcs
 cppreader_funcs = {
 	vf_read,
@@ -194,6 +212,8 @@ cppreader_funcs = {
 	vf_close,
 	vf_finalize,
 	nullptr, // dbg_packet
+	vf_preallocate,
+	vf_unlink,
 };
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -361,3 +381,18 @@ Reader::finalize()
 {
 }
 
+int
+Reader::unlink(const char *filename)
+{
+	return -ENOTSUP;
+}
+
+int
+Reader::preallocate(void *fh,
+                    fies_sz data_size,
+                    const struct fies_alloc_range *ranges,
+                    size_t count)
+{
+	return -meta_err_;
+}
+
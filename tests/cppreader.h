@@ -64,6 +64,11 @@ struct Reader {
 	                            const char **snapshots,
 	                            size_t count);
 	virtual void     finalize  ();
+	virtual int      unlink    (const char *filename);
+	virtual int      preallocate(void *fh,
+	                             fies_sz data_size,
+	                             const struct fies_alloc_range *ranges,
+	                             size_t count);
 
 	virtual int gotFlags(uint32_t flags);
 
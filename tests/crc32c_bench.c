@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../libfies-dmthin/crc.h"
+
+// Checks the CRC32C implementations of libfies-dmthin against the software
+// one and compares their speed on metadata sized blocks and large buffers.
+
+#define BUFFER_SIZE (1024*1024)
+#define NODE_SIZE   4096
+#define DATA_BYTES  (256*1024*1024)
+
+static const struct {
+	enum crc32c_impl impl;
+	const char *name;
+} implementations[] = {
+	{ CRC32C_SOFTWARE, "software" },
+	{ CRC32C_SSE42,    "sse4.2" },
+	{ CRC32C_PCLMUL,   "pclmul" },
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double
+bench(crc32c_func *func, const unsigned char *buffer, size_t size)
+{
+	size_t rounds = DATA_BYTES / size;
+	uint32_t crc = 0xFFFFFFFFU;
+	double t0 = now();
+	for (size_t i = 0; i != rounds; ++i)
+		crc = func(crc, buffer + (i % 8) * 4, size - 32);
+	double t1 = now();
+	if (!crc)
+		printf("(crc 0)\n"); // keep the result alive
+	return (double)(rounds * (size - 32)) / (t1 - t0) / (1024*1024);
+}
+
+// With --check only the results are compared, which is what the test suite
+// runs.
+int
+main(int argc, char **argv)
+{
+	const bool timed = !(argc > 1 && !strcmp(argv[1], "--check"));
+
+	unsigned char *buffer = malloc(BUFFER_SIZE);
+	if (!buffer)
+		return 1;
+	srand(1);
+	for (size_t i = 0; i != BUFFER_SIZE; ++i)
+		buffer[i] = (unsigned char)rand();
+
+	// The check value of the standard CRC32C.
+	crc32c_func *software = crc32c_implementation(CRC32C_SOFTWARE);
+	if ((software(0xFFFFFFFFU, "123456789", 9) ^ 0xFFFFFFFFU)
+	    != 0xE3069283U)
+	{
+		fprintf(stderr, "software: wrong check value\n");
+		return 1;
+	}
+
+	unsigned long mismatches = 0;
+	const size_t count = sizeof(implementations)/sizeof(*implementations);
+	for (size_t n = 0; n != count; ++n) {
+		crc32c_func *func =
+			crc32c_implementation(implementations[n].impl);
+		if (!func) {
+			printf("%-8s  not supported\n",
+			       implementations[n].name);
+			continue;
+		}
+		// Lengths and offsets around the stride and alignment limits.
+		for (size_t length = 0; length < 3*8192*2 + 64;
+		     length += length < 1024 ? 1 : 61)
+		{
+			size_t offset = length % 13;
+			if (func(0xFFFFFFFFU, buffer + offset, length) !=
+			    software(0xFFFFFFFFU, buffer + offset, length))
+			{
+				if (!mismatches++)
+					fprintf(stderr, "%s: mismatch at %zu\n",
+					        implementations[n].name,
+					        length);
+			}
+		}
+		if (func(0xFFFFFFFFU, buffer, BUFFER_SIZE) !=
+		    software(0xFFFFFFFFU, buffer, BUFFER_SIZE))
+		{
+			++mismatches;
+		}
+		if (!timed) {
+			printf("%-8s  checked\n", implementations[n].name);
+			continue;
+		}
+
+		double node = bench(func, buffer, NODE_SIZE);
+		double large = bench(func, buffer, BUFFER_SIZE);
+		printf("%-8s  %8.0f MiB/s (4k blocks) %8.0f MiB/s (1M)\n",
+		       implementations[n].name, node, large);
+	}
+
+	free(buffer);
+	return mismatches ? 1 : 0;
+}
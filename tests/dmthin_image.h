@@ -0,0 +1,112 @@
+#ifndef FIES_TESTS_DMTHIN_IMAGE_H
+#define FIES_TESTS_DMTHIN_IMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../lib/util.h"
+#include "../include/fies.h"
+#include "../libfies-dmthin/dmthin.h"
+#include "../libfies-dmthin/crc.h"
+
+// Builds dm-thin metadata blocks in memory for the libfies-dmthin tests.
+
+#define DMTHIN_BLOCK_SIZE 4096
+#define DMTHIN_DATA_BLOCK (128*512)
+
+static inline void
+dmthin_checksum(void *block, uint32_t xor)
+{
+	uint8_t *data = block;
+	uint32_t csum = crc32c(data + 4, DMTHIN_BLOCK_SIZE - 4) ^ xor;
+	csum = FIES_LE(csum);
+	memcpy(data, &csum, sizeof(csum));
+}
+
+static inline void
+dmthin_node(void *block, size_t blocknr, uint32_t flags,
+            const uint64_t *keys, const void *values,
+            uint32_t nr_entries, uint32_t value_size)
+{
+	btree_node *node = block;
+	const uint32_t max_entries =
+		(uint32_t)((DMTHIN_BLOCK_SIZE - sizeof(*node))
+		           / (sizeof(uint64_t) + value_size));
+	node->flags = FIES_LE(flags);
+	node->blocknr = FIES_LE((uint64_t)blocknr);
+	node->nr_entries = FIES_LE(nr_entries);
+	node->max_entries = FIES_LE(max_entries);
+	node->value_size = FIES_LE(value_size);
+	for (uint32_t i = 0; i != nr_entries; ++i)
+		node->keys[i] = FIES_LE(keys[i]);
+	memcpy(node->keys + max_entries, values,
+	       (size_t)nr_entries * value_size);
+	dmthin_checksum(block, BTREE_CSUM_XOR);
+}
+
+// A node whose values are block numbers: internal nodes, and the leaves of
+// the top level tree which point to the devices' trees.
+static inline void
+dmthin_blockNode(void *block, size_t blocknr, uint32_t flags,
+                 const uint64_t *keys, const uint64_t *blocks,
+                 uint32_t nr_entries)
+{
+	uint64_t disk[16];
+	for (uint32_t i = 0; i != nr_entries; ++i)
+		disk[i] = FIES_LE(blocks[i]);
+	dmthin_node(block, blocknr, flags, keys, disk, nr_entries,
+	            sizeof(*disk));
+}
+
+// A leaf of a device's tree, mapping to data blocks with time stamp 0.
+static inline void
+dmthin_dataLeaf(void *block, size_t blocknr,
+                const uint64_t *keys, const uint64_t *data,
+                uint32_t nr_entries)
+{
+	uint64_t disk[16];
+	for (uint32_t i = 0; i != nr_entries; ++i)
+		disk[i] = FIES_LE(data[i] << 24);
+	dmthin_node(block, blocknr, LEAF_NODE, keys, disk, nr_entries,
+	            sizeof(*disk));
+}
+
+// 2 bits per block, high bit first.
+static inline void
+dmthin_bitmap(void *block, size_t blocknr,
+              const uint8_t *counts, size_t nr_counts)
+{
+	struct thin_bitmap_header *header = block;
+	header->blocknr = FIES_LE((uint64_t)blocknr);
+	uint8_t *bits = (uint8_t*)(header + 1);
+	for (size_t i = 0; i != nr_counts; ++i) {
+		uint64_t word;
+		memcpy(&word, bits + i / 32 * sizeof(word), sizeof(word));
+		word = FIES_LE(word);
+		const unsigned int bit = (unsigned int)(i % 32) * 2;
+		word |= (uint64_t)(counts[i] >> 1) << bit;
+		word |= (uint64_t)(counts[i] & 1) << (bit + 1);
+		word = FIES_LE(word);
+		memcpy(bits + i / 32 * sizeof(word), &word, sizeof(word));
+	}
+	dmthin_checksum(block, THIN_BITMAP_CSUM_XOR);
+}
+
+// Without space maps, fill them in before dmthin_checksum().
+static inline void
+dmthin_super(void *block, size_t blocknr, uint64_t mapping_root)
+{
+	struct thin_superblock *super = block;
+	super->blocknr = FIES_LE((uint64_t)blocknr);
+	super->magic = FIES_LE((uint64_t)THIN_SUPER_MAGIC);
+	super->version = FIES_LE((uint32_t)THIN_VERSION);
+	super->data_mapping_root = FIES_LE(mapping_root);
+	super->data_block_size =
+		FIES_LE((uint32_t)(DMTHIN_DATA_BLOCK / 512));
+	super->metadata_block_size =
+		FIES_LE((uint32_t)(DMTHIN_BLOCK_SIZE / 512));
+	dmthin_checksum(block, THIN_SUPER_CSUM_XOR);
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../lib/util.h"
+#include "../lib/vector.h"
+#include "../include/fies.h"
+#include "../include/fies/dmthin.h"
+#include "../src/fies-dmthin/dmthin_plan.h"
+#include "dmthin_image.h"
+
+// Plans the export of several devices with FiesDMThin_mapDevices() and the
+// --single-pass planner: subtrees shared between devices, data blocks shared
+// via different leaves, a later device larger than the one it shares its
+// last subtree with, and a device listed twice.
+
+#define BLOCK_COUNT 7
+#define DATA_BLOCK  DMTHIN_DATA_BLOCK
+
+enum {
+	SUPER = 0,
+	TOP_NODE,
+	ROOT_1,    // device 1: LEAF_1A, LEAF_1B
+	LEAF_1A,   // blocks 0-3 => data 100-103
+	LEAF_1B,   // blocks 8-9 => data 108-109
+	ROOT_2,    // device 2: LEAF_2A, LEAF_1B
+	LEAF_2A,   // blocks 0-2 => data 200, 101, 102
+};
+
+#define EQZ(X, Y) do { \
+	++count; \
+	size_t x = (X); \
+	size_t y = (Y); \
+	if (x != y) { \
+		++failed; \
+		fprintf(stderr, "Assertion (%s) failed: %zu != %zu\n", \
+		        #X " == " #Y, x, y); \
+	} \
+} while (0)
+
+static size_t count = 0, failed = 0;
+
+static uint8_t image[BLOCK_COUNT][DMTHIN_BLOCK_SIZE];
+
+static const void*
+getBlock(void *opaque, size_t block_number)
+{
+	(void)opaque;
+	return block_number < BLOCK_COUNT ? image[block_number] : NULL;
+}
+
+static void
+putBlock(void *opaque, const void *block)
+{
+	(void)opaque;
+	(void)block;
+}
+
+static void
+makeImage(void)
+{
+	dmthin_super(image[SUPER], SUPER, TOP_NODE);
+
+	const uint64_t devices[2] = { 1, 2 };
+	const uint64_t roots[2] = { ROOT_1, ROOT_2 };
+	dmthin_blockNode(image[TOP_NODE], TOP_NODE, LEAF_NODE,
+	                 devices, roots, 2);
+
+	const uint64_t root_keys[2] = { 0, 8 };
+	const uint64_t root_1[2] = { LEAF_1A, LEAF_1B };
+	dmthin_blockNode(image[ROOT_1], ROOT_1, INTERNAL_NODE,
+	                 root_keys, root_1, 2);
+	const uint64_t keys_1a[4] = { 0, 1, 2, 3 };
+	const uint64_t data_1a[4] = { 100, 101, 102, 103 };
+	dmthin_dataLeaf(image[LEAF_1A], LEAF_1A, keys_1a, data_1a, 4);
+	const uint64_t keys_1b[2] = { 8, 9 };
+	const uint64_t data_1b[2] = { 108, 109 };
+	dmthin_dataLeaf(image[LEAF_1B], LEAF_1B, keys_1b, data_1b, 2);
+
+	const uint64_t root_2[2] = { LEAF_2A, LEAF_1B };
+	dmthin_blockNode(image[ROOT_2], ROOT_2, INTERNAL_NODE,
+	                 root_keys, root_2, 2);
+	const uint64_t keys_2a[3] = { 0, 1, 2 };
+	const uint64_t data_2a[3] = { 200, 101, 102 };
+	dmthin_dataLeaf(image[LEAF_2A], LEAF_2A, keys_2a, data_2a, 3);
+}
+
+// Compare a planned extent, offsets and lengths in data blocks.
+static void
+checkExtent(Vector *plan, size_t index, size_t at, uint32_t flags,
+            uint64_t logical, uint64_t length, uint64_t from)
+{
+	ThinMetaPlanned *vol = Vector_at(plan, index);
+	EQZ(at < Vector_length(&vol->extents), true);
+	if (at >= Vector_length(&vol->extents))
+		return;
+	const struct FiesFile_Extent *ex = Vector_at(&vol->extents, at);
+	EQZ(ex->flags, flags);
+	EQZ(ex->logical, logical * DATA_BLOCK);
+	EQZ(ex->length, length * DATA_BLOCK);
+	if (flags & FIES_FL_COPY) {
+		EQZ(ex->source.file, 0);
+		EQZ(ex->source.offset, from * DATA_BLOCK);
+	} else {
+		EQZ(ex->physical, from * DATA_BLOCK);
+	}
+}
+
+int
+main(void)
+{
+	makeImage();
+	struct FiesDMThin *dmthin =
+		FiesDMThin_new(NULL, sizeof(image), DMTHIN_BLOCK_SIZE,
+		               getBlock, putBlock);
+	if (!dmthin) {
+		perror("FiesDMThin_new");
+		return 1;
+	}
+
+	// Device 2 grew past the end of device 1, which is listed twice.
+	VectorOf(ThinMetaPlanned) plan;
+	ThinMetaPlan_init(&plan);
+	ThinMetaPlan_queue(&plan, 1, 12 * DATA_BLOCK);
+	ThinMetaPlan_queue(&plan, 2, 16 * DATA_BLOCK);
+	ThinMetaPlan_queue(&plan, 1, 12 * DATA_BLOCK);
+	const uint32_t devices[3] = { 1, 2, 1 };
+	int rc = FiesDMThin_mapDevices(dmthin, devices, 3,
+	                               ThinMetaPlan_extent, &plan);
+	EQZ((size_t)rc, 0);
+	if (rc == 0)
+		rc = ThinMetaPlan_resolve(&plan, "pool");
+	EQZ((size_t)rc, 0);
+
+	ThinMetaPlanned *vol;
+	size_t lengths[3] = { 2, 3, 2 }, i = 0;
+	Vector_foreach(&plan, vol)
+		EQZ(Vector_length(&vol->extents), lengths[i++]);
+
+	checkExtent(&plan, 0, 0, FIES_FL_DATA, 0, 4, 100);
+	checkExtent(&plan, 0, 1, FIES_FL_DATA, 8, 2, 108);
+	// the data blocks shared via another leaf
+	checkExtent(&plan, 1, 0, FIES_FL_DATA, 0, 1, 200);
+	checkExtent(&plan, 1, 1, FIES_FL_COPY, 1, 2, 1);
+	// the shared last subtree only up to what device 1 maps
+	checkExtent(&plan, 1, 2, FIES_FL_COPY, 8, 2, 8);
+	// the whole tree is shared, with holes where device 1 has them
+	checkExtent(&plan, 2, 0, FIES_FL_COPY, 0, 4, 0);
+	checkExtent(&plan, 2, 1, FIES_FL_COPY, 8, 2, 8);
+
+	Vector_destroy(&plan);
+	FiesDMThin_delete(dmthin);
+	printf("%zu of %zu tests failed\n", failed, count);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../lib/util.h"
+#include "../include/fies.h"
+#include "../include/fies/dmthin.h"
+#include "dmthin_image.h"
+
+// Maps a device through a metadata snapshot whose superblock copy has its
+// space map roots zeroed, like the kernel leaves it, and checks that the
+// reference counts are still found via the live superblock.
+
+#define BLOCK_SIZE  DMTHIN_BLOCK_SIZE
+#define BLOCK_COUNT 10
+#define DATA_BLOCK  DMTHIN_DATA_BLOCK
+
+enum {
+	LIVE_SUPER = 0,
+	SNAP_SUPER,
+	DATA_INDEX,
+	DATA_BITMAP,
+	META_INDEX,
+	META_BITMAP,
+	TOP_NODE,
+	DEVICE_NODE,
+};
+
+#define EQZ(X, Y) do { \
+	++count; \
+	size_t x = (X); \
+	size_t y = (Y); \
+	if (x != y) { \
+		++failed; \
+		fprintf(stderr, "Assertion (%s) failed: %zu != %zu\n", \
+		        #X " == " #Y, x, y); \
+	} \
+} while (0)
+
+static uint8_t image[BLOCK_COUNT][BLOCK_SIZE];
+
+static const void*
+getBlock(void *opaque, size_t block_number)
+{
+	(void)opaque;
+	return block_number < BLOCK_COUNT ? image[block_number] : NULL;
+}
+
+static void
+putBlock(void *opaque, const void *block)
+{
+	(void)opaque;
+	(void)block;
+}
+
+static void
+makeSuper(size_t block, bool with_space_maps)
+{
+	dmthin_super(image[block], block, TOP_NODE);
+	struct thin_superblock *super = (void*)image[block];
+	super->metasnap_root = FIES_LE((uint64_t)(block ? 0 : SNAP_SUPER));
+	if (with_space_maps) {
+		struct thin_space_map_root root = {
+			.nr_blocks = FIES_LE((uint64_t)64),
+			.bitmap_root = FIES_LE((uint64_t)DATA_INDEX),
+		};
+		memcpy(super->data_spacemap_root, &root, sizeof(root));
+		root.nr_blocks = FIES_LE((uint64_t)BLOCK_COUNT);
+		root.bitmap_root = FIES_LE((uint64_t)META_INDEX);
+		memcpy(super->metadata_spacemap_root, &root, sizeof(root));
+	}
+	dmthin_checksum(image[block], THIN_SUPER_CSUM_XOR);
+}
+
+// Device 1 maps its first 3 blocks to data blocks 10 to 12, which are
+// referenced 1, 2 and 1 times.
+static void
+makeImage(void)
+{
+	makeSuper(LIVE_SUPER, true);
+	makeSuper(SNAP_SUPER, false);
+
+	const uint64_t index_key = 0;
+	struct thin_index_entry entry = {
+		.blocknr = FIES_LE((uint64_t)DATA_BITMAP),
+	};
+	dmthin_node(image[DATA_INDEX], DATA_INDEX, LEAF_NODE,
+	            &index_key, &entry, 1, sizeof(entry));
+	const uint8_t data_counts[13] = { [10] = 1, [11] = 2, [12] = 1 };
+	dmthin_bitmap(image[DATA_BITMAP], DATA_BITMAP,
+	              data_counts, sizeof(data_counts));
+
+	struct thin_metadata_index *mi = (void*)image[META_INDEX];
+	mi->blocknr = FIES_LE((uint64_t)META_INDEX);
+	mi->index[0].blocknr = FIES_LE((uint64_t)META_BITMAP);
+	dmthin_checksum(image[META_INDEX], THIN_INDEX_CSUM_XOR);
+	uint8_t meta_counts[BLOCK_COUNT];
+	memset(meta_counts, 1, sizeof(meta_counts));
+	dmthin_bitmap(image[META_BITMAP], META_BITMAP,
+	              meta_counts, sizeof(meta_counts));
+
+	const uint64_t device = 1;
+	const uint64_t device_root = DEVICE_NODE;
+	dmthin_blockNode(image[TOP_NODE], TOP_NODE, LEAF_NODE,
+	                 &device, &device_root, 1);
+	const uint64_t logical[3] = { 0, 1, 2 };
+	const uint64_t data[3] = { 10, 11, 12 };
+	dmthin_dataLeaf(image[DEVICE_NODE], DEVICE_NODE, logical, data, 3);
+}
+
+int
+main(void)
+{
+	size_t count = 0, failed = 0;
+
+	makeImage();
+	struct FiesDMThin *dmthin =
+		FiesDMThin_new(NULL, sizeof(image), BLOCK_SIZE,
+		               getBlock, putBlock);
+	if (!dmthin) {
+		perror("FiesDMThin_new");
+		return 1;
+	}
+	EQZ(dmthin->snap_root, SNAP_SUPER);
+
+	struct FiesDMThin_Extent extents[4];
+	ssize_t got = FiesDMThin_queryExtents(dmthin, 1, 0, 3 * DATA_BLOCK,
+	                                      FIES_DMTHIN_QUERY_REFCOUNTS,
+	                                      extents, 4);
+	EQZ((size_t)got, 3);
+	if (got == 3) {
+		EQZ(extents[0].physical, 10 * DATA_BLOCK);
+		EQZ(extents[0].refcount, 1);
+		EQZ(extents[0].flags & FIES_FL_SHARED, 0);
+		EQZ(extents[1].refcount, 2);
+		EQZ(extents[1].flags & FIES_FL_SHARED, FIES_FL_SHARED);
+		EQZ(extents[2].refcount, 1);
+		EQZ(extents[2].flags & FIES_FL_SHARED, 0);
+	}
+
+	FiesDMThin_delete(dmthin);
+	printf("%zu of %zu tests failed\n", failed, count);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/vector.h"
+#include "../src/cli_common.h"
+#include "../src/filematch.h"
+#include "../src/util.h"
+
+// Compares the compiled FileMatchSet against matching every pattern one by
+// one, the way `fies create` checks --exclude patterns against each tail of a
+// path.
+
+#define PATTERN_COUNT 300
+#define PATH_COUNT    50000
+
+static bool
+linear_matches(Vector *vec, const char *path, mode_t mode)
+{
+	FileMatch *it;
+	Vector_foreach(vec, it) {
+		const char *part;
+		size_t pi = strlen(path);
+		while ( (part = next_tail_component(path, &pi)) ) {
+			if (FileMatch_matches(it, part, mode))
+				return true;
+		}
+	}
+	return false;
+}
+
+static bool
+set_matches(FileMatchSet *set, const char *path, mode_t mode)
+{
+	const char *part;
+	size_t pi = strlen(path);
+	while ( (part = next_tail_component(path, &pi)) ) {
+		if (FileMatchSet_matches(set, part, mode))
+			return true;
+	}
+	return false;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// With --check only the results are compared, which is what the test suite
+// runs.
+int
+main(int argc, char **argv)
+{
+	const bool timed = !(argc > 1 && !strcmp(argv[1], "--check"));
+
+	static char globs[PATTERN_COUNT][64];
+	VectorOf(FileMatch) patterns;
+	Vector_init_type(&patterns, FileMatch);
+	Vector_set_destructor(&patterns, (Vector_dtor*)FileMatch_destroy);
+	for (unsigned i = 0; i != PATTERN_COUNT; ++i) {
+		int flags = 0;
+		switch (i % 6) {
+		case 0: snprintf(globs[i], sizeof(globs[i]), "file%u.c", i);
+			break;
+		case 1: snprintf(globs[i], sizeof(globs[i]), "*.ext%u", i);
+			break;
+		case 2: snprintf(globs[i], sizeof(globs[i]), "tmp%u*", i);
+			break;
+		case 3: snprintf(globs[i], sizeof(globs[i]), "dir%u/sub1", i);
+			break;
+		case 4: snprintf(globs[i], sizeof(globs[i]), "*%u/file7.o", i);
+			flags = FMATCH_WILDCARD_SLASH;
+			break;
+		default:
+			snprintf(globs[i], sizeof(globs[i]), "f?le%u.[ch]", i);
+			break;
+		}
+		FileMatch entry = {
+			.flags = flags | (i % 50 == 7 ? FMATCH_F_DIR : 0),
+			.glob = globs[i]
+		};
+		Vector_push(&patterns, &entry);
+	}
+	if (!handle_file_re_opt("/^cache[0-9]+$/", &patterns, "bench"))
+		return 1;
+
+	FileMatchSet set;
+	FileMatchSet_init(&set);
+	FileMatchSet_compile(&set, &patterns);
+
+	char (*paths)[96] = malloc(PATH_COUNT * sizeof(*paths));
+	if (!paths)
+		return 1;
+	srand(1);
+	for (unsigned i = 0; i != PATH_COUNT; ++i) {
+		unsigned a = (unsigned)rand() % 400;
+		unsigned b = (unsigned)rand() % 400;
+		static const char *const ext[] = { "c", "h", "o", "ext" };
+		snprintf(paths[i], sizeof(paths[i]), "dir%u/%s%u/file%u.%s%u",
+		         a, i % 3 ? "sub" : "tmp", b % 20, b,
+		         ext[i % 4], i % 4 == 3 ? b : 0);
+		if (i % 97 == 0)
+			snprintf(paths[i], sizeof(paths[i]), "cache%u", a);
+	}
+
+	unsigned long hits_linear = 0, hits_set = 0, mismatches = 0;
+	for (unsigned i = 0; i != PATH_COUNT; ++i) {
+		mode_t mode = i % 5 ? S_IFREG : S_IFDIR;
+		bool linear = linear_matches(&patterns, paths[i], mode);
+		bool compiled = set_matches(&set, paths[i], mode);
+		hits_linear += linear;
+		hits_set += compiled;
+		if (linear != compiled && !mismatches++)
+			fprintf(stderr, "mismatch: %s\n", paths[i]);
+	}
+	printf("%u patterns, %u paths, %lu matches\n",
+	       PATTERN_COUNT+1, PATH_COUNT, hits_linear);
+
+	if (timed) {
+		double t0 = now();
+		for (unsigned i = 0; i != PATH_COUNT; ++i) {
+			mode_t mode = i % 5 ? S_IFREG : S_IFDIR;
+			(void)linear_matches(&patterns, paths[i], mode);
+		}
+		double t1 = now();
+		for (unsigned i = 0; i != PATH_COUNT; ++i) {
+			mode_t mode = i % 5 ? S_IFREG : S_IFDIR;
+			(void)set_matches(&set, paths[i], mode);
+		}
+		double t2 = now();
+		printf("linear: %.3fs\n", t1 - t0);
+		printf("set:    %.3fs\n", t2 - t1);
+	}
+
+	free(paths);
+	FileMatchSet_destroy(&set);
+	Vector_destroy(&patterns);
+	return (mismatches || hits_linear != hits_set) ? 1 : 0;
+}
@@ -51,6 +51,28 @@ MemReader::create(const char *filename,
 	return 0;
 }
 
+int
+MemReader::reference(const char *filename,
+                     fies_sz     filesize,
+                     uint32_t    mode,
+                     void      **out_fh)
+{
+	auto ex = expected_refs_.find(filename);
+	if (ex == expected_refs_.end()) {
+		err("unexpected reference file: %s\n", filename);
+		*out_fh = nullptr;
+		return 0;
+	}
+	*out_fh = ex->second.get();
+	if (ex->second->size_ != filesize) {
+		err("reference file %s of unexpected size "
+		    "0x%" PRI_X_FIES_POS " (!= 0x%" PRI_X_FIES_POS ")\n",
+		    filename, filesize, ex->second->size_);
+	}
+	(void)mode;
+	return 0;
+}
+
 fies_ssz
 MemReader::pwrite(void *pfh,
                   const void *data,
@@ -82,6 +104,13 @@ MemReader::close(void *pfh)
 	return rc;
 }
 
+int
+MemReader::unlink(const char *filename)
+{
+	unlinked_.emplace_back(filename);
+	return 0;
+}
+
 int
 MemReader::fileDone(void *pfh)
 {
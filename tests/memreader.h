@@ -18,6 +18,10 @@ struct MemReader : Reader {
 	                  fies_sz     filesize,
 	                  uint32_t    mode,
 	                  void      **out_fh) override;
+	int      reference(const char *filename,
+	                   fies_sz     filesize,
+	                   uint32_t    mode,
+	                   void      **out_fh) override;
 	int      close   (void *fh) override;
 	fies_ssz pwrite  (void *fh,
 	                  const void *data,
@@ -29,18 +33,22 @@ struct MemReader : Reader {
 	                  fies_pos src_offset,
 	                  fies_sz  length) override;
 	int      fileDone(void *fh) override;
+	int      unlink  (const char *filename) override;
 
 	size_t remaining() const;
 	const uint8_t *data() const;
 
 	void expectFile(uniq<CheckFile>);
 	void expectFile(CheckFile*); // screw make_unique
+	void expectReference(CheckFile*);
 
 	const uint8_t *data_;
 	size_t length_;
 	size_t pos_ = 0;
 
 	map<string, uniq<CheckFile>> expected_files_;
+	map<string, uniq<CheckFile>> expected_refs_;
+	vector<string> unlinked_;
 };
 #pragma clang diagnostic pop
 
@@ -68,4 +76,10 @@ MemReader::expectFile(CheckFile *file)
 	return expectFile(uniq<CheckFile>{file});
 }
 
+inline void
+MemReader::expectReference(CheckFile *file)
+{
+	expected_refs_.emplace(file->name_, uniq<CheckFile>{file});
+}
+
 #endif
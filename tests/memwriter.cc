@@ -8,6 +8,13 @@ MemWriter::MemWriter()
 	createDefault();
 }
 
+MemWriter::MemWriter(uint32_t flags)
+	: Writer(nullptr)
+{
+	self_ = FiesWriter_newFull(&cppwriter_funcs, reinter<void*>(this),
+	                           flags);
+}
+
 MemWriter::~MemWriter()
 {
 }
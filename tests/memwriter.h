@@ -7,6 +7,7 @@
 #pragma clang diagnostic ignored "-Wpadded"
 struct MemWriter : Writer {
 	MemWriter();
+	explicit MemWriter(uint32_t flags);
 	~MemWriter() override;
 	ssize_t writev(const struct iovec *iov, size_t cnt) override;
 	vector<uint8_t> data_;
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "../lib/vector.h"
+#include "../src/fies_regex.h"
+
+// Checks --xform rules against regexec() results, in particular where the
+// required literal prefilter has to see through bracket expressions.
+
+static size_t count = 0, failed = 0;
+
+static void
+check(const char *rule, const char *text, const char *expected)
+{
+	++count;
+	char *errstr = NULL;
+	RexReplace *xform = RexReplace_new(rule, &errstr);
+	if (!xform) {
+		++failed;
+		fprintf(stderr, "%s: %s\n", rule, errstr ? errstr : "error");
+		free(errstr);
+		return;
+	}
+	VectorOf(RexReplace*) rules;
+	Vector_init_type(&rules, RexReplace*);
+	Vector_set_destructor(&rules, (Vector_dtor*)RexReplace_pdestroy);
+	Vector_push(&rules, &xform);
+	char *result = apply_xform_vec(text, &rules);
+	if (!result || strcmp(result, expected)) {
+		++failed;
+		fprintf(stderr, "%s on `%s`: `%s` != `%s`\n", rule, text,
+		        result ? result : "(null)", expected);
+	}
+	free(result);
+	Vector_destroy(&rules);
+}
+
+int
+main(void)
+{
+	check("/abc/X/", "xabcx", "xXx");
+	check("/abc/X/", "xabx", "xabx");
+	// the class's own ']' does not end the bracket expression
+	check("/[[:digit:]]x/Y/", "q5xw", "qYw");
+	check("/a[[:alpha:]]b/Z/", "aqbc", "Zc");
+	check("/[[.-.]]x/Y/", "a-xb", "aYb");
+	check("/[[=e=]]x/Y/", "aexb", "aYb");
+	check("/[]a]x/Y/", "q]xw", "qYw");
+	check("/[^]a]x/Y/", "qbxw", "qYw");
+	xform_cleanup();
+
+	printf("%zu of %zu tests failed\n", failed, count);
+	return failed ? 1 : 0;
+}
@@ -155,10 +155,293 @@ t_filelist_1()
 	ASSERT(!data.files.size());
 }
 
+// With FIES_F_ALLOC_HINTS the data ranges of a file are announced before
+// its extents.
+static void
+t_alloc_hint()
+{
+	MemWriter mwr(FIES_F_DEFAULT_FLAGS | FIES_F_ALLOC_HINTS);
+	ASSERT(mwr);
+	auto dev0 = FiesWriter_newDevice(mwr);
+
+	auto D1 = PhyExt { 0x001000, 0x1000, "d"_exfl };
+	auto D2 = PhyExt { 0x00A000, 0x1000, "d"_exfl };
+	auto Z1 = PhyExt { 0x003000, 0x1000, "z"_exfl };
+	auto D3 = PhyExt { 0x004000, 0x2000, "d"_exfl };
+
+	// The extents mapped for the hint are reused for the data.
+	TestFile tf { "/f1", 0x5000, {
+		{ extent(0x0000, D1), 1, 1 },
+		{ extent(0x1000, D2), 1, 1 },
+		{ extent(0x2000, Z1), 1, 0 },
+		{ extent(0x3000, D3), 1, 1 },
+	} };
+	auto f = newFiesFile(&tf, tf.c_name(), tf.size_, 0644_freg, dev0);
+	ASSERT(f);
+	fieserr(mwr, FiesWriter_writeFile(mwr, f.get()));
+	tf.done();
+
+	struct AllocReader : MemReader {
+		AllocReader(MemWriter& writer) : MemReader(writer) {}
+
+		int preallocate(void *fh, fies_sz data_size,
+		                const struct fies_alloc_range *ranges,
+		                size_t count) override
+		{
+			CK(fh);
+			data_size_ = data_size;
+			ranges_.assign(ranges, ranges + count);
+			++calls_;
+			return 0;
+		}
+
+		fies_ssz pwrite(void *fh, const void *data, fies_sz count,
+		                fies_pos offset) override
+		{
+			CK(calls_ == 1);
+			return MemReader::pwrite(fh, data, count, offset);
+		}
+
+		size_t calls_ = 0;
+		fies_sz data_size_ = 0;
+		vector<struct fies_alloc_range> ranges_;
+	};
+
+	AllocReader ard(mwr);
+	ASSERT(ard);
+	auto ck = new CheckFile { "/f1", 0x5000, 0644_freg, {
+		{ 0x0000, 0x1000, DataClass::PosData, 1 },
+		{ 0x1000, 0x1000, DataClass::PosData, 1 },
+		{ 0x2000, 0x1000, DataClass::Zero,    1 },
+		{ 0x3000, 0x2000, DataClass::PosData, 1 },
+	} };
+	ard.expectFile(ck);
+	if (!ard.readAll())
+		err("reading failed");
+	ck->done();
+	CK(ard.calls_ == 1);
+	CK(ard.data_size_ == 0x4000);
+	CK(ard.ranges_.size() == 2);
+	if (ard.ranges_.size() == 2) {
+		CK(ard.ranges_[0].offset == 0x0000);
+		CK(ard.ranges_[0].length == 0x2000);
+		CK(ard.ranges_[1].offset == 0x3000);
+		CK(ard.ranges_[1].length == 0x2000);
+	}
+
+	// Ranges past FIES_ALLOC_MAX_RANGES are left out of the hint, and of
+	// its data size.
+	MemWriter mwr2(FIES_F_DEFAULT_FLAGS | FIES_F_ALLOC_HINTS);
+	ASSERT(mwr2);
+	auto dev1 = FiesWriter_newDevice(mwr2);
+	const size_t n = FIES_ALLOC_MAX_RANGES + 4;
+	TestFile tf2 { "/f2", n * 0x2000, {} };
+	auto ck2 = new CheckFile { "/f2", n * 0x2000, 0644_freg, {} };
+	for (size_t i = 0; i != n; ++i) {
+		const fies_pos at = i * 0x2000;
+		tf2.extents_.emplace_back(extent(at, at, 0x1000, "d"_exfl),
+		                          1, 1);
+		tf2.extents_.emplace_back(extent(at + 0x1000, 0, 0x1000,
+		                                 "z"_exfl),
+		                          1, 0);
+		ck2->ranges_.push_back({ at, 0x1000, DataClass::PosData, 1 });
+		ck2->ranges_.push_back({ at + 0x1000, 0x1000,
+		                         DataClass::Zero, 1 });
+	}
+	f = newFiesFile(&tf2, tf2.c_name(), tf2.size_, 0644_freg, dev1);
+	ASSERT(f);
+	fieserr(mwr2, FiesWriter_writeFile(mwr2, f.get()));
+	tf2.done();
+
+	AllocReader ard2(mwr2);
+	ASSERT(ard2);
+	ard2.expectFile(ck2);
+	if (!ard2.readAll())
+		err("reading failed");
+	ck2->done();
+	CK(ard2.calls_ == 1);
+	CK(ard2.ranges_.size() == FIES_ALLOC_MAX_RANGES);
+	CK(ard2.data_size_ == FIES_ALLOC_MAX_RANGES * 0x1000);
+	if (ard2.ranges_.size() == FIES_ALLOC_MAX_RANGES) {
+		CK(ard2.ranges_.back().offset
+		   == (FIES_ALLOC_MAX_RANGES - 1) * 0x2000);
+		CK(ard2.ranges_.back().length == 0x1000);
+	}
+}
+
+// An update to a previous stream, as `fies c --manifest` sends it: the old
+// version of a modified file is a reference to clone unchanged extents from,
+// and removed files are unlinked.
+static void
+t_incremental()
+{
+	MemWriter mwr;
+	ASSERT(mwr);
+	auto dev0 = FiesWriter_newDevice(mwr);
+
+	auto SA = PhyExt { 0x20A000, 0x1000, "ds"_exfl };
+	auto SB = PhyExt { 0x20B000, 0x1000, "ds"_exfl };
+	auto SC = PhyExt { 0x20C000, 0x1000, "ds"_exfl };
+	auto D1 = PhyExt { 0x001000, 0x1000, "d"_exfl };
+
+	TestFile old { "/f1", 0x3000, {
+		{ extent(0x0000, SA), 1, 0 },
+		{ extent(0x1000, SB), 1, 0 },
+		{ extent(0x2000, SC), 1, 0 },
+	} };
+	auto ref = newFiesFile(&old, old.c_name(), old.size_, 0644_freg, dev0);
+	ASSERT(ref);
+	fieserr(mwr, FiesWriter_readRefFile(mwr, ref.get()));
+	old.done();
+
+	TestFile cur { "/f1", 0x3000, {
+		{ extent(0x0000, SA), 1, 0 },
+		{ extent(0x1000, D1), 1, 1 },
+		{ extent(0x2000, SC), 1, 0 },
+	} };
+	auto f = newFiesFile(&cur, cur.c_name(), cur.size_, 0644_freg, dev0);
+	ASSERT(f);
+	fieserr(mwr, FiesWriter_writeFile(mwr, f.get()));
+	cur.done();
+
+	fieserr(mwr, FiesWriter_unlink(mwr, "/gone"));
+
+	MemReader mrd(mwr);
+	ASSERT(mrd);
+	auto ck_ref = new CheckFile { "/f1", 0x3000, 0644_freg, {
+		{ 0x0000, 0x3000, DataClass::Ignore, 0 },
+	} };
+	auto ck = new CheckFile { "/f1", 0x3000, 0644_freg, {
+		{ 0x0000, 0x1000, DataClass::Cloned,  1 },
+		{ 0x1000, 0x1000, DataClass::PosData, 1 },
+		{ 0x2000, 0x1000, DataClass::Cloned,  1 },
+	} };
+	mrd.expectReference(ck_ref);
+	mrd.expectFile(ck);
+	if (!mrd.readAll())
+		err("reading failed");
+	ck->done();
+	CK(mrd.unlinked_.size() == 1 && mrd.unlinked_[0] == "/gone");
+}
+
+// Positional data as TestFile produces it, with some blocks altered.
+struct ChangedFile : TestFile {
+	using TestFile::TestFile;
+
+	static void content(uint8_t *out, fies_pos offset, size_t length) {
+		for (size_t i = 0; i != length; i += sizeof(fies_pos)) {
+			fies_pos value = offset + i;
+			::memcpy(out + i, &value, sizeof(value));
+		}
+	}
+
+	bool isChanged(fies_pos offset) const {
+		for (auto block : changed_) {
+			if (offset >= block && offset < block + 0x1000)
+				return true;
+		}
+		return false;
+	}
+
+	void alter(uint8_t *out, fies_pos offset, size_t length) const {
+		for (size_t i = 0; i != length; ++i) {
+			if (isChanged(offset + i))
+				out[i] ^= 0x5A;
+		}
+	}
+
+	ssize_t preadp(void *buffer, size_t length, fies_pos offset,
+	               fies_pos physical) override
+	{
+		auto rc = TestFile::preadp(buffer, length, offset, physical);
+		alter(reinter<uint8_t*>(buffer), offset, length);
+		return rc;
+	}
+
+	vector<fies_pos> changed_;
+};
+
+// A copy of a reference file with a few changed blocks, without shared
+// extents, only has the changed blocks sent as data in delta mode.
+static void
+t_delta()
+{
+	MemWriter mwr;
+	ASSERT(mwr);
+	auto dev0 = FiesWriter_newDevice(mwr);
+	fieserr(mwr, FiesWriter_setDelta(mwr, 0x1000, 0));
+
+	auto D1 = PhyExt { 0x100000, 0x8000, "d"_exfl };
+	auto D2 = PhyExt { 0x200000, 0x8000, "d"_exfl };
+
+	ChangedFile reffile { "/ref", 0x8000, { { extent(0x0000, D1), 1, 1 } } };
+	auto ref = newFiesFile(&reffile, reffile.c_name(), reffile.size_,
+	                       0644_freg, dev0);
+	ASSERT(ref);
+	// The writer owns delta reference files.
+	fieserr(mwr, FiesWriter_readDeltaRefFile(mwr, ref.release()));
+
+	ChangedFile copy { "/copy", 0x8000, { { extent(0x0000, D2), 1, 1 } } };
+	copy.changed_ = { 0x2000, 0x5000 };
+	auto f = newFiesFile(&copy, copy.c_name(), copy.size_, 0644_freg,
+	                     dev0);
+	ASSERT(f);
+	fieserr(mwr, FiesWriter_writeFile(mwr, f.get()));
+	copy.done();
+
+	struct DeltaReader : MemReader {
+		vector<uint8_t> out_ = vector<uint8_t>(0x8000);
+		CheckFile *copy_ = nullptr;
+		DeltaReader(MemWriter& writer) : MemReader(writer) {}
+
+		fies_ssz pwrite(void *fh, const void *data, fies_sz count,
+		                fies_pos offset) override
+		{
+			ASSERT(fh == copy_ && offset + count <= out_.size());
+			if (data)
+				::memcpy(&out_[offset], data, count);
+			return MemReader::pwrite(fh, data, count, offset);
+		}
+
+		int clone(void *dst, fies_pos dstoff, void *src,
+		          fies_pos srcoff, fies_sz len) override
+		{
+			ASSERT(dst == copy_ && dstoff + len <= out_.size());
+			ChangedFile::content(&out_[dstoff], srcoff, len);
+			return MemReader::clone(dst, dstoff, src, srcoff, len);
+		}
+	};
+
+	DeltaReader drd(mwr);
+	ASSERT(drd);
+	drd.expectReference(new CheckFile { "/ref", 0x8000, 0644_freg, {
+		{ 0x0000, 0x8000, DataClass::Ignore, 0 },
+	} });
+	drd.copy_ = new CheckFile { "/copy", 0x8000, 0644_freg, {
+		{ 0x0000, 0x2000, DataClass::Cloned, 1 },
+		{ 0x2000, 0x1000, DataClass::Ignore, 1 },
+		{ 0x3000, 0x2000, DataClass::Cloned, 1 },
+		{ 0x5000, 0x1000, DataClass::Ignore, 1 },
+		{ 0x6000, 0x2000, DataClass::Cloned, 1 },
+	} };
+	drd.expectFile(drd.copy_);
+	if (!drd.readAll())
+		err("reading failed");
+	drd.copy_->done();
+
+	vector<uint8_t> expected(0x8000);
+	ChangedFile::content(expected.data(), 0, expected.size());
+	copy.alter(expected.data(), 0, expected.size());
+	CK(drd.out_ == expected);
+}
+
 int
 main()
 {
 	t1();
 	t_filelist_1();
+	t_alloc_hint();
+	t_incremental();
+	t_delta();
 	return test_errors == 0 ? 0 : 1;
 }